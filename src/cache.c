@@ -0,0 +1,408 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+
+#include "common.h"
+#include "prototypes.h"
+
+#ifdef USE_SHM_CACHE
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#define SHM_SHARDS 16 /* independently locked parts of the cache */
+#define SHM_VAL_LEN 2048 /* longest DER-encoded session to be cached */
+
+typedef struct {
+    time_t expire;
+    int lru_prev, lru_next; /* LRU list, -1 terminated */
+    int hash_next; /* bucket chain or free list, -1 terminated */
+    unsigned int key_len, val_len;
+    unsigned char key[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned char val[SHM_VAL_LEN];
+} SHM_ENTRY;
+
+typedef struct {
+    pthread_mutex_t lock; /* robust mutex shared between processes */
+    int lru_head, lru_tail; /* the most and the least recently used entry */
+    int free_head; /* released entries */
+    int unused; /* entries never used, to avoid touching untouched pages */
+    unsigned long hits, misses, expired, evicted;
+} SHM_SHARD;
+
+struct shm_cache_struct { /* the beginning of the shared memory segment */
+    size_t size; /* total size of the segment */
+    size_t entry_offset; /* offset of the first entry */
+    unsigned long seed; /* hash function seed */
+    int entries, buckets; /* per shard */
+    SHM_SHARD shard[SHM_SHARDS];
+    /* followed by int bucket[SHM_SHARDS][buckets] */
+    /* followed by SHM_ENTRY entry[SHM_SHARDS][entries] */
+};
+
+typedef struct shm_segment_struct { /* a segment of a service */
+    struct shm_segment_struct *next;
+    char *servname; /* sections are never released */
+    int size;
+    SHM_CACHE *cache;
+} SHM_SEGMENT;
+
+#define SHM_BUCKET(c, s) ((int *)((c)+1)+(s)*(c)->buckets)
+#define SHM_ENTRY_TAB(c, s) \
+    ((SHM_ENTRY *)((char *)(c)+(c)->entry_offset)+(s)*(c)->entries)
+
+/**************************************** prototypes */
+
+static SHM_CACHE *shm_cache_map(int);
+static void shard_lock(SHM_CACHE *, int);
+static void shard_unlock(SHM_CACHE *, int);
+static void shard_clear(SHM_CACHE *, int);
+static unsigned long shm_hash(SHM_CACHE *, const unsigned char *,
+    unsigned int);
+static int shm_find(SHM_CACHE *, int, int, const unsigned char *,
+    unsigned int);
+static int shm_alloc(SHM_CACHE *, int);
+static void shm_release(SHM_CACHE *, int, int, int);
+static void lru_unlink(SHM_SHARD *, SHM_ENTRY *, int);
+static void lru_push(SHM_SHARD *, SHM_ENTRY *, int);
+
+/**************************************** cache operations */
+
+static SHM_SEGMENT *shm_segments=NULL; /* only used by the main thread */
+
+/* the segment of a service is reused across configuration reloads */
+SHM_CACHE *shm_cache_create(char *servname, int size) {
+    SHM_SEGMENT *segment;
+
+    for(segment=shm_segments; segment; segment=segment->next)
+        if(!strcmp(segment->servname, servname))
+            break;
+    if(segment && segment->size==size) {
+        s_log(LOG_DEBUG, "Shared session cache reused");
+        return segment->cache;
+    }
+    if(!segment) {
+        segment=calloc(1, sizeof(SHM_SEGMENT));
+        if(!segment) {
+            s_log(LOG_ERR, "Memory allocation failed");
+            return NULL;
+        }
+        segment->servname=servname;
+        segment->next=shm_segments;
+        shm_segments=segment;
+    } else if(segment->cache) { /* resized */
+#ifdef USE_FORK
+        /* the old segment stays mapped in the running child processes */
+        munmap((void *)segment->cache, segment->cache->size);
+#endif
+        /* threads of the old configuration may still use it */
+    }
+    segment->cache=shm_cache_map(size);
+    segment->size=segment->cache ? size : 0;
+    return segment->cache;
+}
+
+/* create a segment shared with the processes forked later */
+static SHM_CACHE *shm_cache_map(int size) {
+    SHM_CACHE *cache;
+    pthread_mutexattr_t attr;
+    int entries, i;
+    size_t entry_offset, total;
+
+    entries=(size+SHM_SHARDS-1)/SHM_SHARDS;
+    entry_offset=sizeof(SHM_CACHE)+(size_t)SHM_SHARDS*entries*sizeof(int);
+    entry_offset=(entry_offset+15)&~(size_t)15; /* align */
+    total=entry_offset+(size_t)SHM_SHARDS*entries*sizeof(SHM_ENTRY);
+    cache=mmap(NULL, total, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(cache==MAP_FAILED) {
+        ioerror("mmap");
+        return NULL;
+    }
+    /* anonymous mappings are zero-filled */
+    cache->size=total;
+    cache->entry_offset=entry_offset;
+    cache->entries=cache->buckets=entries;
+    RAND_bytes((unsigned char *)&cache->seed, sizeof cache->seed);
+    /* a process killed with a shard locked must not block the others */
+    if(pthread_mutexattr_init(&attr) ||
+            pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) ||
+            pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) {
+        s_log(LOG_ERR, "Shared session cache: Robust mutexes not supported");
+        munmap((void *)cache, total);
+        return NULL;
+    }
+    for(i=0; i<SHM_SHARDS; ++i) {
+        if(pthread_mutex_init(&cache->shard[i].lock, &attr)) {
+            s_log(LOG_ERR, "Shared session cache: pthread_mutex_init failed");
+            while(--i>=0)
+                pthread_mutex_destroy(&cache->shard[i].lock);
+            pthread_mutexattr_destroy(&attr);
+            munmap((void *)cache, total);
+            return NULL;
+        }
+        shard_clear(cache, i);
+    }
+    pthread_mutexattr_destroy(&attr);
+    s_log(LOG_DEBUG, "Shared session cache: %d entries, %lu bytes",
+        SHM_SHARDS*entries, (unsigned long)total);
+    return cache;
+}
+
+void shm_cache_new(SHM_CACHE *cache,
+        const unsigned char *key, unsigned int key_len,
+        const unsigned char *val, unsigned int val_len, long timeout) {
+    unsigned long hash;
+    int s, b, i;
+    SHM_ENTRY *entry;
+    time_t now;
+
+    if(key_len>SSL_MAX_SSL_SESSION_ID_LENGTH || val_len>SHM_VAL_LEN) {
+        s_log(LOG_DEBUG, "shm_cache_new: session too big (%u bytes)",
+            val_len);
+        return;
+    }
+    time(&now);
+    hash=shm_hash(cache, key, key_len);
+    s=hash%SHM_SHARDS;
+    b=(hash/SHM_SHARDS)%cache->buckets;
+    shard_lock(cache, s);
+    i=shm_find(cache, s, b, key, key_len);
+    if(i<0) { /* not found: allocate a new entry */
+        i=shm_alloc(cache, s);
+        entry=SHM_ENTRY_TAB(cache, s)+i;
+        entry->key_len=key_len;
+        memcpy(entry->key, key, key_len);
+        entry->hash_next=SHM_BUCKET(cache, s)[b];
+        SHM_BUCKET(cache, s)[b]=i;
+    } else {
+        entry=SHM_ENTRY_TAB(cache, s)+i;
+        lru_unlink(cache->shard+s, SHM_ENTRY_TAB(cache, s), i);
+    }
+    entry->expire=now+timeout;
+    entry->val_len=val_len;
+    memcpy(entry->val, val, val_len);
+    lru_push(cache->shard+s, SHM_ENTRY_TAB(cache, s), i);
+    shard_unlock(cache, s);
+}
+
+/* returns a str_alloc()ed copy of the session or NULL */
+unsigned char *shm_cache_get(SHM_CACHE *cache,
+        const unsigned char *key, unsigned int key_len,
+        unsigned int *val_len) {
+    unsigned long hash;
+    int s, b, i;
+    SHM_ENTRY *entry;
+    unsigned char *val;
+    time_t now;
+
+    if(key_len>SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+    val=str_alloc(SHM_VAL_LEN); /* not to allocate with the lock held */
+    if(!val)
+        return NULL;
+    time(&now);
+    hash=shm_hash(cache, key, key_len);
+    s=hash%SHM_SHARDS;
+    b=(hash/SHM_SHARDS)%cache->buckets;
+    shard_lock(cache, s);
+    i=shm_find(cache, s, b, key, key_len);
+    if(i<0) {
+        ++cache->shard[s].misses;
+        shard_unlock(cache, s);
+        str_free(val);
+        return NULL;
+    }
+    entry=SHM_ENTRY_TAB(cache, s)+i;
+    if(entry->expire<now) {
+        ++cache->shard[s].expired;
+        shm_release(cache, s, b, i);
+        shard_unlock(cache, s);
+        str_free(val);
+        return NULL;
+    }
+    ++cache->shard[s].hits;
+    *val_len=entry->val_len;
+    memcpy(val, entry->val, entry->val_len);
+    lru_unlink(cache->shard+s, SHM_ENTRY_TAB(cache, s), i);
+    lru_push(cache->shard+s, SHM_ENTRY_TAB(cache, s), i);
+    shard_unlock(cache, s);
+    return val;
+}
+
+void shm_cache_remove(SHM_CACHE *cache,
+        const unsigned char *key, unsigned int key_len) {
+    unsigned long hash;
+    int s, b, i;
+
+    if(key_len>SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return;
+    hash=shm_hash(cache, key, key_len);
+    s=hash%SHM_SHARDS;
+    b=(hash/SHM_SHARDS)%cache->buckets;
+    shard_lock(cache, s);
+    i=shm_find(cache, s, b, key, key_len);
+    if(i>=0)
+        shm_release(cache, s, b, i);
+    shard_unlock(cache, s);
+}
+
+void shm_cache_stats(SHM_CACHE *cache) {
+    unsigned long hits=0, misses=0, expired=0, evicted=0;
+    int i;
+
+    /* the counters are read without locking */
+    for(i=0; i<SHM_SHARDS; ++i) {
+        hits+=cache->shard[i].hits;
+        misses+=cache->shard[i].misses;
+        expired+=cache->shard[i].expired;
+        evicted+=cache->shard[i].evicted;
+    }
+    s_log(LOG_DEBUG, "%4lu shared session cache hits", hits);
+    s_log(LOG_DEBUG, "%4lu shared session cache misses", misses);
+    s_log(LOG_DEBUG, "%4lu shared session cache timeouts", expired);
+    s_log(LOG_DEBUG, "%4lu shared session cache evictions", evicted);
+}
+
+/**************************************** internal functions */
+
+static void shard_lock(SHM_CACHE *cache, int s) {
+    if(pthread_mutex_lock(&cache->shard[s].lock)!=EOWNERDEAD)
+        return;
+    /* the owner died in the middle of an update: start from scratch */
+    s_log(LOG_WARNING,
+        "Shared session cache: Shard %d abandoned by a dead process", s);
+    shard_clear(cache, s);
+    pthread_mutex_consistent(&cache->shard[s].lock);
+}
+
+static void shard_unlock(SHM_CACHE *cache, int s) {
+    pthread_mutex_unlock(&cache->shard[s].lock);
+}
+
+static void shard_clear(SHM_CACHE *cache, int s) {
+    SHM_SHARD *shard=cache->shard+s;
+    int b;
+
+    shard->lru_head=shard->lru_tail=-1;
+    shard->free_head=-1;
+    shard->unused=0;
+    for(b=0; b<cache->buckets; ++b)
+        SHM_BUCKET(cache, s)[b]=-1;
+}
+
+static unsigned long shm_hash(SHM_CACHE *cache,
+        const unsigned char *key, unsigned int key_len) {
+    unsigned long hash=cache->seed; /* session ids may be chosen by peers */
+    unsigned int i;
+
+    for(i=0; i<key_len; ++i) /* FNV-1a */
+        hash=(hash^key[i])*16777619UL;
+    return hash;
+}
+
+static int shm_find(SHM_CACHE *cache, int s, int b,
+        const unsigned char *key, unsigned int key_len) {
+    SHM_ENTRY *tab=SHM_ENTRY_TAB(cache, s);
+    int i;
+
+    for(i=SHM_BUCKET(cache, s)[b]; i>=0; i=tab[i].hash_next)
+        if(tab[i].key_len==key_len && !memcmp(tab[i].key, key, key_len))
+            return i;
+    return -1;
+}
+
+static int shm_alloc(SHM_CACHE *cache, int s) {
+    SHM_SHARD *shard=cache->shard+s;
+    SHM_ENTRY *tab=SHM_ENTRY_TAB(cache, s);
+    int i;
+
+    if(shard->free_head>=0) { /* reuse a released entry */
+        i=shard->free_head;
+        shard->free_head=tab[i].hash_next;
+        return i;
+    }
+    if(shard->unused<cache->entries) /* use a fresh entry */
+        return shard->unused++;
+    /* evict the least recently used entry */
+    i=shard->lru_tail;
+    ++shard->evicted;
+    shm_release(cache, s,
+        (shm_hash(cache, tab[i].key, tab[i].key_len)/SHM_SHARDS)%
+            cache->buckets, i);
+    shard->free_head=tab[i].hash_next; /* take it back from the free list */
+    return i;
+}
+
+static void shm_release(SHM_CACHE *cache, int s, int b, int i) {
+    SHM_SHARD *shard=cache->shard+s;
+    SHM_ENTRY *tab=SHM_ENTRY_TAB(cache, s);
+    int *ptr;
+
+    for(ptr=SHM_BUCKET(cache, s)+b; *ptr!=i; ptr=&tab[*ptr].hash_next)
+        ;
+    *ptr=tab[i].hash_next;
+    lru_unlink(shard, tab, i);
+    tab[i].hash_next=shard->free_head;
+    shard->free_head=i;
+}
+
+static void lru_unlink(SHM_SHARD *shard, SHM_ENTRY *tab, int i) {
+    if(tab[i].lru_prev>=0)
+        tab[tab[i].lru_prev].lru_next=tab[i].lru_next;
+    else
+        shard->lru_head=tab[i].lru_next;
+    if(tab[i].lru_next>=0)
+        tab[tab[i].lru_next].lru_prev=tab[i].lru_prev;
+    else
+        shard->lru_tail=tab[i].lru_prev;
+}
+
+static void lru_push(SHM_SHARD *shard, SHM_ENTRY *tab, int i) {
+    tab[i].lru_prev=-1;
+    tab[i].lru_next=shard->lru_head;
+    if(shard->lru_head>=0)
+        tab[shard->lru_head].lru_prev=i;
+    else
+        shard->lru_tail=i;
+    shard->lru_head=i;
+}
+
+#endif /* USE_SHM_CACHE */
+
+/* end of cache.c */
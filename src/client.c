@@ -59,6 +59,10 @@ static void run_client(CLI *);
 static void init_local(CLI *);
 static void init_remote(CLI *);
 static void init_ssl(CLI *);
+static SSL_SESSION *session_cache_get(CLI *, SOCKADDR_UNION *);
+static void session_cache_put(CLI *, SOCKADDR_UNION *, SSL_SESSION *);
+static CLIENT_CACHE *session_cache_find(SERVICE_OPTIONS *, SOCKADDR_UNION *);
+static void session_cache_remove(CLIENT_CACHE *, SSL_SESSION *);
 static void transfer(CLI *);
 static void parse_socket_error(CLI *, const char *);
 
@@ -71,6 +75,7 @@ static int connect_remote(CLI *);
 static int connect_transparent(CLI *);
 #endif /* SO_ORIGINAL_DST */
 static void local_bind(CLI *c);
+static void source_unavailable(CLI *);
 static void print_bound_address(CLI *);
 static void reset(int, char *);
 
@@ -111,6 +116,10 @@ void *client(void *arg) {
         }
     } else
         run_client(c);
+#ifdef USE_MUX
+    if(c->mux) /* outgoing mux channel */
+        mux_release(c->mux);
+#endif
     /* str_free() cannot be used here, because corresponding
        calloc() is called from a different thread */
     free(c);
@@ -139,6 +148,7 @@ static void run_client(CLI *c) {
     c->fd=-1;
     c->ssl=NULL;
     c->sock_bytes=c->ssl_bytes=0;
+    c->handshake=0;
 
     error=setjmp(c->err);
     if(!error)
@@ -148,6 +158,10 @@ static void run_client(CLI *c) {
         "Connection %s: %d bytes sent to SSL, %d bytes sent to socket",
          error==1 ? "reset" : "closed", c->ssl_bytes, c->sock_bytes);
 
+        /* release the handshake slot left by longjmp() */
+    if(c->handshake)
+        handshake_leave();
+
         /* cleanup temporary (e.g. IDENT) socket */
     if(c->fd>=0)
         closesocket(c->fd);
@@ -191,7 +205,26 @@ static void run_client(CLI *c) {
 }
 
 static void do_client(CLI *c) {
+#ifdef USE_MUX
+    if(c->mux) { /* outgoing mux channel without a local socket */
+        init_remote(c);
+        init_ssl(c);
+        mux_transfer(c);
+        return;
+    }
+#endif
     init_local(c);
+#ifdef USE_MUX
+    if(c->opt->option.mux) {
+        if(c->opt->option.client) {
+            mux_attach(c); /* served by a mux channel thread */
+        } else {
+            init_ssl(c);
+            mux_transfer(c);
+        }
+        return;
+    }
+#endif
     if(!c->opt->option.client && !c->opt->protocol) {
         /* server mode and no protocol negotiation needed */
         init_ssl(c);
@@ -233,7 +266,8 @@ static void init_local(CLI *c) {
         if(set_socket_options(c->local_rfd.fd, 1)<0)
             longjmp(c->err, 1);
 #ifdef USE_LIBWRAP
-        libwrap_auth(c);
+        if(!libwrap_auth(c))
+            longjmp(c->err, 1);
 #endif /* USE_LIBWRAP */
         auth_user(c);
         s_log(LOG_NOTICE, "Service %s accepted connection from %s",
@@ -270,7 +304,9 @@ static void init_remote(CLI *c) {
 
 static void init_ssl(CLI *c) {
     int i, err;
-    SSL_SESSION *old_session;
+    SOCKADDR_UNION dest;
+    socklen_t dest_len;
+    SSL_SESSION *offered=NULL;
 
     if(!(c->ssl=SSL_new(c->opt->ctx))) {
         sslerror("SSL_new");
@@ -289,11 +325,13 @@ static void init_ssl(CLI *c) {
             }
         }
 #endif
-        if(c->opt->session) {
-            enter_critical_section(CRIT_SESSION);
-            SSL_set_session(c->ssl, c->opt->session);
-            leave_critical_section(CRIT_SESSION);
-        }
+        /* the destination only differs between connections with multiple
+         * connect addresses, delayed lookup or transparent destinations */
+        memset(&dest, 0, sizeof dest);
+        dest_len=sizeof dest;
+        if(getpeername(c->remote_fd.fd, &dest.sa, &dest_len))
+            memset(&dest, 0, sizeof dest); /* e.g. exec: share one entry */
+        offered=session_cache_get(c, &dest);
         SSL_set_fd(c->ssl, c->remote_fd.fd);
         SSL_set_connect_state(c->ssl);
     } else {
@@ -319,6 +357,11 @@ static void init_ssl(CLI *c) {
     }
 
     while(1) {
+        /* a handshake slot is only held while computing,
+         * not while waiting for the peer */
+        if(!handshake_enter(c->opt->timeout_busy))
+            longjmp(c->err, 1);
+        c->handshake=1;
 #if OPENSSL_VERSION_NUMBER<0x1000002f
         /* this critical section is a crude workaround for CVE-2010-3864 *
          * see http://www.securityfocus.com/bid/44884 for details        *
@@ -332,6 +375,8 @@ static void init_ssl(CLI *c) {
 #if OPENSSL_VERSION_NUMBER<0x1000002f
         leave_critical_section(CRIT_SSL);
 #endif /* OpenSSL version < 1.0.0b */
+        handshake_leave();
+        c->handshake=0;
         err=SSL_get_error(c->ssl, i);
         if(err==SSL_ERROR_NONE)
             break; /* ok -> done */
@@ -369,24 +414,111 @@ static void init_ssl(CLI *c) {
             sslerror("SSL_accept");
         longjmp(c->err, 1);
     }
+    if(c->opt->option.client)
+        session_cache_put(c, &dest, offered);
     if(SSL_session_reused(c->ssl)) {
         s_log(LOG_INFO, "SSL %s: previous session reused",
             c->opt->option.client ? "connected" : "accepted");
     } else { /* a new session was negotiated */
-        if(c->opt->option.client) {
+        if(c->opt->option.client)
             s_log(LOG_INFO, "SSL connected: new session negotiated");
-            enter_critical_section(CRIT_SESSION);
-            old_session=c->opt->session;
-            c->opt->session=SSL_get1_session(c->ssl); /* store it */
-            if(old_session)
-                SSL_SESSION_free(old_session); /* release the old one */
-            leave_critical_section(CRIT_SESSION);
-        } else
+        else
             s_log(LOG_INFO, "SSL accepted: new session negotiated");
         print_cipher(c);
     }
 }
 
+/****************************** client mode session cache */
+
+    /* offer the most recent session cached for the destination */
+static SSL_SESSION *session_cache_get(CLI *c, SOCKADDR_UNION *dest) {
+    CLIENT_CACHE *entry;
+    SSL_SESSION *session=NULL;
+
+    enter_critical_section(CRIT_SESSION);
+    entry=session_cache_find(c->opt, dest);
+    if(entry && entry->session[0]) {
+        session=entry->session[0];
+        entry->last_used=++c->opt->client_cache_clock;
+        SSL_set_session(c->ssl, session); /* increments the reference count */
+    } else
+        ++c->opt->client_cache_misses;
+    leave_critical_section(CRIT_SESSION);
+    return session; /* only used for comparison in session_cache_put() */
+}
+
+    /* update the destination entry after the handshake */
+static void session_cache_put(CLI *c, SOCKADDR_UNION *dest,
+        SSL_SESSION *offered) {
+    CLIENT_CACHE *entry;
+    SSL_SESSION *session;
+    int i;
+
+    session=SSL_get_session(c->ssl);
+    enter_critical_section(CRIT_SESSION);
+    entry=session_cache_find(c->opt, dest);
+    if(offered) {
+        if(SSL_session_reused(c->ssl)) {
+            ++c->opt->client_cache_hits;
+        } else {
+            ++c->opt->client_cache_stale;
+            if(entry) /* rejected: fall back to the next one */
+                session_cache_remove(entry, offered);
+        }
+    }
+    if(session && (session!=offered || !SSL_session_reused(c->ssl))) {
+            /* a new or a renewed session */
+        if(!entry) { /* replace the least recently used entry */
+            entry=c->opt->client_cache;
+            for(i=1; i<CLIENT_CACHE_DESTS; ++i)
+                if(c->opt->client_cache[i].last_used<entry->last_used)
+                    entry=c->opt->client_cache+i;
+            for(i=0; i<CLIENT_CACHE_SESSIONS; ++i)
+                if(entry->session[i])
+                    SSL_SESSION_free(entry->session[i]);
+            memset(entry, 0, sizeof(CLIENT_CACHE));
+            memcpy(&entry->addr, dest, sizeof(SOCKADDR_UNION));
+        }
+        if(SSL_session_reused(c->ssl) && offered) /* renewed ticket */
+            session_cache_remove(entry, offered);
+        if(entry->session[CLIENT_CACHE_SESSIONS-1])
+            SSL_SESSION_free(entry->session[CLIENT_CACHE_SESSIONS-1]);
+        memmove(entry->session+1, entry->session,
+            (CLIENT_CACHE_SESSIONS-1)*sizeof(SSL_SESSION *));
+        entry->session[0]=SSL_get1_session(c->ssl);
+        entry->last_used=++c->opt->client_cache_clock;
+    }
+    leave_critical_section(CRIT_SESSION);
+}
+
+    /* CRIT_SESSION needs to be held by the caller */
+static CLIENT_CACHE *session_cache_find(SERVICE_OPTIONS *opt,
+        SOCKADDR_UNION *dest) {
+    int i;
+
+    for(i=0; i<CLIENT_CACHE_DESTS; ++i)
+        if(opt->client_cache[i].session[0] &&
+                !memcmp(&opt->client_cache[i].addr, dest,
+                sizeof(SOCKADDR_UNION)))
+            return opt->client_cache+i;
+    return NULL;
+}
+
+    /* CRIT_SESSION needs to be held by the caller */
+static void session_cache_remove(CLIENT_CACHE *entry, SSL_SESSION *session) {
+    int i;
+
+    for(i=0; i<CLIENT_CACHE_SESSIONS; ++i)
+        if(entry->session[i]==session)
+            break;
+    if(i==CLIENT_CACHE_SESSIONS) /* already removed by another thread */
+        return;
+    SSL_SESSION_free(session);
+    memmove(entry->session+i, entry->session+i+1,
+        (CLIENT_CACHE_SESSIONS-1-i)*sizeof(SSL_SESSION *));
+    entry->session[CLIENT_CACHE_SESSIONS-1]=NULL;
+}
+
 /****************************** transfer data */
 static void transfer(CLI *c) {
     int watchdog=0; /* a counter to detect an infinite loop */
@@ -761,6 +893,10 @@ static void parse_socket_error(CLI *c, const char *text) {
             "Function %s temporary lack of resources: retrying", text);
         return;
 #endif
+    case EINPROGRESS: /* the first write of a TCP Fast Open connect() */
+        s_log(LOG_DEBUG,
+            "Function %s connection in progress: retrying when writable", text);
+        return;
     default:
         sockerror(text);
         longjmp(c->err, 1);
@@ -1028,6 +1164,9 @@ static int connect_remote(CLI *c) { /* connect remote host */
     SOCKADDR_UNION addr;
     SOCKADDR_LIST resolved_list, *address_list;
     int fd, ind_try, ind_cur;
+#ifdef TCP_FASTOPEN_CONNECT
+    int on;
+#endif
 
     /* setup address_list */
     if(c->opt->option.delayed_lookup) {
@@ -1038,6 +1177,13 @@ static int connect_remote(CLI *c) { /* connect remote host */
             longjmp(c->err, 1);
         }
         address_list=&resolved_list;
+    } else if(c->opt->remote_refresh) { /* refreshed by cron.c */
+        enter_critical_section(CRIT_ADDR);
+        memcpy(&resolved_list, &c->opt->remote_addr, sizeof(SOCKADDR_LIST));
+        if(resolved_list.num) /* advance the shared round-robin counter */
+            c->opt->remote_addr.cur=(resolved_list.cur+1)%resolved_list.num;
+        leave_critical_section(CRIT_ADDR);
+        address_list=&resolved_list;
     } else /* use pre-resolved addresses */
         address_list=&c->opt->remote_addr;
 
@@ -1059,7 +1205,22 @@ static int connect_remote(CLI *c) { /* connect remote host */
         if(c->bind_addr.num) /* explicit local bind or transparent proxy */
             local_bind(c);
 
+#ifdef TCP_FASTOPEN_CONNECT
+        if(c->opt->option.fastopen) {
+            /* connect() returns immediately and the SYN is only sent
+             * with the first write, i.e. the ClientHello in the client
+             * mode or the first chunk of plaintext in the server mode */
+            on=1;
+            if(setsockopt(c->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+                    (void *)&on, sizeof on))
+                sockerror("setsockopt TCP_FASTOPEN_CONNECT");
+            /* ignore the error: fall back to a regular connect() */
+        }
+#endif /* TCP_FASTOPEN_CONNECT */
+
         if(connect_blocking(c, &addr, addr_len(addr))) {
+            if(get_last_socket_error()==EADDRNOTAVAIL)
+                source_unavailable(c);
             closesocket(c->fd);
             c->fd=-1;
             continue; /* next IP */
@@ -1100,10 +1261,18 @@ static int connect_transparent(CLI *c) { /* connect the original dst */
 
 static void local_bind(CLI *c) {
     SOCKADDR_UNION addr;
-    int on;
+    int on, ind_cur;
 
     on=1;
-    memcpy(&addr, &c->bind_addr.addr[0], sizeof addr);
+    ind_cur=0;
+    if(c->bind_addr.num>1) { /* spread connections across the source pool */
+        enter_critical_section(CRIT_ADDR);
+        ind_cur=c->opt->source_addr.cur;
+        c->opt->source_addr.cur=(ind_cur+1)%c->opt->source_addr.num;
+        leave_critical_section(CRIT_ADDR);
+    }
+    c->bind_addr.cur=ind_cur; /* for source_unavailable() */
+    memcpy(&addr, &c->bind_addr.addr[ind_cur], sizeof addr);
 
 #if defined(USE_WIN32)
     /* do nothing */
@@ -1155,14 +1324,37 @@ static void local_bind(CLI *c) {
     }
 
     addr.in.sin_port=htons(0); /* retry with ephemeral port */
+#ifdef IP_BIND_ADDRESS_NO_PORT
+    /* defer the port allocation to connect(), so that a single source
+     * address can reuse the same port for different destinations */
+    if(setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &on, sizeof on))
+        sockerror("setsockopt IP_BIND_ADDRESS_NO_PORT");
+    /* ignore the error to retain older Linux compatibility */
+#endif
     if(!bind(c->fd, &addr.sa, addr_len(addr))) {
         s_log(LOG_INFO, "local_bind succeeded on an ephemeral port");
         return; /* success */
     }
+    if(get_last_socket_error()==EADDRINUSE) /* no ephemeral ports left */
+        source_unavailable(c);
     sockerror("local_bind (ephemeral port)");
     longjmp(c->err, 1);
 }
 
+static void source_unavailable(CLI *c) { /* ephemeral ports exhausted */
+    char txt[IPLEN];
+    unsigned long count;
+
+    if(!c->opt->source_addr.num) /* not a configured source pool */
+        return;
+    enter_critical_section(CRIT_ADDR);
+    count=++c->opt->source_unavail[c->bind_addr.cur];
+    leave_critical_section(CRIT_ADDR);
+    s_ntop(txt, c->bind_addr.addr+c->bind_addr.cur);
+    s_log(LOG_WARNING, "Service %s: source address %s exhausted (%lu time(s))",
+        c->opt->servname, txt, count);
+}
+
 static void print_bound_address(CLI *c) {
     char txt[IPLEN];
     SOCKADDR_UNION addr;
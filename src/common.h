@@ -118,6 +118,31 @@ typedef int socklen_t;
 #define USE_LIBWRAP
 #endif
 
+/* stream multiplexing passes descriptors between threads of one process */
+#if !defined(USE_WIN32) && !defined(USE_FORK)
+#define USE_MUX
+#endif
+
+/* shared memory session cache needs mmap() and robust process-shared
+ * mutexes */
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_PTHREAD_H) && \
+    defined(HAVE_PTHREAD_MUTEXATTR_SETROBUST)
+#define USE_SHM_CACHE
+#ifndef USE_PTHREAD
+#include <pthread.h>
+#endif
+#endif
+
+/* in-memory CRLpath store is reloaded by the cron thread */
+#ifdef USE_PTHREAD
+#define USE_CRL_STORE
+#endif
+
+/* private key operations forwarded to keyd over a UNIX socket */
+#if !defined(USE_WIN32) && !defined(USE_OS2)
+#define USE_KEYD
+#endif
+
 /* must be included before sys/stat.h for Ultrix */
 #include <sys/types.h>   /* u_short, u_long */
 /* general headers */
@@ -165,6 +190,7 @@ typedef unsigned long u32;
 #define sleep(c) Sleep(1000*(c))
 
 #define get_last_socket_error() WSAGetLastError()
+#define set_last_socket_error(e) WSASetLastError(e)
 #define get_last_error()        GetLastError()
 #define readsocket(s,b,n)       recv((s),(b),(n),0)
 #define writesocket(s,b,n)      send((s),(b),(n),0)
@@ -184,6 +210,7 @@ typedef unsigned long u32;
 #define EINPROGRESS WSAEINPROGRESS
 #define EWOULDBLOCK WSAEWOULDBLOCK
 #define EADDRINUSE WSAEADDRINUSE
+#define EADDRNOTAVAIL WSAEADDRNOTAVAIL
 
 #define ECONNRESET WSAECONNRESET
 #define ENOTSOCK WSAENOTSOCK
@@ -192,6 +219,7 @@ typedef unsigned long u32;
 #define EWOULDBLOCK WSAEWOULDBLOCK
 #define EISCONN WSAEISCONN
 #define EADDRINUSE WSAEADDRINUSE
+#define EADDRNOTAVAIL WSAEADDRNOTAVAIL
 
 #ifdef EINVAL
 #undef EINVAL
@@ -228,6 +256,7 @@ typedef unsigned long u32;
 #define NI_NUMERICHOST          1
 #define NI_NUMERICSERV          2
 #define get_last_socket_error() sock_errno()
+#define set_last_socket_error(e) (errno=(e))
 #define get_last_error()        errno
 #define readsocket(s,b,n)       recv((s),(b),(n),0)
 #define writesocket(s,b,n)      send((s),(b),(n),0)
@@ -235,6 +264,7 @@ typedef unsigned long u32;
 #define ioctlsocket(a,b,c)      so_ioctl((a),(b),(c))
 #else
 #define get_last_socket_error() errno
+#define set_last_socket_error(e) (errno=(e))
 #define get_last_error()        errno
 #define readsocket(s,b,n)       read((s),(b),(n))
 #define writesocket(s,b,n)      write((s),(b),(n))
@@ -288,7 +318,11 @@ typedef unsigned long u32;
 #ifdef HAVE_SYS_FILIO_H
 #include <sys/filio.h>   /* for FIONBIO */
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>    /* mmap */
+#endif
 #include <pwd.h>
+#include <dirent.h>      /* opendir */
 #ifdef HAVE_GRP_H
 #include <grp.h>
 #endif
@@ -299,8 +333,12 @@ typedef unsigned long u32;
 
 #include <netinet/in.h>  /* struct sockaddr_in */
 #include <sys/socket.h>  /* getpeername */
+#ifdef USE_KEYD
+#include <sys/un.h>      /* struct sockaddr_un */
+#endif
 #include <arpa/inet.h>   /* inet_ntoa */
 #include <sys/time.h>    /* select */
+#include <sys/uio.h>     /* writev */
 #include <sys/ioctl.h>   /* ioctl */
 #include <netinet/tcp.h>
 #include <netdb.h>
@@ -378,6 +416,7 @@ extern char *sys_errlist[];
 #endif /* HAVE_OSSL_ENGINE_H */
 
 #include <openssl/ocsp.h>
+#include <openssl/hmac.h>
 
 #ifdef USE_FIPS
 #include <openssl/fips.h>
@@ -0,0 +1,244 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+/* crlbench: revocation lookups in a large synthetic CRL */
+
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/rand.h>
+
+#include "crlindex.h"
+
+static void usage(const char *);
+static X509_CRL *synthetic_crl(long);
+static X509_CRL *read_crl(const char *);
+static ASN1_INTEGER *random_serial(void);
+static X509_REVOKED *linear_find(X509_CRL *, ASN1_INTEGER *);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+    long value, entries=100000, lookups=100000, linear_lookups=100;
+    long i, found, n;
+    char *end, *file=NULL;
+    X509_CRL *crl;
+    CRL_INDEX *index;
+    ASN1_INTEGER **serial;
+    double start, elapsed;
+    int arg;
+
+    for(arg=1; arg<argc-1 && argv[arg][0]=='-'; arg+=2) {
+        if(argv[arg][1]=='f') {
+            file=argv[arg+1];
+            continue;
+        }
+        value=strtol(argv[arg+1], &end, 10);
+        if(end==argv[arg+1] || *end || value<1)
+            usage(argv[0]);
+        switch(argv[arg][1]) {
+        case 'n':
+            entries=value;
+            break;
+        case 'l':
+            lookups=value;
+            break;
+        case 's':
+            linear_lookups=value;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(arg!=argc)
+        usage(argv[0]);
+
+    start=now();
+    crl=file ? read_crl(file) : synthetic_crl(entries);
+    if(!crl)
+        return 1;
+    n=sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl));
+    if(n<0) /* no revoked entries */
+        n=0;
+    fprintf(stderr, "crlbench: %ld revoked serials %s in %.3f s\n",
+        n, file ? "loaded" : "generated", now()-start);
+
+    /* every other serial is revoked */
+    serial=calloc(lookups, sizeof(ASN1_INTEGER *));
+    if(!serial) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for(i=0; i<lookups; ++i)
+        serial[i]=i%2 && n>0 ? ASN1_INTEGER_dup(sk_X509_REVOKED_value(
+            X509_CRL_get_REVOKED(crl), rand()%n)->serialNumber) :
+            random_serial();
+
+    start=now();
+    index=crl_index_new(crl);
+    if(!index) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    printf("index built in %.3f s\n", now()-start);
+
+    start=now();
+    for(i=found=0; i<lookups; ++i)
+        if(crl_index_find(index, serial[i]))
+            ++found;
+    elapsed=now()-start;
+    printf("hashed: %ld lookups in %.3f s: %.3f us/lookup, %ld revoked\n",
+        lookups, elapsed, elapsed*1000000/lookups, found);
+
+    if(linear_lookups>lookups)
+        linear_lookups=lookups;
+    start=now();
+    for(i=found=0; i<linear_lookups; ++i)
+        if(linear_find(crl, serial[i]))
+            ++found;
+    elapsed=now()-start;
+    printf("linear: %ld lookups in %.3f s: %.3f us/lookup, %ld revoked\n",
+        linear_lookups, elapsed, elapsed*1000000/linear_lookups, found);
+
+    for(i=0; i<lookups; ++i)
+        ASN1_INTEGER_free(serial[i]);
+    free(serial);
+    crl_index_free(index);
+    X509_CRL_free(crl);
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n entries] [-l lookups] [-s linear_lookups] "
+        "[-f crl.pem]\n", name);
+    fprintf(stderr, "  -n  revoked serials in a synthetic CRL (default 100000)\n");
+    fprintf(stderr, "  -l  hashed lookups (default 100000)\n");
+    fprintf(stderr, "  -s  linear lookups (default 100)\n");
+    fprintf(stderr, "  -f  PEM-encoded CRL instead of a synthetic one\n");
+    exit(1);
+}
+
+    /* an unsigned CRL is enough to measure the lookups */
+static X509_CRL *synthetic_crl(long entries) {
+    X509_CRL *crl;
+    X509_REVOKED *revoked;
+    ASN1_INTEGER *serial;
+    ASN1_TIME *date;
+    long i;
+
+    crl=X509_CRL_new();
+    date=ASN1_TIME_set(NULL, time(NULL));
+    if(!crl || !date) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    for(i=0; i<entries; ++i) {
+        revoked=X509_REVOKED_new();
+        serial=random_serial();
+        if(!revoked || !serial ||
+                !X509_REVOKED_set_serialNumber(revoked, serial) ||
+                !X509_REVOKED_set_revocationDate(revoked, date) ||
+                !X509_CRL_add0_revoked(crl, revoked)) {
+            fprintf(stderr, "Failed to add a revoked serial\n");
+            return NULL;
+        }
+        ASN1_INTEGER_free(serial);
+    }
+    ASN1_TIME_free(date);
+    return crl;
+}
+
+static X509_CRL *read_crl(const char *file) {
+    FILE *fp;
+    X509_CRL *crl;
+
+    fp=fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return NULL;
+    }
+    crl=PEM_read_X509_CRL(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if(!crl)
+        fprintf(stderr, "%s: Failed to read a PEM-encoded CRL\n", file);
+    return crl;
+}
+
+    /* 16 random bytes, as issued by typical CAs */
+static ASN1_INTEGER *random_serial(void) {
+    unsigned char buf[16];
+    BIGNUM *bn;
+    ASN1_INTEGER *serial;
+
+    if(RAND_pseudo_bytes(buf, sizeof buf)<0)
+        return NULL;
+    buf[0]&=0x7f; /* positive */
+    bn=BN_bin2bn(buf, sizeof buf, NULL);
+    if(!bn)
+        return NULL;
+    serial=BN_to_ASN1_INTEGER(bn, NULL);
+    BN_free(bn);
+    return serial;
+}
+
+    /* the loop previously used by crl_check() */
+static X509_REVOKED *linear_find(X509_CRL *crl, ASN1_INTEGER *serial) {
+    X509_REVOKED *revoked;
+    int i, n;
+
+    n=sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl));
+    for(i=0; i<n; i++) {
+        revoked=sk_X509_REVOKED_value(X509_CRL_get_REVOKED(crl), i);
+        if(!ASN1_INTEGER_cmp(revoked->serialNumber, serial))
+            return revoked;
+    }
+    return NULL;
+}
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+/* end of crlbench.c */
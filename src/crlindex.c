@@ -0,0 +1,114 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+/* crlindex: open addressing hash table of the serial numbers revoked
+ * by a CRL, shared by verify.c and crlbench.c */
+
+#include <stdlib.h>
+
+#include "crlindex.h"
+
+#define CRL_INDEX_MIN 16 /* smallest number of slots */
+
+struct crl_index_struct {
+    unsigned long mask; /* the number of slots minus one */
+    X509_REVOKED **slot; /* owned by the CRL, NULL for an empty slot */
+};
+
+static unsigned long serial_hash(ASN1_INTEGER *);
+
+    /* the entries are not copied: the CRL has to outlive its index */
+CRL_INDEX *crl_index_new(X509_CRL *crl) {
+    STACK_OF(X509_REVOKED) *revoked;
+    CRL_INDEX *index;
+    X509_REVOKED *entry;
+    unsigned long size, h;
+    int i, n;
+
+    revoked=X509_CRL_get_REVOKED(crl);
+    n=revoked ? sk_X509_REVOKED_num(revoked) : 0;
+    for(size=CRL_INDEX_MIN; size<2UL*n; size<<=1)
+        ; /* keep the load factor below 50% */
+    index=calloc(1, sizeof(CRL_INDEX));
+    if(!index)
+        return NULL;
+    index->slot=calloc(size, sizeof(X509_REVOKED *));
+    if(!index->slot) {
+        free(index);
+        return NULL;
+    }
+    index->mask=size-1;
+    for(i=0; i<n; ++i) {
+        entry=sk_X509_REVOKED_value(revoked, i);
+        for(h=serial_hash(entry->serialNumber)&index->mask; index->slot[h];
+                h=(h+1)&index->mask)
+            ; /* linear probing */
+        index->slot[h]=entry;
+    }
+    return index;
+}
+
+X509_REVOKED *crl_index_find(const CRL_INDEX *index, ASN1_INTEGER *serial) {
+    unsigned long h;
+
+    for(h=serial_hash(serial)&index->mask; index->slot[h];
+            h=(h+1)&index->mask)
+        if(!ASN1_INTEGER_cmp(index->slot[h]->serialNumber, serial))
+            return index->slot[h];
+    return NULL; /* not revoked */
+}
+
+void crl_index_free(CRL_INDEX *index) {
+    if(!index)
+        return;
+    free(index->slot);
+    free(index);
+}
+
+static unsigned long serial_hash(ASN1_INTEGER *serial) {
+    unsigned long hash=2166136261UL; /* FNV-1a */
+    const unsigned char *data=ASN1_STRING_data(serial);
+    int i, len=ASN1_STRING_length(serial);
+
+    for(i=0; i<len; ++i)
+        hash=((hash^data[i])*16777619UL)&0xffffffffUL;
+    if(ASN1_STRING_type(serial)==V_ASN1_NEG_INTEGER)
+        hash=~hash&0xffffffffUL;
+    return hash;
+}
+
+/* end of crlindex.c */
@@ -0,0 +1,316 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+#include "common.h"
+#include "prototypes.h"
+
+#define CRON_INTERVAL 1 /* seconds between subsequent cron jobs */
+
+/**************************************** prototypes */
+
+#if defined(USE_PTHREAD) || defined(USE_WIN32)
+#ifdef USE_PTHREAD
+static void *cron_thread(void *);
+#else
+static void cron_thread(void *);
+#endif
+static void cron_worker(void);
+static void cron_remote_refresh(SERVICE_OPTIONS *, time_t);
+#ifndef OPENSSL_NO_TLSEXT
+static void cron_ticket_keys(SERVICE_OPTIONS *, time_t);
+#endif
+static void cron_session_file(SERVICE_OPTIONS *, time_t);
+static void cron_verify_pins(SERVICE_OPTIONS *, time_t);
+#endif /* USE_PTHREAD || USE_WIN32 */
+
+/**************************************** cron thread */
+
+#ifdef USE_PTHREAD
+
+int cron_init(void) {
+    pthread_t thread;
+    pthread_attr_t pth_attr;
+    int error;
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigset_t new_set, old_set;
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    /* signals are only handled by the main thread */
+    sigfillset(&new_set);
+    pthread_sigmask(SIG_SETMASK, &new_set, &old_set); /* block signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    pthread_attr_init(&pth_attr);
+    pthread_attr_setdetachstate(&pth_attr, PTHREAD_CREATE_DETACHED);
+    error=pthread_create(&thread, &pth_attr, cron_thread, NULL);
+    pthread_attr_destroy(&pth_attr);
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL); /* unblock signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    if(error) {
+        errno=error;
+        ioerror("pthread_create");
+        return 0; /* FAILED */
+    }
+    return 1; /* OK */
+}
+
+static void *cron_thread(void *arg) {
+    (void)arg; /* skip warning about unused parameter */
+    s_log(LOG_DEBUG, "Cron thread initialized");
+    for(;;) {
+        cron_worker();
+        str_cleanup(); /* release the memory allocated by this iteration */
+        sleep(CRON_INTERVAL);
+    }
+    return NULL; /* it should never be executed */
+}
+
+#endif /* USE_PTHREAD */
+
+#ifdef USE_WIN32
+
+int cron_init(void) {
+    if((long)_beginthread(cron_thread, 0, NULL)==-1) {
+        ioerror("_beginthread");
+        return 0; /* FAILED */
+    }
+    return 1; /* OK */
+}
+
+static void cron_thread(void *arg) {
+    (void)arg; /* skip warning about unused parameter */
+    s_log(LOG_DEBUG, "Cron thread initialized");
+    for(;;) {
+        cron_worker();
+        str_cleanup(); /* release the memory allocated by this iteration */
+        Sleep(1000*CRON_INTERVAL);
+    }
+}
+
+#endif /* USE_WIN32 */
+
+#if defined(USE_UCONTEXT) || defined(USE_FORK) || defined(USE_OS2)
+
+int cron_init(void) {
+    SERVICE_OPTIONS *opt;
+
+    /* a blocking job would stall all ucontext threads, and the changes
+     * made by a forked process are not visible to the others */
+    if(global_options.handshake_workers)
+        s_log(LOG_WARNING,
+            "handshakeWorkers is not supported with this threading model");
+    for(opt=service_options.next; opt; opt=opt->next) {
+        if(opt->remote_refresh)
+            s_log(LOG_WARNING,
+                "Service %s: connectRefresh is not supported with this threading model",
+                opt->servname);
+#ifndef OPENSSL_NO_TLSEXT
+        if(!opt->option.client && (opt->ticket_keys || opt->ticket_rotate))
+            s_log(LOG_WARNING,
+                "Service %s: ticket keys are only updated on configuration reload with this threading model",
+                opt->servname);
+#endif
+        if(opt->session_file && opt->session_file_interval)
+            s_log(LOG_WARNING,
+                "Service %s: sessionFileInterval is not supported with this threading model",
+                opt->servname);
+#ifndef OPENSSL_NO_TLSEXT
+        if(!opt->option.client && opt->option.ocsp_stapling)
+            s_log(LOG_WARNING,
+#ifdef USE_UCONTEXT
+                "Service %s: OCSPstapling is not supported with this threading model",
+#else
+                "Service %s: stapled OCSP response is only updated on configuration reload with this threading model",
+#endif
+                opt->servname);
+#endif
+        if(opt->pin_set)
+            s_log(LOG_WARNING,
+                "Service %s: verifyPins is only reloaded on configuration reload with this threading model",
+                opt->servname);
+    }
+    return 1; /* OK */
+}
+
+#endif /* USE_UCONTEXT || USE_FORK || USE_OS2 */
+
+/**************************************** cron jobs */
+
+#if defined(USE_PTHREAD) || defined(USE_WIN32)
+
+static void cron_worker(void) {
+    SERVICE_OPTIONS *opt;
+    time_t now;
+
+    time(&now);
+#ifndef OPENSSL_NO_RSA
+    tmp_rsa_refresh(now);
+#endif
+    /* sections replaced with a configuration reload are never released,
+     * so it is safe to walk a list that has just been replaced */
+    for(opt=service_options.next; opt; opt=opt->next) {
+        if(opt->remote_refresh && !opt->option.delayed_lookup)
+            cron_remote_refresh(opt, now);
+#ifndef OPENSSL_NO_TLSEXT
+        if(!opt->option.client && (opt->ticket_keys || opt->ticket_rotate))
+            cron_ticket_keys(opt, now);
+#endif
+        if(opt->session_file && opt->session_file_interval)
+            cron_session_file(opt, now);
+        if(opt->ocsp_cache && opt->option.ocsp_aia)
+            ocsp_resolve_refresh(opt, now);
+#ifndef OPENSSL_NO_TLSEXT
+        if(opt->ocsp_staple)
+            ocsp_staple_refresh(opt, now);
+#endif
+#ifdef USE_CRL_STORE
+        if(opt->crl_store)
+            crl_store_refresh(opt, now);
+#endif
+        if(opt->pin_set)
+            cron_verify_pins(opt, now);
+    }
+}
+
+static void cron_remote_refresh(SERVICE_OPTIONS *opt, time_t now) {
+    SOCKADDR_LIST addr_list;
+    NAME_LIST *name_list;
+
+    if(!opt->remote_refresh_time) { /* resolved when the section was parsed */
+        opt->remote_refresh_time=now+opt->remote_refresh;
+        return;
+    }
+    if(now<opt->remote_refresh_time)
+        return; /* not yet */
+    opt->remote_refresh_time=now+opt->remote_refresh;
+
+    memset(&addr_list, 0, sizeof addr_list); /* memcmp() below */
+    /* the addresses of all the "connect" names are combined */
+    for(name_list=opt->remote_names; name_list; name_list=name_list->next)
+        if(!name2addrlist(&addr_list, name_list->name, DEFAULT_LOOPBACK)) {
+            s_log(LOG_WARNING, "Service %s: cannot refresh '%s' - keeping %d old address(es)",
+                opt->servname, name_list->name, opt->remote_addr.num);
+            return;
+        }
+
+    enter_critical_section(CRIT_ADDR);
+    if(addr_list.num==opt->remote_addr.num &&
+            !memcmp(addr_list.addr, opt->remote_addr.addr,
+                addr_list.num*sizeof(SOCKADDR_UNION))) { /* unchanged */
+        leave_critical_section(CRIT_ADDR);
+        s_log(LOG_DEBUG, "Service %s: 'connect' resolved to the same %d address(es)",
+            opt->servname, addr_list.num);
+        return;
+    }
+    /* preserve the round-robin position */
+    addr_list.cur=opt->remote_addr.cur%addr_list.num;
+    memcpy(&opt->remote_addr, &addr_list, sizeof(SOCKADDR_LIST));
+    leave_critical_section(CRIT_ADDR);
+    s_log(LOG_INFO, "Service %s: 'connect' refreshed to %d address(es)",
+        opt->servname, addr_list.num);
+}
+
+#ifndef OPENSSL_NO_TLSEXT
+
+static void cron_ticket_keys(SERVICE_OPTIONS *opt, time_t now) {
+    struct stat st;
+
+    if(!opt->ticket_keys) { /* generated keys */
+        if(now>=opt->ticket_rotate_time)
+            ticket_keys_rotate(opt);
+        return;
+    }
+    if(stat(opt->ticket_keys, &st)) {
+        if(opt->ticket_keys_mtime) { /* only logged once */
+            ioerror(opt->ticket_keys);
+            s_log(LOG_WARNING, "Service %s: keeping %d old ticket key(s)",
+                opt->servname, opt->ticket_key_num);
+            opt->ticket_keys_mtime=0; /* reloaded when it reappears */
+        }
+        return; /* keep the old keys */
+    }
+    /* modifications within the second of the last load are not
+     * visible in st_mtime, so recently modified keys are reread */
+    if(st.st_mtime==opt->ticket_keys_mtime && st.st_mtime<now-1)
+        return; /* not modified */
+    if(!ticket_keys_load(opt)) {
+        opt->ticket_keys_mtime=st.st_mtime; /* don't retry until modified */
+        s_log(LOG_WARNING, "Service %s: keeping %d old ticket key(s)",
+            opt->servname, opt->ticket_key_num);
+    }
+}
+
+#endif /* OPENSSL_NO_TLSEXT */
+
+static void cron_session_file(SERVICE_OPTIONS *opt, time_t now) {
+    if(!opt->session_file_time) { /* sessions were loaded by context_init() */
+        opt->session_file_time=now+opt->session_file_interval;
+        return;
+    }
+    if(now<opt->session_file_time)
+        return; /* not yet */
+    opt->session_file_time=now+opt->session_file_interval;
+    session_file_save(opt);
+}
+
+static void cron_verify_pins(SERVICE_OPTIONS *opt, time_t now) {
+    struct stat st;
+
+    if(stat(opt->pin_file, &st)) {
+        if(opt->pin_file_mtime) { /* only logged once */
+            ioerror(opt->pin_file);
+            s_log(LOG_WARNING, "Service %s: keeping the old fingerprints from %s",
+                opt->servname, opt->pin_file);
+            opt->pin_file_mtime=0; /* reloaded when it reappears */
+        }
+        return; /* keep the old fingerprints */
+    }
+    /* modifications within the second of the last load are not
+     * visible in st_mtime, so recently modified files are reread */
+    if(st.st_mtime==opt->pin_file_mtime && st.st_mtime<now-1)
+        return; /* not modified */
+    if(!pin_set_load(opt)) {
+        opt->pin_file_mtime=st.st_mtime; /* don't retry until modified */
+        s_log(LOG_WARNING, "Service %s: keeping the old fingerprints from %s",
+            opt->servname, opt->pin_file);
+    }
+}
+
+#endif /* USE_PTHREAD || USE_WIN32 */
+
+/* end of cron.c */
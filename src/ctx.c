@@ -37,30 +37,66 @@
 
 #include "common.h"
 #include "prototypes.h"
+#include "sessiond.h"
+#ifdef USE_KEYD
+#include "keyd.h"
+#endif
 
 #ifndef OPENSSL_NO_RSA
 /* cache temporary keys up to 4096 bits */
 #define KEY_CACHE_LENGTH 4097
 /* cache temporary keys up to 1 hour */
 #define KEY_CACHE_TIME 3600
+/* regenerate the keys in the cron thread 5 minutes before they expire */
+#define KEY_REFRESH_TIME 300
 static struct keytabstruct {
     RSA *key;
+    RSA *old_key;        /* may still be used by a concurrent handshake */
     time_t timeout;
 } key_table[KEY_CACHE_LENGTH];
-static BIGNUM *e_value;
+static BIGNUM *e_value=NULL;
+static int long_keylen=0;
 #endif /* OPENSSL_NO_RSA */
 
+#ifndef OPENSSL_NO_TLSEXT
+/* exact host names and the edges of a trie of reversed wildcard labels
+ * share a single hash table, so that neither lookup depends on the
+ * number of the virtual services */
+#define SNI_INDEX_MIN 64 /* initial number of buckets */
+#define SNI_NAME_MAX 255 /* maximum length of a DNS name */
+
+typedef struct sni_entry_struct {
+    struct sni_entry_struct *next;                       /* hash chain */
+    const void *parent;  /* NULL for a host name, or the parent trie node */
+    char *name;                           /* lowercase host name or label */
+    SERVICE_OPTIONS *opt;     /* the service of a host name or a wildcard */
+} SNI_ENTRY;
+
+struct sni_index_struct {
+    SNI_ENTRY **bucket;
+    unsigned long size, num;
+};
+#endif /* OPENSSL_NO_TLSEXT */
+
 /**************************************** prototypes */
 
 /* SNI */
 #ifndef OPENSSL_NO_TLSEXT
 static int servername_cb(SSL *, int *, void *);
+static SERVICE_OPTIONS *sni_index_find(const SNI_INDEX *, const char *);
+static SNI_ENTRY *sni_entry_find(const SNI_INDEX *, const void *,
+    const char *, size_t);
+static SNI_ENTRY *sni_entry_add(SNI_INDEX *, const void *,
+    const char *, size_t);
+static unsigned long sni_hash(const void *, const char *, size_t);
 #endif
 
 /* RSA/DH initialization */
 #ifndef OPENSSL_NO_RSA
 static RSA *tmp_rsa_cb(SSL *, int, int);
+static int tmp_rsa_missing(int, int, time_t);
 static RSA *make_temp_key(int);
+static void store_temp_key(int, RSA *, time_t);
 #endif /* OPENSSL_NO_RSA */
 #ifndef OPENSSL_NO_DH
 static int init_dh(SSL_CTX *, SERVICE_OPTIONS *);
@@ -70,9 +106,47 @@ static int init_ecdh(SSL_CTX *, SERVICE_OPTIONS *);
 #endif /* USE_ECDH */
 
 /* loading certificate */
+static int check_key_file(const char *);
 static int load_pem_cert(SERVICE_OPTIONS *);
+static int load_cert_pair(SERVICE_OPTIONS *, char *, char *);
+static int cert_key_type(const char *);
+#if OPENSSL_VERSION_NUMBER<0x10002000L
+static int load_extra_chain(SSL_CTX *, const char *);
+#endif
 static int password_cb(char *, int, int, void *);
 
+/* keyd private key service */
+#if defined(USE_KEYD) && !defined(OPENSSL_NO_RSA)
+typedef struct {
+    SERVICE_OPTIONS *opt;
+    u_char id[KEYD_ID_LEN];
+} KEYD_KEY;
+
+static int keyd_load_key(SERVICE_OPTIONS *, const char *);
+static int keyd_priv_enc(int, const unsigned char *, unsigned char *,
+    RSA *, int);
+static int keyd_priv_dec(int, const unsigned char *, unsigned char *,
+    RSA *, int);
+static int keyd_request(KEYD_KEY *, int, int, const unsigned char *, int,
+    unsigned char *, int);
+static int keyd_transfer(SERVICE_OPTIONS *, void *, int,
+    unsigned char *, int);
+static int keyd_pooled(SERVICE_OPTIONS *);
+static int keyd_socket(SERVICE_OPTIONS *);
+static void keyd_release(SERVICE_OPTIONS *, int);
+static int keyd_recv(int, void *, int);
+#endif /* USE_KEYD && !OPENSSL_NO_RSA */
+
+/* session tickets */
+#ifndef OPENSSL_NO_TLSEXT
+static int ticket_key_cb(SSL *, unsigned char *, unsigned char *,
+    EVP_CIPHER_CTX *, HMAC_CTX *, int);
+static int ticket_keys_read_file(const char *, TICKET_KEY *, int);
+#ifndef USE_WIN32
+static int ticket_keys_read_dir(const char *, TICKET_KEY *);
+#endif
+#endif /* OPENSSL_NO_TLSEXT */
+
 /* session cache callbacks */
 static int sess_new_cb(SSL *, SSL_SESSION *);
 static SSL_SESSION *sess_get_cb(SSL *, unsigned char *, int, int *);
@@ -82,6 +156,13 @@ static void cache_transfer(SSL_CTX *, const unsigned int, const unsigned,
     const unsigned char *, const unsigned int,
     unsigned char **, unsigned int *);
 
+/* session file */
+static void session_file_load(SERVICE_OPTIONS *);
+static void session_file_server(void *, void *);
+static int session_file_write(BIO *, SOCKADDR_UNION *, SSL_SESSION *);
+static int session_file_client(SERVICE_OPTIONS *, SOCKADDR_UNION *,
+    SSL_SESSION *);
+
 /* info callbacks */
 static void info_callback(const SSL *, int, int);
 static void print_stats(SSL_CTX *);
@@ -91,26 +172,30 @@ static void sslerror_queue(void);
 /**************************************** initialize section->ctx */
 
 int context_init(SERVICE_OPTIONS *section) { /* init SSL context */
-    struct stat st; /* buffer for stat */
-#ifndef OPENSSL_NO_RSA
     int i;
+#ifndef OPENSSL_NO_RSA
+    RSA *rsa;
+    int keylen;
 #endif /* OPENSSL_NO_RSA */
 
     /* check if certificate exists */
     if(!section->key) /* key file not specified */
         section->key=section->cert;
+    for(i=0; i<section->extra_cert_num; ++i)
+        if(!section->extra_key[i])
+            section->extra_key[i]=section->extra_cert[i];
+#ifdef USE_KEYD
+    if(!section->keyd_path)
+#endif
 #ifdef HAVE_OSSL_ENGINE_H
     if(!section->engine)
 #endif
-    if(section->key) {
-        if(stat(section->key, &st)) {
-            ioerror(section->key);
+    {
+        if(section->key && !check_key_file(section->key))
             return 0;
-        }
-#if !defined(USE_WIN32) && !defined(USE_OS2)
-        if(st.st_mode & 7)
-            s_log(LOG_WARNING, "Wrong permissions on %s", section->key);
-#endif /* defined USE_WIN32 */
+        for(i=0; i<section->extra_cert_num; ++i)
+            if(!check_key_file(section->extra_key[i]))
+                return 0;
     }
 
     /* create SSL context */
@@ -125,18 +210,24 @@ int context_init(SERVICE_OPTIONS *section) { /* init SSL context */
         SSL_CTX_set_tlsext_servername_callback(section->ctx, servername_cb);
 #endif
 #ifndef OPENSSL_NO_RSA
-        for(i=0; i<KEY_CACHE_LENGTH; ++i) {
-            key_table[i].key=NULL;
-            key_table[i].timeout=0;
-        }
-        e_value=BN_new();
-        if(!e_value) {
-            sslerror("BN_new");
-            return 0;
-        }
-        if(!BN_set_word(e_value, RSA_F4)) {
-            sslerror("BN_set_word");
-            return 0;
+        if(!e_value) { /* the key table is shared by all the sections */
+            e_value=BN_new();
+            if(!e_value) {
+                sslerror("BN_new");
+                return 0;
+            }
+            if(!BN_set_word(e_value, RSA_F4)) {
+                sslerror("BN_set_word");
+                BN_free(e_value);
+                e_value=NULL;
+                return 0;
+            }
+            /* pregenerate the key lengths used by export ciphers */
+            for(keylen=512; keylen<=1024; keylen*=2) {
+                rsa=make_temp_key(keylen);
+                if(rsa)
+                    store_temp_key(keylen, rsa, time(NULL));
+            }
         }
         SSL_CTX_set_tmp_rsa_callback(section->ctx, tmp_rsa_cb);
 #endif /* OPENSSL_NO_RSA */
@@ -147,6 +238,10 @@ int context_init(SERVICE_OPTIONS *section) { /* init SSL context */
         init_ecdh(section->ctx, section); /* ignore the result */
 #endif /* OPENSSL_NO_ECDH */
     }
+#if !defined(OPENSSL_NO_TLSEXT) && defined(SSL_OP_NO_TICKET)
+    if(section->ticket_keys || section->ticket_rotate) /* override sessiond */
+        section->ssl_options&=~SSL_OP_NO_TICKET;
+#endif
     if(section->ssl_options) {
         s_log(LOG_DEBUG, "Configuration SSL options: 0x%08lX",
             section->ssl_options);
@@ -165,11 +260,35 @@ int context_init(SERVICE_OPTIONS *section) { /* init SSL context */
     /* session cache */
     SSL_CTX_set_session_cache_mode(section->ctx, SSL_SESS_CACHE_BOTH);
     SSL_CTX_set_timeout(section->ctx, section->session_timeout);
+#ifdef USE_SHM_CACHE
+    if(section->session_shm && !section->option.client) {
+        /* created before FORK threads, so that they share the segment */
+        section->shm_cache=shm_cache_create(section->servname,
+            section->session_shm);
+        if(!section->shm_cache)
+            return 0;
+    }
+    if(section->option.sessiond || section->shm_cache) {
+#else
     if(section->option.sessiond) {
+#endif
         SSL_CTX_sess_set_new_cb(section->ctx, sess_new_cb);
         SSL_CTX_sess_set_get_cb(section->ctx, sess_get_cb);
         SSL_CTX_sess_set_remove_cb(section->ctx, sess_remove_cb);
     }
+    if(section->session_file)
+        session_file_load(section);
+#ifndef OPENSSL_NO_TLSEXT
+    if(!section->option.client) {
+        if(section->ticket_keys) {
+            if(!ticket_keys_load(section))
+                return 0;
+        } else if(section->ticket_rotate)
+            ticket_keys_rotate(section);
+        if(section->ticket_key_num)
+            SSL_CTX_set_tlsext_ticket_key_cb(section->ctx, ticket_key_cb);
+    }
+#endif /* OPENSSL_NO_TLSEXT */
 
     /* info callback */
     SSL_CTX_set_info_callback(section->ctx, info_callback);
@@ -179,6 +298,12 @@ int context_init(SERVICE_OPTIONS *section) { /* init SSL context */
         return 0;
     if(!verify_init(section))
         return 0;
+#if !defined(OPENSSL_NO_TLSEXT) && !defined(USE_UCONTEXT)
+    /* a blocking request would stall all ucontext threads */
+    if(!section->option.client && section->option.ocsp_stapling)
+        if(!ocsp_staple_init(section))
+            return 0;
+#endif
 
     s_log(LOG_DEBUG, "SSL context initialized for service %s",
         section->servname);
@@ -191,30 +316,194 @@ int context_init(SERVICE_OPTIONS *section) { /* init SSL context */
 static int servername_cb(SSL *ssl, int *ad, void *arg) {
     SERVICE_OPTIONS *opt=(SERVICE_OPTIONS *)arg;
     const char *servername=SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
-    SERVERNAME_LIST *list;
+    SERVICE_OPTIONS *slave;
     CLI *c;
 
-    /* leave the alert type at SSL_AD_UNRECOGNIZED_NAME */
-    (void)ad; /* skip warning about unused parameter */
-    if(!opt->servername_list_head) /* no virtual services defined */
+    /* the alert type defaults to SSL_AD_UNRECOGNIZED_NAME */
+    (void)ad; /* skip warning about unused parameter without libwrap */
+    if(!opt->sni_index) /* no virtual services defined */
         return SSL_TLSEXT_ERR_OK;
     if(!servername) /* no SNI extension received from the client */
         return SSL_TLSEXT_ERR_NOACK;
 
-    for(list=opt->servername_list_head; list; list=list->next)
-        if(!strcasecmp(servername, list->servername)) {
-            c=SSL_get_ex_data(ssl, cli_index);
-            c->opt=list->opt;
-            SSL_set_SSL_CTX(ssl, c->opt->ctx);
-            s_log(LOG_NOTICE, "SNI: switched to section %s",
-                c->opt->servname);
+    slave=sni_index_find(opt->sni_index, servername);
+    if(!slave) {
+        s_log(LOG_ERR, "SNI: no service defined for server %s", servername);
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
+    c=SSL_get_ex_data(ssl, cli_index);
+    c->opt=slave;
+    SSL_set_SSL_CTX(ssl, c->opt->ctx);
+    s_log(LOG_NOTICE, "SNI: switched to section %s", c->opt->servname);
 #ifdef USE_LIBWRAP
-            libwrap_auth(c); /* retry on a service switch */
+    if(!libwrap_auth(c)) { /* retry on a service switch */
+        *ad=SSL_AD_ACCESS_DENIED;
+        return SSL_TLSEXT_ERR_ALERT_FATAL;
+    }
 #endif /* USE_LIBWRAP */
-            return SSL_TLSEXT_ERR_OK;
-        }
-    s_log(LOG_ERR, "SNI: no service defined for server %s", servername);
-    return SSL_TLSEXT_ERR_ALERT_FATAL;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+    /* "*.example.com" matches any name ending with ".example.com",
+     * the longest matching wildcard is used if no host name matches,
+     * and the first service wins for duplicate names */
+char *sni_index_add(SERVICE_OPTIONS *master, char *servername,
+        SERVICE_OPTIONS *slave) {
+    char name[SNI_NAME_MAX+1];
+    const void *parent;
+    SNI_ENTRY *entry;
+    size_t len, end, start;
+
+    len=strlen(servername);
+    if(!len || len>SNI_NAME_MAX)
+        return "Invalid SNI server name";
+    for(end=0; end<len; ++end)
+        name[end]=tolower((unsigned char)servername[end]);
+    name[len]='\0';
+    if(strchr(name+1, '*') || (name[0]=='*' && (len<3 || name[1]!='.')))
+        return "Wildcard is only allowed as \"*.\" at the beginning";
+
+    if(!master->sni_index) {
+        /* never released, as the contexts of reloaded sections */
+        master->sni_index=calloc(1, sizeof(SNI_INDEX));
+        if(!master->sni_index)
+            return "Memory allocation failed";
+    }
+    if(name[0]!='*') { /* host name */
+        entry=sni_entry_add(master->sni_index, NULL, name, len);
+        if(!entry)
+            return "Memory allocation failed";
+        if(!entry->opt)
+            entry->opt=slave;
+        return NULL; /* OK */
+    }
+
+    /* walk the reversed labels of the wildcard suffix */
+    parent=master->sni_index; /* the root of the trie */
+    for(end=len; ; end=start-1) {
+        for(start=end; start>2 && name[start-1]!='.'; --start)
+            ;
+        if(start==end)
+            return "Empty label in SNI server name";
+        entry=sni_entry_add(master->sni_index, parent, name+start, end-start);
+        if(!entry)
+            return "Memory allocation failed";
+        if(start==2) /* the label following "*." */
+            break;
+        parent=entry;
+    }
+    if(!entry->opt)
+        entry->opt=slave;
+    return NULL; /* OK */
+}
+
+static SERVICE_OPTIONS *sni_index_find(const SNI_INDEX *index,
+        const char *servername) {
+    char name[SNI_NAME_MAX+1];
+    const void *parent;
+    SNI_ENTRY *entry;
+    SERVICE_OPTIONS *wildcard=NULL;
+    size_t len, end, start;
+
+    if(!index)
+        return NULL;
+    len=strlen(servername);
+    if(!len || len>SNI_NAME_MAX || servername[0]=='.')
+        return NULL;
+    for(end=0; end<len; ++end)
+        name[end]=tolower((unsigned char)servername[end]);
+    name[len]='\0';
+
+    entry=sni_entry_find(index, NULL, name, len);
+    if(entry)
+        return entry->opt;
+
+    /* the deepest wildcard node that leaves at least one label */
+    parent=index;
+    for(end=len; end>0; end=start-1) {
+        for(start=end; start>0 && name[start-1]!='.'; --start)
+            ;
+        if(!start) /* the leftmost label is matched by the asterisk */
+            break;
+        entry=sni_entry_find(index, parent, name+start, end-start);
+        if(!entry)
+            break;
+        if(entry->opt)
+            wildcard=entry->opt;
+        parent=entry;
+    }
+    return wildcard;
+}
+
+static SNI_ENTRY *sni_entry_find(const SNI_INDEX *index, const void *parent,
+        const char *name, size_t len) {
+    SNI_ENTRY *entry;
+
+    if(!index->size)
+        return NULL;
+    for(entry=index->bucket[sni_hash(parent, name, len)%index->size];
+            entry; entry=entry->next)
+        if(entry->parent==parent && !strncmp(entry->name, name, len) &&
+                !entry->name[len])
+            return entry;
+    return NULL;
+}
+
+    /* find or create an entry */
+static SNI_ENTRY *sni_entry_add(SNI_INDEX *index, const void *parent,
+        const char *name, size_t len) {
+    SNI_ENTRY *entry, **bucket, *next;
+    unsigned long size, i, h;
+
+    entry=sni_entry_find(index, parent, name, len);
+    if(entry)
+        return entry;
+
+    if(index->num>=index->size) { /* grow and rehash */
+        size=index->size ? 2*index->size : SNI_INDEX_MIN;
+        bucket=calloc(size, sizeof(SNI_ENTRY *));
+        if(!bucket)
+            return NULL;
+        for(i=0; i<index->size; ++i)
+            for(entry=index->bucket[i]; entry; entry=next) {
+                next=entry->next;
+                h=sni_hash(entry->parent, entry->name,
+                    strlen(entry->name))%size;
+                entry->next=bucket[h];
+                bucket[h]=entry;
+            }
+        free(index->bucket);
+        index->bucket=bucket;
+        index->size=size;
+    }
+
+    entry=calloc(1, sizeof(SNI_ENTRY));
+    if(!entry)
+        return NULL;
+    entry->name=malloc(len+1);
+    if(!entry->name) {
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->name, name, len);
+    entry->name[len]='\0';
+    entry->parent=parent;
+    h=sni_hash(parent, name, len)%index->size;
+    entry->next=index->bucket[h];
+    index->bucket[h]=entry;
+    ++index->num;
+    return entry;
+}
+
+static unsigned long sni_hash(const void *parent, const char *name,
+        size_t len) {
+    unsigned long hash=2166136261UL; /* FNV-1a */
+    size_t i;
+
+    hash=((hash^(unsigned long)(size_t)parent)*16777619UL)&0xffffffffUL;
+    for(i=0; i<len; ++i)
+        hash=((hash^(unsigned char)name[i])*16777619UL)&0xffffffffUL;
+    return hash;
 }
 /* TLSEXT callback return codes:
  *  - SSL_TLSEXT_ERR_OK
@@ -228,10 +517,9 @@ static int servername_cb(SSL *ssl, int *ad, void *arg) {
 #ifndef OPENSSL_NO_RSA
 
 static RSA *tmp_rsa_cb(SSL *s, int export, int keylen) {
-    RSA *rsa;
+    RSA *rsa, *new_rsa;
     time_t now;
     int idx, key_is_long;
-    static int long_keylen=0;
 
     (void)s; /* skip warning about unused parameter */
     (void)export; /* skip warning about unused parameter */
@@ -239,20 +527,74 @@ static RSA *tmp_rsa_cb(SSL *s, int export, int keylen) {
     idx=key_is_long ? 0 : keylen;
     time(&now);
     enter_critical_section(CRIT_KEYGEN);
-    if(key_table[idx].timeout<now || (key_is_long && keylen!=long_keylen)) {
-        rsa=key_table[idx].key;
-        key_table[idx].key=make_temp_key(keylen);
-        if(rsa)
-            RSA_free(rsa);
-        key_table[idx].timeout=now+KEY_CACHE_TIME;
+    rsa=tmp_rsa_missing(idx, keylen, now) ? NULL : key_table[idx].key;
+    leave_critical_section(CRIT_KEYGEN);
+    if(rsa)
+        return rsa;
+
+    /* with a cron thread, only key lengths other than the pregenerated
+     * ones are generated during the handshake, and without holding
+     * CRIT_KEYGEN, so other handshakes are not stalled */
+    new_rsa=make_temp_key(keylen);
+    enter_critical_section(CRIT_KEYGEN);
+    if(new_rsa && tmp_rsa_missing(idx, keylen, now)) { /* still missing */
+        store_temp_key(idx, new_rsa, now);
         if(key_is_long)
             long_keylen=keylen;
+        new_rsa=NULL;
     }
     rsa=key_table[idx].key;
     leave_critical_section(CRIT_KEYGEN);
+    if(new_rsa) /* generated concurrently */
+        RSA_free(new_rsa);
     return rsa;
 }
 
+    /* executed within CRIT_KEYGEN */
+static int tmp_rsa_missing(int idx, int keylen, time_t now) {
+#if defined(USE_PTHREAD) || defined(USE_WIN32)
+    (void)now; /* skip warning about unused parameter */
+#endif
+    return !key_table[idx].key || (!idx && keylen!=long_keylen)
+#if !defined(USE_PTHREAD) && !defined(USE_WIN32)
+        || key_table[idx].timeout<now
+#endif
+        ;
+}
+
+#if defined(USE_PTHREAD) || defined(USE_WIN32)
+
+void tmp_rsa_refresh(time_t now) { /* executed by the cron thread */
+    RSA *rsa;
+    int idx, keylen;
+
+    for(idx=0; ; ++idx) {
+        /* find the next key to be regenerated */
+        enter_critical_section(CRIT_KEYGEN);
+        while(idx<KEY_CACHE_LENGTH && (!key_table[idx].key ||
+                key_table[idx].timeout>now+KEY_REFRESH_TIME))
+            ++idx;
+        keylen=idx ? idx : long_keylen;
+        leave_critical_section(CRIT_KEYGEN);
+        if(idx==KEY_CACHE_LENGTH)
+            return; /* no more keys */
+
+        rsa=make_temp_key(keylen); /* without holding CRIT_KEYGEN */
+        if(!rsa)
+            continue; /* keep the old key until the next attempt */
+        enter_critical_section(CRIT_KEYGEN);
+        if(idx || keylen==long_keylen) { /* still the same length */
+            store_temp_key(idx, rsa, now);
+            rsa=NULL;
+        }
+        leave_critical_section(CRIT_KEYGEN);
+        if(rsa)
+            RSA_free(rsa);
+    }
+}
+
+#endif /* USE_PTHREAD || USE_WIN32 */
+
 static RSA *make_temp_key(int keylen) {
     RSA *rsa;
 
@@ -262,14 +604,26 @@ static RSA *make_temp_key(int keylen) {
         sslerror("RSA_new");
         return NULL;
     }
-    if(RSA_generate_key_ex(rsa, keylen, e_value, NULL)) {
+    if(!RSA_generate_key_ex(rsa, keylen, e_value, NULL)) {
         sslerror("RSA_generate_key_ex");
+        RSA_free(rsa);
         return NULL;
     }
     s_log(LOG_DEBUG, "Temporary RSA key created");
     return rsa;
 }
 
+    /* executed within CRIT_KEYGEN */
+static void store_temp_key(int idx, RSA *rsa, time_t now) {
+    /* the pointer returned by tmp_rsa_cb() is only used until
+     * the handshake takes a reference, so one old key is enough */
+    if(key_table[idx].old_key)
+        RSA_free(key_table[idx].old_key);
+    key_table[idx].old_key=key_table[idx].key;
+    key_table[idx].key=rsa;
+    key_table[idx].timeout=now+KEY_CACHE_TIME;
+}
+
 #endif /* OPENSSL_NO_RSA */
 
 /**************************************** DH initialization */
@@ -328,7 +682,132 @@ static int init_ecdh(SSL_CTX *ctx, SERVICE_OPTIONS *section) {
 
 static int cache_initialized=0;
 
+static int check_key_file(const char *key) {
+    struct stat st; /* buffer for stat */
+
+    if(stat(key, &st)) {
+        ioerror(key);
+        return 0;
+    }
+#if !defined(USE_WIN32) && !defined(USE_OS2)
+    if(st.st_mode & 7)
+        s_log(LOG_WARNING, "Wrong permissions on %s", key);
+#endif /* defined USE_WIN32 */
+    return 1; /* OK */
+}
+
+    /* OpenSSL keeps a single certificate for each key type, and selects
+     * the one matching the negotiated cipher suite (and the signature
+     * algorithms of the client since OpenSSL 1.0.2) during the handshake */
 static int load_pem_cert(SERVICE_OPTIONS *opt) {
+    int i, j, type[EXTRA_CERTS+1];
+
+    if(!opt->cert) /* no certificate specified */
+        return 1; /* OK */
+
+    if(!load_cert_pair(opt, opt->cert, opt->key))
+        return 0;
+    if(!opt->extra_cert_num)
+        return 1; /* OK */
+
+    type[0]=cert_key_type(opt->cert);
+    for(i=0; i<opt->extra_cert_num; ++i) {
+        type[i+1]=cert_key_type(opt->extra_cert[i]);
+        for(j=0; j<=i; ++j)
+            if(type[i+1]==type[j]) { /* it would silently replace the other */
+                s_log(LOG_ERR,
+                    "Certificate %s: Another certificate uses the same key type",
+                    opt->extra_cert[i]);
+                return 0;
+            }
+        if(!load_cert_pair(opt, opt->extra_cert[i], opt->extra_key[i]))
+            return 0;
+    }
+#if OPENSSL_VERSION_NUMBER<0x10002000L
+    s_log(LOG_DEBUG, "Chain certificates are shared by all the key types");
+#endif
+    s_log(LOG_INFO, "Service %s: %d certificate(s) loaded",
+        opt->servname, opt->extra_cert_num+1);
+    return 1; /* OK */
+}
+
+static int cert_key_type(const char *file) {
+    BIO *bio;
+    X509 *cert;
+    EVP_PKEY *pkey;
+    int type=EVP_PKEY_NONE;
+
+    bio=BIO_new_file(file, "r");
+    if(!bio)
+        return -1; /* reported by SSL_CTX_use_certificate_chain_file() */
+    cert=PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if(!cert)
+        return -1;
+    pkey=X509_get_pubkey(cert);
+    if(pkey) {
+#if OPENSSL_VERSION_NUMBER>=0x10000000L
+        type=EVP_PKEY_base_id(pkey);
+#else
+        type=EVP_PKEY_type(pkey->type);
+#endif
+        EVP_PKEY_free(pkey);
+    }
+    X509_free(cert);
+    return type;
+}
+
+#if OPENSSL_VERSION_NUMBER<0x10002000L
+
+    /* the chain certificates are appended to those of the other files */
+static int load_extra_chain(SSL_CTX *ctx, const char *file) {
+    BIO *bio;
+    X509 *cert;
+    int i;
+
+    bio=BIO_new_file(file, "r");
+    if(!bio) {
+        sslerror("BIO_new_file");
+        return 0;
+    }
+    cert=PEM_read_bio_X509(bio, NULL, ctx->default_passwd_callback,
+        ctx->default_passwd_callback_userdata);
+    if(!cert) {
+        sslerror("PEM_read_bio_X509");
+        BIO_free(bio);
+        return 0;
+    }
+    if(!SSL_CTX_use_certificate(ctx, cert)) {
+        sslerror("SSL_CTX_use_certificate");
+        X509_free(cert);
+        BIO_free(bio);
+        return 0;
+    }
+    X509_free(cert);
+    while((cert=PEM_read_bio_X509(bio, NULL, ctx->default_passwd_callback,
+            ctx->default_passwd_callback_userdata))) {
+        for(i=0; i<sk_X509_num(ctx->extra_certs); ++i)
+            if(!X509_cmp(sk_X509_value(ctx->extra_certs, i), cert))
+                break;
+        if(i<sk_X509_num(ctx->extra_certs)) { /* a shared intermediate CA */
+            X509_free(cert);
+            continue;
+        }
+        if(!SSL_CTX_add_extra_chain_cert(ctx, cert)) { /* takes ownership */
+            sslerror("SSL_CTX_add_extra_chain_cert");
+            X509_free(cert);
+            BIO_free(bio);
+            return 0;
+        }
+    }
+    ERR_clear_error(); /* PEM_R_NO_START_LINE at the end of the file */
+    BIO_free(bio);
+    return 1; /* OK */
+}
+
+#endif /* OpenSSL version < 1.0.2 */
+
+static int load_cert_pair(SERVICE_OPTIONS *opt, char *cert, char *key) {
     int i, reason;
     UI_DATA ui_data;
 #ifdef HAVE_OSSL_ENGINE_H
@@ -336,20 +815,38 @@ static int load_pem_cert(SERVICE_OPTIONS *opt) {
     UI_METHOD *ui_method;
 #endif
 
-    if(!opt->cert) /* no certificate specified */
-        return 1; /* OK */
-
     ui_data.opt=opt; /* setup current section for callbacks */
 
-    s_log(LOG_DEBUG, "Certificate: %s", opt->cert);
-    if(!SSL_CTX_use_certificate_chain_file(opt->ctx, opt->cert)) {
-        s_log(LOG_ERR, "Error reading certificate file: %s", opt->cert);
+    s_log(LOG_DEBUG, "Certificate: %s", cert);
+#if OPENSSL_VERSION_NUMBER<0x10002000L
+    /* SSL_CTX_use_certificate_chain_file() would replace the chain
+     * certificates of the previously loaded files */
+    if(cert!=opt->cert) {
+        if(!load_extra_chain(opt->ctx, cert)) {
+            s_log(LOG_ERR, "Error reading certificate file: %s", cert);
+            return 0;
+        }
+    } else
+#endif
+    if(!SSL_CTX_use_certificate_chain_file(opt->ctx, cert)) {
+        s_log(LOG_ERR, "Error reading certificate file: %s", cert);
         sslerror("SSL_CTX_use_certificate_chain_file");
         return 0;
     }
     s_log(LOG_DEBUG, "Certificate loaded");
 
-    s_log(LOG_DEBUG, "Key file: %s", opt->key);
+#ifdef USE_KEYD
+    if(opt->keyd_path) { /* the key is held by keyd */
+#ifndef OPENSSL_NO_RSA
+        return keyd_load_key(opt, cert);
+#else
+        s_log(LOG_ERR, "keyd requires RSA support");
+        return 0;
+#endif
+    }
+#endif /* USE_KEYD */
+
+    s_log(LOG_DEBUG, "Key file: %s", key);
     SSL_CTX_set_default_passwd_cb(opt->ctx, password_cb);
 #ifdef HAVE_OSSL_ENGINE_H
 #ifdef USE_WIN32
@@ -360,7 +857,7 @@ static int load_pem_cert(SERVICE_OPTIONS *opt) {
 #endif /* USE_WIN32 */
     if(opt->engine)
         for(i=1; i<=3; i++) {
-            pkey=ENGINE_load_private_key(opt->engine, opt->key,
+            pkey=ENGINE_load_private_key(opt->engine, key,
                 ui_method, &ui_data);
             if(!pkey) {
                 reason=ERR_GET_REASON(ERR_peek_error());
@@ -384,7 +881,7 @@ static int load_pem_cert(SERVICE_OPTIONS *opt) {
                 continue; /* there is no cached value */
             SSL_CTX_set_default_passwd_cb_userdata(opt->ctx,
                 i ? &ui_data : NULL); /* try the cached password first */
-            if(SSL_CTX_use_PrivateKey_file(opt->ctx, opt->key,
+            if(SSL_CTX_use_PrivateKey_file(opt->ctx, key,
                     SSL_FILETYPE_PEM))
                 break;
             reason=ERR_GET_REASON(ERR_peek_error());
@@ -427,17 +924,498 @@ static int password_cb(char *buf, int size, int rwflag, void *userdata) {
     return len;
 }
 
-/**************************************** session cache callbacks */
+/**************************************** keyd private key service */
+
+#if defined(USE_KEYD) && !defined(OPENSSL_NO_RSA)
+
+#define KEYD_TIMEOUT 10 /* seconds to wait for a keyd response */
+
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+static RSA_METHOD *keyd_method=NULL;
+#else
+static RSA_METHOD keyd_method_data, *keyd_method=NULL;
+#endif
+
+    /* only the public part of the key is known to stunnel, private key
+     * operations are forwarded to keyd over a UNIX socket */
+static int keyd_load_key(SERVICE_OPTIONS *opt, const char *file) {
+    BIO *bio;
+    X509 *cert;
+    EVP_PKEY *pkey;
+    RSA *pub, *rsa;
+    KEYD_KEY *key;
+    unsigned char *der, *der_tmp;
+    int der_len;
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+    const BIGNUM *n, *e;
+#endif
+
+    if(!keyd_method) { /* the default method with private key operations */
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+        keyd_method=RSA_meth_dup(RSA_PKCS1_OpenSSL());
+        if(!keyd_method) {
+            sslerror("RSA_meth_dup");
+            return 0;
+        }
+        RSA_meth_set1_name(keyd_method, "stunnel keyd");
+        RSA_meth_set_priv_enc(keyd_method, keyd_priv_enc);
+        RSA_meth_set_priv_dec(keyd_method, keyd_priv_dec);
+#else
+        memcpy(&keyd_method_data, RSA_PKCS1_SSLeay(), sizeof(RSA_METHOD));
+        keyd_method_data.name="stunnel keyd";
+        keyd_method_data.rsa_priv_enc=keyd_priv_enc;
+        keyd_method_data.rsa_priv_dec=keyd_priv_dec;
+        keyd_method=&keyd_method_data;
+#endif
+    }
+
+    bio=BIO_new_file(file, "r");
+    if(!bio) {
+        sslerror("BIO_new_file");
+        return 0;
+    }
+    cert=PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if(!cert) {
+        sslerror("PEM_read_bio_X509");
+        return 0;
+    }
+    pkey=X509_get_pubkey(cert);
+    X509_free(cert);
+    if(!pkey) {
+        sslerror("X509_get_pubkey");
+        return 0;
+    }
+    pub=EVP_PKEY_get1_RSA(pkey);
+    EVP_PKEY_free(pkey);
+    if(!pub) {
+        s_log(LOG_ERR, "keyd: Only RSA keys are supported");
+        return 0;
+    }
+
+    /* keyd selects its key with the SHA-1 of the public key */
+    key=calloc(1, sizeof(KEYD_KEY));
+    if(!key) {
+        s_log(LOG_ERR, "keyd: Memory allocation failed");
+        RSA_free(pub);
+        return 0;
+    }
+    key->opt=opt;
+    der_len=i2d_RSAPublicKey(pub, NULL);
+    der_tmp=der=str_alloc(der_len);
+    if(!der) {
+        s_log(LOG_ERR, "keyd: Memory allocation failed");
+        RSA_free(pub);
+        free(key);
+        return 0;
+    }
+    i2d_RSAPublicKey(pub, &der_tmp);
+    SHA1(der, der_len, key->id);
+    str_free(der);
+
+    rsa=RSA_new();
+    if(!rsa) {
+        sslerror("RSA_new");
+        RSA_free(pub);
+        free(key);
+        return 0;
+    }
+    RSA_set_method(rsa, keyd_method);
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+    RSA_get0_key(pub, &n, &e, NULL);
+    RSA_set0_key(rsa, BN_dup(n), BN_dup(e), NULL);
+#else
+    rsa->n=BN_dup(pub->n);
+    rsa->e=BN_dup(pub->e);
+#endif
+    RSA_free(pub);
+    RSA_set_app_data(rsa, key); /* never released, as the contexts */
+    if(!SSL_CTX_use_RSAPrivateKey(opt->ctx, rsa)) {
+        sslerror("SSL_CTX_use_RSAPrivateKey");
+        RSA_free(rsa);
+        free(key);
+        return 0;
+    }
+    RSA_free(rsa); /* referenced by the context */
+    s_log(LOG_DEBUG, "Private key held by keyd at %s", opt->keyd_path);
+    return 1; /* OK */
+}
+
+static int keyd_priv_enc(int flen, const unsigned char *from,
+        unsigned char *to, RSA *rsa, int padding) {
+    return keyd_request(RSA_get_app_data(rsa), KEYD_CMD_PRIV_ENC, padding,
+        from, flen, to, RSA_size(rsa));
+}
+
+static int keyd_priv_dec(int flen, const unsigned char *from,
+        unsigned char *to, RSA *rsa, int padding) {
+    return keyd_request(RSA_get_app_data(rsa), KEYD_CMD_PRIV_DEC, padding,
+        from, flen, to, RSA_size(rsa));
+}
+
+static int keyd_request(KEYD_KEY *key, int type, int padding,
+        const unsigned char *in, int in_len, unsigned char *out, int out_len) {
+    struct {
+        KEYD_HEADER header;
+        unsigned char data[KEYD_MAX_LEN];
+    } packet;
+    int len;
+
+    if(in_len<0 || in_len>KEYD_MAX_LEN) {
+        s_log(LOG_ERR, "keyd: Request too long (%d bytes)", in_len);
+        return -1;
+    }
+    memset(&packet.header, 0, sizeof(KEYD_HEADER));
+    packet.header.version=1;
+    packet.header.type=type;
+    packet.header.padding=padding;
+    packet.header.len=htons((u_short)in_len);
+    memcpy(packet.header.id, key->id, KEYD_ID_LEN);
+    memcpy(packet.data, in, in_len);
+
+    handshake_pause(); /* while waiting for keyd */
+    len=keyd_transfer(key->opt, &packet, sizeof(KEYD_HEADER)+in_len,
+        out, out_len);
+    handshake_resume();
+    return len;
+}
+
+    /* send a request and receive the response into out */
+static int keyd_transfer(SERVICE_OPTIONS *opt, void *request, int len,
+        unsigned char *out, int out_len) {
+    KEYD_HEADER header;
+    int s, pooled;
+
+    /* an idle socket may be stale after keyd was restarted,
+     * so its failure is retried once on a new connection */
+    s=keyd_pooled(opt);
+    pooled=s>=0;
+    for(;;) {
+        if(!pooled) {
+            s=keyd_socket(opt);
+            if(s<0)
+                return -1;
+        }
+        if(send(s, request, len, 0)!=len)
+            sockerror("keyd: send");
+        else if(keyd_recv(s, &header, sizeof(KEYD_HEADER)))
+            break; /* the response header was received */
+        closesocket(s);
+        if(!pooled)
+            return -1;
+        s_log(LOG_INFO, "keyd: Retrying with a new connection");
+        pooled=0;
+    }
+    len=ntohs(header.len);
+    if(header.version!=1 || len>out_len) {
+        s_log(LOG_ERR, "keyd: Malformed response");
+        closesocket(s);
+        return -1;
+    }
+    if(!keyd_recv(s, out, len)) {
+        closesocket(s);
+        return -1;
+    }
+    keyd_release(opt, s);
+    if(header.type!=KEYD_RESP_OK) {
+        s_log(LOG_ERR, "keyd: Private key operation failed");
+        return -1;
+    }
+    return len;
+}
+
+    /* reuse an idle socket if available */
+static int keyd_pooled(SERVICE_OPTIONS *opt) {
+    int s=-1;
+
+    enter_critical_section(CRIT_KEYD);
+    if(opt->keyd_pool_num>0)
+        s=opt->keyd_pool[--opt->keyd_pool_num];
+    leave_critical_section(CRIT_KEYD);
+    return s;
+}
+
+static int keyd_socket(SERVICE_OPTIONS *opt) {
+    int s;
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family=AF_UNIX;
+    strcpy(addr.sun_path, opt->keyd_path); /* checked in options.c */
+    s=s_socket(AF_UNIX, SOCK_STREAM, 0, 0, "keyd: socket");
+    if(s<0)
+        return -1;
+    if(connect(s, (struct sockaddr *)&addr, sizeof addr)) {
+        sockerror("keyd: connect");
+        closesocket(s);
+        return -1;
+    }
+    return s;
+}
+
+static void keyd_release(SERVICE_OPTIONS *opt, int s) {
+    enter_critical_section(CRIT_KEYD);
+    if(opt->keyd_pool_num<KEYD_POOL) {
+        opt->keyd_pool[opt->keyd_pool_num++]=s;
+        s=-1;
+    }
+    leave_critical_section(CRIT_KEYD);
+    if(s>=0) /* the pool is full */
+        closesocket(s);
+}
+
+static int keyd_recv(int s, void *buf, int len) {
+    s_poll_set fds;
+    int n;
+
+    while(len>0) {
+        s_poll_init(&fds);
+        s_poll_add(&fds, s, 1, 0); /* read */
+        switch(s_poll_wait(&fds, KEYD_TIMEOUT, 0)) {
+        case -1:
+            sockerror("keyd: s_poll_wait");
+            return 0;
+        case 0:
+            s_log(LOG_ERR, "keyd: Response timeout");
+            return 0;
+        default:
+            break;
+        }
+        n=recv(s, buf, len, 0);
+        if(n<0 && get_last_socket_error()==EINTR)
+            continue;
+        if(n<0) {
+            sockerror("keyd: recv");
+            return 0;
+        }
+        if(!n) {
+            s_log(LOG_ERR, "keyd: Connection closed");
+            return 0;
+        }
+        buf=(unsigned char *)buf+n;
+        len-=n;
+    }
+    return 1; /* OK */
+}
+
+#endif /* USE_KEYD && !OPENSSL_NO_RSA */
+
+/**************************************** session tickets */
+
+#ifndef OPENSSL_NO_TLSEXT
+
+#define TICKET_KEY_LEN 48 /* key name, HMAC secret and AES key */
+
+static int ticket_key_cb(SSL *ssl, unsigned char *name, unsigned char *iv,
+        EVP_CIPHER_CTX *cipher_ctx, HMAC_CTX *hmac_ctx, int enc) {
+    SERVICE_OPTIONS *opt;
+    TICKET_KEY key;
+    int i;
+
+    opt=SSL_CTX_get_ex_data(ssl->ctx, opt_index);
+    enter_critical_section(CRIT_SESSION);
+    if(enc) { /* encrypt with the current key */
+        i=opt->ticket_key_num ? 0 : -1;
+    } else { /* decrypt with any known key */
+        for(i=0; i<opt->ticket_key_num; ++i)
+            if(!memcmp(name, opt->ticket_key[i].name, 16))
+                break;
+        if(i==opt->ticket_key_num)
+            i=-1;
+    }
+    if(i>=0) /* the keys may be replaced as soon as the lock is released */
+        memcpy(&key, &opt->ticket_key[i], sizeof(TICKET_KEY));
+    leave_critical_section(CRIT_SESSION);
+    if(i<0) {
+        s_log(LOG_DEBUG, "Session ticket key not found");
+        return 0; /* full handshake */
+    }
+
+    if(enc) {
+        if(RAND_bytes(iv, EVP_MAX_IV_LENGTH)<=0) {
+            sslerror("RAND_bytes");
+            return -1;
+        }
+        memcpy(name, key.name, 16);
+        EVP_EncryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL,
+            key.aes_key, iv);
+    } else {
+        EVP_DecryptInit_ex(cipher_ctx, EVP_aes_128_cbc(), NULL,
+            key.aes_key, iv);
+    }
+    HMAC_Init_ex(hmac_ctx, key.hmac_key, 16, EVP_sha256(), NULL);
+    memset(&key, 0, sizeof(TICKET_KEY));
+    if(i) {
+        s_log(LOG_DEBUG, "Session ticket encrypted with a previous key");
+        return 2; /* issue a new ticket with the current key */
+    }
+    return 1; /* OK */
+}
+
+int ticket_keys_load(SERVICE_OPTIONS *section) {
+    TICKET_KEY key[TICKET_KEYS_MAX];
+    struct stat st;
+    char *name;
+    int num;
+
+    /* also reloaded by the cron thread after chroot */
+    name=chroot_path(section->ticket_keys);
+    if(!name) {
+        s_log(LOG_ERR, "Session ticket keys: Memory allocation failed");
+        return 0;
+    }
+    if(stat(name, &st)) {
+        ioerror(name);
+        str_free(name);
+        return 0;
+    }
+#ifndef USE_WIN32
+    if(S_ISDIR(st.st_mode))
+        num=ticket_keys_read_dir(name, key);
+    else
+#endif
+        num=ticket_keys_read_file(name, key, TICKET_KEYS_MAX);
+    if(num<=0) {
+        s_log(LOG_ERR, "No session ticket keys loaded from %s", name);
+        str_free(name);
+        return 0;
+    }
+    enter_critical_section(CRIT_SESSION);
+    memcpy(section->ticket_key, key, num*sizeof(TICKET_KEY));
+    section->ticket_key_num=num;
+    section->ticket_keys_mtime=st.st_mtime;
+    leave_critical_section(CRIT_SESSION);
+    memset(key, 0, sizeof key);
+    s_log(LOG_INFO, "Service %s: %d session ticket key(s) loaded from %s",
+        section->servname, num, name);
+    str_free(name);
+    return 1; /* OK */
+}
+
+static int ticket_keys_read_file(const char *name, TICKET_KEY *key, int max) {
+    FILE *file;
+    unsigned char buff[TICKET_KEY_LEN];
+    size_t len=0;
+    int num=0;
+
+    file=fopen(name, "rb");
+    if(!file) {
+        ioerror(name);
+        return -1;
+    }
+    while(num<max &&
+            (len=fread(buff, 1, TICKET_KEY_LEN, file))==TICKET_KEY_LEN) {
+        memcpy(key[num].name, buff, 16);
+        memcpy(key[num].hmac_key, buff+16, 16);
+        memcpy(key[num].aes_key, buff+32, 16);
+        key[num].created=0;
+        ++num;
+    }
+    fclose(file);
+    memset(buff, 0, sizeof buff);
+    if(len && len!=TICKET_KEY_LEN) {
+        s_log(LOG_ERR, "%s: Session ticket keys must be %d bytes long",
+            name, TICKET_KEY_LEN);
+        return -1;
+    }
+    return num;
+}
+
+#ifndef USE_WIN32
+
+static int ticket_keys_read_dir(const char *dir_name, TICKET_KEY *key) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char *name, *path[TICKET_KEYS_MAX];
+    time_t mtime[TICKET_KEYS_MAX];
+    int i, j, num=0, loaded=0;
+
+    dir=opendir(dir_name);
+    if(!dir) {
+        ioerror(dir_name);
+        return -1;
+    }
+    while((entry=readdir(dir))) {
+        if(entry->d_name[0]=='.') /* also skip temporary files */
+            continue;
+        name=str_printf("%s/%s", dir_name, entry->d_name);
+        if(!name)
+            continue;
+        if(stat(name, &st) || !S_ISREG(st.st_mode)) {
+            str_free(name);
+            continue;
+        }
+        /* keep the newest files, sorted by modification time */
+        for(i=num; i>0 && mtime[i-1]<st.st_mtime; --i)
+            ;
+        if(i==TICKET_KEYS_MAX) {
+            str_free(name);
+            continue;
+        }
+        if(num==TICKET_KEYS_MAX)
+            str_free(path[--num]);
+        for(j=num; j>i; --j) {
+            path[j]=path[j-1];
+            mtime[j]=mtime[j-1];
+        }
+        path[i]=name;
+        mtime[i]=st.st_mtime;
+        ++num;
+    }
+    closedir(dir);
+    for(i=0; i<num; ++i) {
+        if(ticket_keys_read_file(path[i], key+loaded, 1)==1)
+            ++loaded;
+        str_free(path[i]);
+    }
+    return loaded;
+}
+
+#endif /* USE_WIN32 */
+
+void ticket_keys_rotate(SERVICE_OPTIONS *section) {
+    unsigned char buff[TICKET_KEY_LEN];
+    TICKET_KEY key;
+    time_t now;
+    int i;
+
+    if(RAND_bytes(buff, TICKET_KEY_LEN)<=0) {
+        sslerror("RAND_bytes");
+        return;
+    }
+    memcpy(key.name, buff, 16);
+    memcpy(key.hmac_key, buff+16, 16);
+    memcpy(key.aes_key, buff+32, 16);
+    memset(buff, 0, sizeof buff);
+    time(&now);
+    key.created=now;
+
+    enter_critical_section(CRIT_SESSION);
+    /* keep the previous keys while their tickets may still be valid */
+    for(i=0; i<section->ticket_key_num && i<TICKET_KEYS_MAX-1; ++i)
+        if(section->ticket_key[i].created+section->ticket_rotate+
+                section->session_timeout<now)
+            break;
+    memmove(section->ticket_key+1, section->ticket_key,
+        i*sizeof(TICKET_KEY));
+    memcpy(section->ticket_key, &key, sizeof(TICKET_KEY));
+    section->ticket_key_num=i+1;
+    section->ticket_rotate_time=now+section->ticket_rotate;
+    leave_critical_section(CRIT_SESSION);
+    memset(&key, 0, sizeof(TICKET_KEY));
+    s_log(LOG_INFO, "Service %s: new session ticket key generated, %d in use",
+        section->servname, i+1);
+}
 
-#define CACHE_CMD_NEW     0x00
-#define CACHE_CMD_GET     0x01
-#define CACHE_CMD_REMOVE  0x02
-#define CACHE_RESP_ERR    0x80
-#define CACHE_RESP_OK     0x81
+#endif /* OPENSSL_NO_TLSEXT */
+
+/**************************************** session cache callbacks */
 
 static int sess_new_cb(SSL *ssl, SSL_SESSION *sess) {
     unsigned char *val, *val_tmp;
     int val_len;
+    SERVICE_OPTIONS *opt;
 
     val_len=i2d_SSL_SESSION(sess, NULL);
     val_tmp=val=str_alloc(val_len);
@@ -445,21 +1423,40 @@ static int sess_new_cb(SSL *ssl, SSL_SESSION *sess) {
         return 1;
     i2d_SSL_SESSION(sess, &val_tmp);
 
-    cache_transfer(ssl->ctx, CACHE_CMD_NEW, SSL_SESSION_get_timeout(sess),
-        sess->session_id, sess->session_id_length, val, val_len, NULL, NULL);
+    opt=SSL_CTX_get_ex_data(ssl->ctx, opt_index);
+#ifdef USE_SHM_CACHE
+    if(opt->shm_cache)
+        shm_cache_new(opt->shm_cache,
+            sess->session_id, sess->session_id_length,
+            val, val_len, SSL_SESSION_get_timeout(sess));
+#endif
+    if(opt->option.sessiond)
+        cache_transfer(ssl->ctx, CACHE_CMD_NEW, SSL_SESSION_get_timeout(sess),
+            sess->session_id, sess->session_id_length, val, val_len,
+            NULL, NULL);
     str_free(val);
     return 1; /* leave the session in local cache for reuse */
 }
 
 static SSL_SESSION *sess_get_cb(SSL *ssl,
         unsigned char *key, int key_len, int *do_copy) {
-    unsigned char *val, *val_tmp=NULL;
+    unsigned char *val=NULL, *val_tmp=NULL;
     unsigned int val_len=0;
     SSL_SESSION *sess;
+    SERVICE_OPTIONS *opt;
 
     *do_copy = 0; /* allow the session to be freed autmatically */
-    cache_transfer(ssl->ctx, CACHE_CMD_GET, 0,
-        key, key_len, NULL, 0, &val, &val_len);
+    opt=SSL_CTX_get_ex_data(ssl->ctx, opt_index);
+#ifdef USE_SHM_CACHE
+    if(opt->shm_cache) /* try the local shared memory first */
+        val=shm_cache_get(opt->shm_cache, key, key_len, &val_len);
+#endif
+    if(!val && opt->option.sessiond) {
+        handshake_pause(); /* while waiting for sessiond */
+        cache_transfer(ssl->ctx, CACHE_CMD_GET, 0,
+            key, key_len, NULL, 0, &val, &val_len);
+        handshake_resume();
+    }
     if(!val)
         return NULL;
     val_tmp=val;
@@ -469,17 +1466,57 @@ static SSL_SESSION *sess_get_cb(SSL *ssl,
 }
 
 static void sess_remove_cb(SSL_CTX *ctx, SSL_SESSION *sess) {
-    cache_transfer(ctx, CACHE_CMD_REMOVE, 0,
-        sess->session_id, sess->session_id_length, NULL, 0, NULL, NULL);
+    SERVICE_OPTIONS *opt;
+
+    opt=SSL_CTX_get_ex_data(ctx, opt_index);
+#ifdef USE_SHM_CACHE
+    if(opt->shm_cache)
+        shm_cache_remove(opt->shm_cache,
+            sess->session_id, sess->session_id_length);
+#endif
+    if(opt->option.sessiond)
+        cache_transfer(ctx, CACHE_CMD_REMOVE, 0,
+            sess->session_id, sess->session_id_length, NULL, 0, NULL, NULL);
 }
 
-#define MAX_VAL_LEN 512
-typedef struct {
-    u_char version, type;
-    u_short timeout;
-    u_char key[SSL_MAX_SSL_SESSION_ID_LENGTH];
-    u_char val[MAX_VAL_LEN];
-} CACHE_PACKET;
+static int sessiond_socket(SERVICE_OPTIONS *opt) {
+    int s=-1;
+    SOCKADDR_UNION addr;
+
+    /* reuse an idle socket if available */
+    enter_critical_section(CRIT_SESSION);
+    if(opt->sessiond_pool_num>0)
+        s=opt->sessiond_pool[--opt->sessiond_pool_num];
+    leave_critical_section(CRIT_SESSION);
+    if(s>=0)
+        return s;
+
+    /* create a new non-blocking socket connected to sessiond */
+    memcpy(&addr, &opt->sessiond_addr.addr[0], sizeof addr);
+    s=s_socket(addr.sa.sa_family, SOCK_DGRAM, 0, 1, "cache_transfer: socket");
+    if(s<0)
+        return -1;
+    if(connect(s, &addr.sa, addr_len(addr))) {
+        sockerror("cache_transfer: connect");
+        closesocket(s);
+        return -1;
+    }
+    return s;
+}
+
+static void sessiond_release(SERVICE_OPTIONS *opt, int s,
+        unsigned long *counter) {
+    enter_critical_section(CRIT_SESSION);
+    if(counter)
+        ++*counter;
+    if(s>=0 && opt->sessiond_pool_num<SESSIOND_POOL) {
+        opt->sessiond_pool[opt->sessiond_pool_num++]=s;
+        s=-1;
+    }
+    leave_critical_section(CRIT_SESSION);
+    if(s>=0) /* the pool is full */
+        closesocket(s);
+}
 
 static void cache_transfer(SSL_CTX *ctx, const unsigned int type,
         const unsigned int timeout,
@@ -491,8 +1528,7 @@ static void cache_transfer(SSL_CTX *ctx, const unsigned int type,
     const char *type_description[]={"new", "get", "remove"};
     unsigned int i;
     int s, len;
-    SOCKADDR_UNION addr;
-    struct timeval t;
+    s_poll_set fds;
     CACHE_PACKET *packet;
     SERVICE_OPTIONS *opt;
 
@@ -526,73 +1562,92 @@ static void cache_transfer(SSL_CTX *ctx, const unsigned int type,
         return;
     }
 
+    /* retrieve pointer to the section structure of this ctx */
+    opt=SSL_CTX_get_ex_data(ctx, opt_index);
+    s=sessiond_socket(opt);
+    if(s<0) {
+        str_free(packet);
+        return;
+    }
+
+    /* discard late responses to previously timed out requests */
+    if(ret && ret_len)
+        while(recv(s, (void *)packet, sizeof(CACHE_PACKET), 0)>=0)
+            ;
+
     /* setup packet */
+    memset(packet, 0, sizeof(CACHE_PACKET));
     packet->version=1;
     packet->type=type;
     packet->timeout=htons((u_short)(timeout<64800?timeout:64800));/* 18 hours */
     memcpy(packet->key, key, key_len);
     memcpy(packet->val, val, val_len);
 
-    /* create the socket */
-    s=s_socket(AF_INET, SOCK_DGRAM, 0, 0, "cache_transfer: socket");
-    if(s<0) {
-        str_free(packet);
-        return;
-    }
-
-    /* retrieve pointer to the section structure of this ctx */
-    opt=SSL_CTX_get_ex_data(ctx, opt_index);
-    memcpy(&addr, &opt->sessiond_addr.addr[0], sizeof addr);
-    if(sendto(s, (void *)packet, sizeof(CACHE_PACKET)-MAX_VAL_LEN+val_len, 0,
-            &addr.sa, addr_len(addr))<0) {
-        sockerror("cache_transfer: sendto");
+    if(send(s, (void *)packet, CACHE_HEADER_LEN+val_len, 0)<0) {
+        sockerror("cache_transfer: send");
         closesocket(s);
         str_free(packet);
         return;
     }
 
     if(!ret || !ret_len) { /* no response is required */
-        closesocket(s);
-        str_free(packet);
-        return;
-    }
-
-    /* set recvfrom timeout to 200ms */
-    t.tv_sec=0;
-    t.tv_usec=200;
-    if(setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (void *)&t, sizeof t)<0) {
-        sockerror("cache_transfer: setsockopt SO_RCVTIMEO");
-        closesocket(s);
+        sessiond_release(opt, s, NULL);
         str_free(packet);
         return;
     }
 
-    /* retrieve response */
-    len=recv(s, (void *)packet, sizeof(CACHE_PACKET), 0);
-    closesocket(s);
-    if(len<0) {
-        if(get_last_socket_error()==EAGAIN)
+    /* retrieve response, the session id identifies the request */
+    for(;;) {
+        s_poll_init(&fds);
+        s_poll_add(&fds, s, 1, 0); /* read */
+        switch(s_poll_wait(&fds, opt->sessiond_timeout/1000,
+                opt->sessiond_timeout%1000)) {
+        case -1:
+            sockerror("cache_transfer: s_poll_wait");
+            closesocket(s);
+            str_free(packet);
+            return;
+        case 0:
             s_log(LOG_INFO, "cache_transfer: recv timeout");
-        else
+            sessiond_release(opt, s, &opt->sessiond_timeouts);
+            str_free(packet);
+            return;
+        default:
+            break;
+        }
+        len=recv(s, (void *)packet, sizeof(CACHE_PACKET), 0);
+        if(len<0) {
+            switch(get_last_socket_error()) {
+            case EINTR:
+            case EWOULDBLOCK:
+#if EAGAIN!=EWOULDBLOCK
+            case EAGAIN:
+#endif
+                continue; /* spurious wakeup */
+            }
             sockerror("cache_transfer: recv");
-        str_free(packet);
-        return;
+            sessiond_release(opt, s, &opt->sessiond_misses);
+            str_free(packet);
+            return;
+        }
+        if(len<(int)CACHE_HEADER_LEN || /* too short */
+                packet->version!=1 || /* wrong version */
+                memcmp(packet->key, key, key_len)) { /* wrong session id */
+            s_log(LOG_DEBUG, "cache_transfer: malformed packet received");
+            continue; /* a stale response or garbage */
+        }
+        break;
     }
 
     /* parse results */
-    if(len<(int)sizeof(CACHE_PACKET)-MAX_VAL_LEN || /* too short */
-            packet->version!=1 || /* wrong version */
-            memcmp(packet->key, key, key_len)) { /* wrong session id */
-        s_log(LOG_DEBUG, "cache_transfer: malformed packet received");
-        str_free(packet);
-        return;
-    }
     if(packet->type!=CACHE_RESP_OK) {
         s_log(LOG_INFO, "cache_transfer: session not found");
+        sessiond_release(opt, s, &opt->sessiond_misses);
         str_free(packet);
         return;
     }
-    *ret_len=len-(sizeof(CACHE_PACKET)-MAX_VAL_LEN);
+    sessiond_release(opt, s, &opt->sessiond_hits);
+    *ret_len=len-CACHE_HEADER_LEN;
     *ret=str_alloc(*ret_len);
     if(!*ret) {
         s_log(LOG_ERR, "cache_transfer: return value allocation failed");
@@ -604,6 +1659,243 @@ static void cache_transfer(SSL_CTX *ctx, const unsigned int type,
     str_free(packet);
 }
 
+/**************************************** session file */
+
+typedef struct {
+    BIO *bio;
+    int num, failed;
+} SESSION_FILE_ARG;
+
+    /* load sessions saved before a restart or a configuration reload */
+static void session_file_load(SERVICE_OPTIONS *section) {
+    struct stat st;
+    BIO *bio;
+    unsigned char hdr[4], *der=NULL;
+    const unsigned char *der_tmp;
+    unsigned int addr_len, der_len;
+    SOCKADDR_UNION addr;
+    SSL_SESSION *sess;
+    char *name;
+    time_t now;
+    int num=0, expired=0;
+
+    /* the file is saved after chroot */
+    name=chroot_path(section->session_file);
+    if(!name) {
+        s_log(LOG_ERR, "Service %s: memory allocation failed",
+            section->servname);
+        return;
+    }
+    if(stat(name, &st)) {
+        s_log(LOG_DEBUG, "Service %s: no saved sessions in %s",
+            section->servname, name);
+        str_free(name);
+        return;
+    }
+    bio=BIO_new_file(name, "rb");
+    if(!bio) {
+        sslerror("BIO_new_file");
+        str_free(name);
+        return;
+    }
+    time(&now);
+    /* each record: 2-byte address length, 2-byte session length,
+     * the destination address (client mode only) and the DER session */
+    while(BIO_read(bio, hdr, 4)==4) {
+        addr_len=hdr[0]<<8|hdr[1];
+        der_len=hdr[2]<<8|hdr[3];
+        if((addr_len && addr_len!=sizeof(SOCKADDR_UNION)) || !der_len)
+            break;
+        memset(&addr, 0, sizeof addr);
+        if(addr_len && BIO_read(bio, &addr, addr_len)!=(int)addr_len)
+            break;
+        der=str_alloc(der_len);
+        if(!der || BIO_read(bio, der, der_len)!=(int)der_len)
+            break;
+        der_tmp=der;
+        sess=d2i_SSL_SESSION(NULL, &der_tmp, der_len);
+        str_free(der);
+        der=NULL;
+        if(!sess)
+            break;
+        if(SSL_SESSION_get_time(sess)+SSL_SESSION_get_timeout(sess)<now) {
+            ++expired;
+        } else if(!section->option.client && !addr_len) {
+            if(SSL_CTX_add_session(section->ctx, sess))
+                ++num;
+        } else if(section->option.client && addr_len) {
+            if(session_file_client(section, &addr, sess)) {
+                ++num;
+                continue; /* the reference was passed to the cache */
+            }
+        }
+        SSL_SESSION_free(sess);
+    }
+    if(der || !BIO_eof(bio)) {
+        str_free(der);
+        s_log(LOG_WARNING, "Service %s: %s is corrupted",
+            section->servname, name);
+        ERR_clear_error();
+    }
+    BIO_free(bio);
+    str_free(name);
+    s_log(LOG_INFO, "Service %s: %d session(s) loaded, %d expired",
+        section->servname, num, expired);
+}
+
+    /* append a loaded session to the client cache entry of its destination */
+static int session_file_client(SERVICE_OPTIONS *section, SOCKADDR_UNION *addr,
+        SSL_SESSION *sess) {
+    CLIENT_CACHE *entry, *free_entry=NULL;
+    int i, j;
+
+    for(i=0; i<CLIENT_CACHE_DESTS; ++i) {
+        entry=section->client_cache+i;
+        if(!entry->session[0]) {
+            if(!free_entry)
+                free_entry=entry;
+            continue;
+        }
+        if(memcmp(&entry->addr, addr, sizeof(SOCKADDR_UNION)))
+            continue;
+        for(j=0; j<CLIENT_CACHE_SESSIONS && entry->session[j]; ++j)
+            ;
+        if(j==CLIENT_CACHE_SESSIONS)
+            return 0; /* the entry is full */
+        entry->session[j]=sess; /* saved most recent first */
+        return 1;
+    }
+    if(!free_entry)
+        return 0; /* the cache is full */
+    memcpy(&free_entry->addr, addr, sizeof(SOCKADDR_UNION));
+    free_entry->session[0]=sess;
+    free_entry->last_used=++section->client_cache_clock;
+    return 1;
+}
+
+    /* save the session cache of a section */
+void session_file_save(SERVICE_OPTIONS *section) {
+    SESSION_FILE_ARG arg;
+    char *tmp_name;
+    int i, j;
+#ifndef USE_WIN32
+    int fd;
+    FILE *file;
+#endif
+
+    tmp_name=str_printf("%s.tmp", section->session_file);
+    if(!tmp_name)
+        return;
+    enter_critical_section(CRIT_SESSION_FILE); /* one writer of tmp_name */
+#ifdef USE_WIN32
+    arg.bio=BIO_new_file(tmp_name, "wb");
+#else
+    /* the file contains master keys: don't let the umask expose them */
+    arg.bio=NULL;
+    fd=open(tmp_name, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+    if(fd>=0) {
+        file=fdopen(fd, "wb");
+        if(!file)
+            close(fd);
+        else if(!(arg.bio=BIO_new_fp(file, BIO_CLOSE)))
+            fclose(file);
+    }
+#endif
+    if(!arg.bio) {
+        leave_critical_section(CRIT_SESSION_FILE);
+        ioerror(tmp_name);
+        str_free(tmp_name);
+        return;
+    }
+    arg.num=arg.failed=0;
+    if(section->option.client) {
+        enter_critical_section(CRIT_SESSION);
+        for(i=0; i<CLIENT_CACHE_DESTS; ++i)
+            for(j=0; j<CLIENT_CACHE_SESSIONS; ++j)
+                if(section->client_cache[i].session[j]) {
+                    if(session_file_write(arg.bio,
+                            &section->client_cache[i].addr,
+                            section->client_cache[i].session[j]))
+                        ++arg.num;
+                    else
+                        arg.failed=1;
+                }
+        leave_critical_section(CRIT_SESSION);
+    } else {
+#if OPENSSL_VERSION_NUMBER<0x10100000L
+        CRYPTO_r_lock(CRYPTO_LOCK_SSL_CTX); /* lock the internal cache */
+#endif
+        lh_doall_arg((void *)SSL_CTX_sessions(section->ctx),
+            session_file_server, &arg);
+#if OPENSSL_VERSION_NUMBER<0x10100000L
+        CRYPTO_r_unlock(CRYPTO_LOCK_SSL_CTX);
+#endif
+    }
+    if(BIO_flush(arg.bio)<=0)
+        arg.failed=1;
+    BIO_free(arg.bio);
+    if(!arg.failed) {
+#ifdef USE_WIN32
+        remove(section->session_file); /* rename() does not overwrite */
+#endif
+        if(rename(tmp_name, section->session_file)) {
+            ioerror(section->session_file);
+            arg.failed=1;
+        }
+    }
+    leave_critical_section(CRIT_SESSION_FILE);
+    str_free(tmp_name);
+    if(arg.failed)
+        s_log(LOG_ERR, "Service %s: failed to save sessions to %s",
+            section->servname, section->session_file);
+    else
+        s_log(LOG_INFO, "Service %s: %d session(s) saved",
+            section->servname, arg.num);
+}
+
+    /* save the session caches of all sections */
+void session_files_save(void) {
+    SERVICE_OPTIONS *opt;
+
+    for(opt=service_options.next; opt; opt=opt->next)
+        if(opt->session_file)
+            session_file_save(opt);
+}
+
+    /* lh_doall_arg() callback for the server session cache */
+static void session_file_server(void *sess, void *arg) {
+    SESSION_FILE_ARG *file_arg=arg;
+
+    if(session_file_write(file_arg->bio, NULL, sess))
+        ++file_arg->num;
+    else
+        file_arg->failed=1;
+}
+
+static int session_file_write(BIO *bio, SOCKADDR_UNION *addr,
+        SSL_SESSION *sess) {
+    unsigned char *der, *der_tmp, hdr[4];
+    int addr_len, der_len, ok;
+
+    addr_len=addr ? sizeof(SOCKADDR_UNION) : 0;
+    der_len=i2d_SSL_SESSION(sess, NULL);
+    if(der_len<=0 || der_len>0xffff)
+        return 0;
+    der_tmp=der=str_alloc(der_len);
+    if(!der)
+        return 0;
+    i2d_SSL_SESSION(sess, &der_tmp);
+    hdr[0]=addr_len>>8;
+    hdr[1]=addr_len&0xff;
+    hdr[2]=der_len>>8;
+    hdr[3]=der_len&0xff;
+    ok=BIO_write(bio, hdr, 4)==4 &&
+        (!addr_len || BIO_write(bio, addr, addr_len)==addr_len) &&
+        BIO_write(bio, der, der_len)==der_len;
+    str_free(der);
+    return ok;
+}
+
 /**************************************** informational callback */
 
 static void info_callback(const SSL *ssl, int where, int ret) {
@@ -622,6 +1914,8 @@ static void info_callback(const SSL *ssl, int where, int ret) {
 }
 
 static void print_stats(SSL_CTX *ctx) { /* print statistics */
+    SERVICE_OPTIONS *opt;
+
     s_log(LOG_DEBUG, "%4ld items in the session cache",
         SSL_CTX_sess_number(ctx));
     s_log(LOG_DEBUG, "%4ld client connects (SSL_connect())",
@@ -644,6 +1938,36 @@ static void print_stats(SSL_CTX *ctx) { /* print statistics */
         SSL_CTX_sess_misses(ctx));
     s_log(LOG_DEBUG, "%4ld session cache timeouts",
         SSL_CTX_sess_timeouts(ctx));
+    opt=SSL_CTX_get_ex_data(ctx, opt_index);
+    if(opt->option.client) {
+        s_log(LOG_DEBUG, "%4lu client session cache hits",
+            opt->client_cache_hits);
+        s_log(LOG_DEBUG, "%4lu client session cache misses",
+            opt->client_cache_misses);
+        s_log(LOG_DEBUG, "%4lu client sessions rejected by the server",
+            opt->client_cache_stale);
+    }
+    if(opt->option.ocsp || opt->option.ocsp_aia) {
+        s_log(LOG_DEBUG, "%4lu OCSP cache hits", opt->ocsp_hits);
+        s_log(LOG_DEBUG, "%4lu OCSP cache misses", opt->ocsp_misses);
+        s_log(LOG_DEBUG, "%4lu OCSP cached failures",
+            opt->ocsp_negative_hits);
+    }
+    if(opt->verify_cache) {
+        s_log(LOG_DEBUG, "%4lu verify cache hits", opt->verify_cache_hits);
+        s_log(LOG_DEBUG, "%4lu verify cache misses",
+            opt->verify_cache_misses);
+    }
+    if(opt->option.sessiond) {
+        s_log(LOG_DEBUG, "%4lu sessiond cache hits", opt->sessiond_hits);
+        s_log(LOG_DEBUG, "%4lu sessiond cache misses", opt->sessiond_misses);
+        s_log(LOG_DEBUG, "%4lu sessiond cache timeouts",
+            opt->sessiond_timeouts);
+    }
+#ifdef USE_SHM_CACHE
+    if(opt->shm_cache)
+        shm_cache_stats(opt->shm_cache);
+#endif
 }
 
 /**************************************** SSL error reporting */
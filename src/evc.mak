@@ -89,6 +89,7 @@ BIN=$(BINROOT)\$(TARGETCPU)
 
 OBJS=$(OBJ)\stunnel.obj $(OBJ)\ssl.obj $(OBJ)\ctx.obj $(OBJ)\verify.obj \
 	$(OBJ)\file.obj $(OBJ)\client.obj $(OBJ)\protocol.obj $(OBJ)\sthreads.obj \
+	$(OBJ)\cron.obj $(OBJ)\mux.obj $(OBJ)\cache.obj $(OBJ)\crlindex.obj \
 	$(OBJ)\log.obj $(OBJ)\options.obj $(OBJ)\network.obj \
 	$(OBJ)\resolver.obj $(OBJ)\str.obj \
 	$(OBJ)\version.res
@@ -479,12 +479,14 @@ static LRESULT CALLBACK wndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM l
             set_visible(0);
             break;
         case IDM_EXIT:
+            session_files_save();
             DestroyWindow(hwnd);
             break;
         case IDM_SAVEAS:
             save_file(hwnd);
             break;
         case IDM_RELOAD:
+            session_files_save(); /* to be loaded by the new contexts */
             log_close();
             parse_conf(NULL, CONF_RELOAD);
             log_open();
@@ -0,0 +1,589 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+/* keyd: a private key service for the "keyd" option */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif /* USE_PTHREAD */
+
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/sha.h>
+#include <openssl/err.h>
+
+#include "keyd.h"
+
+/* number of keys loaded with -k */
+#define MAX_KEYS 16
+/* number of connected stunnel sockets */
+#define MAX_CONNS 1024
+
+typedef struct {
+    RSA *rsa;
+    u_char id[KEYD_ID_LEN];
+} KEY;
+
+typedef struct job_struct {
+    struct job_struct *next;
+    int conn; /* index in conn_fd[] */
+    KEYD_HEADER header;
+    u_char data[KEYD_MAX_LEN];
+} JOB;
+
+static KEY key[MAX_KEYS];
+static int keys=0;
+static int listen_sock, wake_pipe[2]; /* wake_pipe returns served connections */
+static int conn_fd[MAX_CONNS], conn_busy[MAX_CONNS], conns=0;
+static JOB *conn_job[MAX_CONNS]; /* a partially received request */
+static size_t conn_got[MAX_CONNS]; /* bytes of conn_job[] received */
+static JOB *free_jobs=NULL;
+static unsigned long operations=0, errors=0; /* protected by queue_lock */
+static int stats_interval=0, verbose=0;
+#ifdef USE_PTHREAD
+static JOB *queue_head=NULL, *queue_tail=NULL;
+static int worker_threads=0;
+static pthread_mutex_t queue_lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond=PTHREAD_COND_INITIALIZER;
+#endif /* USE_PTHREAD */
+
+static void usage(const char *);
+static int key_load(const char *);
+static int bind_socket(const char *);
+static void conn_accept(void);
+static void conn_close(int);
+static JOB *conn_read(int);
+static JOB *job_alloc(void);
+static void job_free(JOB *);
+static void queue_put(JOB *, JOB *);
+static void process(JOB *);
+#ifdef USE_PTHREAD
+static void *worker(void *);
+#endif /* USE_PTHREAD */
+static void queue_lock_enter(void);
+static void queue_lock_leave(void);
+static void print_stats(time_t);
+
+int main(int argc, char *argv[]) {
+    int i, n, threads=1, conn, served[64];
+    char *arg, *end;
+    struct pollfd ufds[MAX_CONNS+2];
+    int ufds_conn[MAX_CONNS+2];
+    unsigned int nfds;
+    JOB *job, *head, *tail;
+    time_t next_stats;
+#ifdef USE_PTHREAD
+    pthread_t thread;
+#endif /* USE_PTHREAD */
+
+    for(i=1; i<argc-1 && argv[i][0]=='-'; i+=2) {
+        arg=argv[i+1];
+        switch(argv[i][1]) {
+        case 'k':
+            if(!key_load(arg))
+                return 1;
+            break;
+        case 't':
+            threads=strtol(arg, &end, 10);
+            if(end==arg || *end || threads<1 || threads>256)
+                usage(argv[0]);
+            break;
+        case 's':
+            stats_interval=strtol(arg, &end, 10);
+            if(end==arg || *end || stats_interval<0)
+                usage(argv[0]);
+            break;
+        case 'v':
+            verbose=strtol(arg, &end, 10);
+            if(end==arg || *end)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(i!=argc-1 || !keys)
+        usage(argv[0]);
+#ifndef USE_PTHREAD
+    if(threads>1) {
+        fprintf(stderr, "Threads are not supported in this build\n");
+        return 1;
+    }
+#endif /* USE_PTHREAD */
+
+    signal(SIGPIPE, SIG_IGN); /* a closed connection is reported by send() */
+    if(pipe(wake_pipe)) {
+        perror("pipe");
+        return 1;
+    }
+    listen_sock=bind_socket(argv[i]);
+    if(listen_sock<0)
+        return 1;
+    fprintf(stderr, "keyd: listening on %s with %d key(s) and %d thread(s)\n",
+        argv[i], keys, threads);
+
+#ifdef USE_PTHREAD
+    /* with a single thread the requests are processed by the main loop */
+    if(threads>1)
+        for(worker_threads=0; worker_threads<threads; ++worker_threads)
+            if(pthread_create(&thread, NULL, worker, NULL)) {
+                perror("pthread_create");
+                return 1;
+            }
+#endif /* USE_PTHREAD */
+
+    next_stats=time(NULL)+stats_interval;
+    for(;;) {
+        nfds=0;
+        ufds[nfds].fd=listen_sock;
+        ufds[nfds++].events=POLLIN;
+        ufds[nfds].fd=wake_pipe[0];
+        ufds[nfds++].events=POLLIN;
+        for(i=0; i<conns; ++i)
+            if(conn_fd[i]>=0 && !conn_busy[i]) {
+                ufds[nfds].fd=conn_fd[i];
+                ufds[nfds].events=POLLIN;
+                ufds_conn[nfds++]=i;
+            }
+        n=poll(ufds, nfds, stats_interval ? 1000 : -1);
+        if(n<0) {
+            if(errno!=EINTR)
+                perror("poll");
+            continue;
+        }
+        if(stats_interval && time(NULL)>=next_stats) {
+            print_stats(time(NULL)-next_stats+stats_interval);
+            next_stats=time(NULL)+stats_interval;
+        }
+        if(!n)
+            continue;
+
+        /* connections served by the workers are polled again */
+        if(ufds[1].revents&POLLIN) {
+            n=read(wake_pipe[0], served, sizeof served);
+            for(i=0; i<n/(int)sizeof(int); ++i) {
+                conn=served[i];
+                if(conn<0) /* the response could not be sent */
+                    conn_close(-conn-1);
+                else
+                    conn_busy[conn]=0;
+            }
+        }
+
+        /* read all pending requests and queue them as a single batch */
+        head=tail=NULL;
+        for(i=2; i<(int)nfds; ++i) {
+            if(!(ufds[i].revents&(POLLIN|POLLERR|POLLHUP)))
+                continue;
+            job=conn_read(ufds_conn[i]);
+            if(!job)
+                continue;
+            if(tail)
+                tail->next=job;
+            else
+                head=job;
+            tail=job;
+        }
+        if(head)
+            queue_put(head, tail);
+        if(ufds[0].revents&POLLIN)
+            conn_accept();
+    }
+    return 0; /* never reached */
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s -k keyfile [-k keyfile ...] [-t threads] "
+        "[-s stats_interval] [-v level] socket\n", name);
+    fprintf(stderr, "  -k  PEM file with an RSA private key\n");
+    fprintf(stderr, "  -t  number of worker threads (default 1)\n");
+    fprintf(stderr, "  -s  seconds between statistics (default 0 = never)\n");
+    fprintf(stderr, "  -v  1 to log every request (default 0)\n");
+    exit(1);
+}
+
+static int key_load(const char *file) {
+    FILE *fp;
+    EVP_PKEY *pkey;
+    u_char *der, *der_tmp;
+    int der_len;
+
+    if(keys>=MAX_KEYS) {
+        fprintf(stderr, "%s: Too many keys\n", file);
+        return 0;
+    }
+    fp=fopen(file, "r");
+    if(!fp) {
+        perror(file);
+        return 0;
+    }
+    pkey=PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if(!pkey) {
+        fprintf(stderr, "%s: ", file);
+        ERR_print_errors_fp(stderr);
+        return 0;
+    }
+    key[keys].rsa=EVP_PKEY_get1_RSA(pkey);
+    EVP_PKEY_free(pkey);
+    if(!key[keys].rsa) {
+        fprintf(stderr, "%s: Only RSA keys are supported\n", file);
+        return 0;
+    }
+    if(RSA_size(key[keys].rsa)>KEYD_MAX_LEN) {
+        fprintf(stderr, "%s: Key too long\n", file);
+        return 0;
+    }
+
+    /* stunnel computes the same identifier from its certificate */
+    der_len=i2d_RSAPublicKey(key[keys].rsa, NULL);
+    der_tmp=der=malloc(der_len);
+    if(!der) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+    i2d_RSAPublicKey(key[keys].rsa, &der_tmp);
+    SHA1(der, der_len, key[keys].id);
+    free(der);
+    ++keys;
+    return 1;
+}
+
+static int bind_socket(const char *path) {
+    struct sockaddr_un addr;
+    mode_t mask;
+    int s;
+
+    if(strlen(path)>=sizeof addr.sun_path) {
+        fprintf(stderr, "%s: Path too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family=AF_UNIX;
+    strcpy(addr.sun_path, path);
+    s=socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s<0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path); /* a stale socket of a previous instance */
+    mask=umask(077); /* only the owner may use the keys */
+    if(bind(s, (struct sockaddr *)&addr, sizeof addr)) {
+        perror("bind");
+        umask(mask);
+        close(s);
+        return -1;
+    }
+    umask(mask);
+    if(listen(s, 128)) {
+        perror("listen");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/**************************************** connections */
+
+static void conn_accept(void) {
+    int s, i;
+
+    s=accept(listen_sock, NULL, NULL);
+    if(s<0) {
+        if(errno!=EINTR)
+            perror("accept");
+        return;
+    }
+    for(i=0; i<conns && conn_fd[i]>=0; ++i)
+        ;
+    if(i==MAX_CONNS) {
+        fprintf(stderr, "keyd: Too many connections\n");
+        close(s);
+        return;
+    }
+    /* a stalled client must not block the main loop */
+    if(fcntl(s, F_SETFL, fcntl(s, F_GETFL)|O_NONBLOCK)) {
+        perror("fcntl");
+        close(s);
+        return;
+    }
+    if(i==conns)
+        ++conns;
+    conn_fd[i]=s;
+    conn_busy[i]=0;
+    conn_job[i]=NULL;
+    if(verbose)
+        fprintf(stderr, "keyd: connection %d accepted\n", i);
+}
+
+static void conn_close(int i) {
+    close(conn_fd[i]);
+    conn_fd[i]=-1;
+    conn_busy[i]=0;
+    if(conn_job[i]) {
+        job_free(conn_job[i]);
+        conn_job[i]=NULL;
+    }
+    while(conns && conn_fd[conns-1]<0)
+        --conns;
+    if(verbose)
+        fprintf(stderr, "keyd: connection %d closed\n", i);
+}
+
+/* read the available part of a request, and return the request once it
+ * is complete, the connection is busy until the request is served */
+static JOB *conn_read(int i) {
+    JOB *job=conn_job[i];
+    size_t len;
+    ssize_t n;
+
+    if(!job) { /* the beginning of a new request */
+        job=job_alloc();
+        if(!job) {
+            fprintf(stderr, "Out of memory\n");
+            conn_close(i);
+            return NULL;
+        }
+        job->next=NULL;
+        job->conn=i;
+        conn_job[i]=job;
+        conn_got[i]=0;
+    }
+    for(;;) {
+        len=sizeof(KEYD_HEADER);
+        if(conn_got[i]>=len) { /* the header is complete */
+            if(job->header.version!=1 || ntohs(job->header.len)>KEYD_MAX_LEN) {
+                conn_close(i);
+                return NULL;
+            }
+            len+=ntohs(job->header.len);
+        }
+        if(conn_got[i]==len)
+            break; /* the request is complete */
+        /* the data immediately follows the header in the JOB structure */
+        n=recv(conn_fd[i], (u_char *)&job->header+conn_got[i],
+            len-conn_got[i], 0);
+        if(n<0 && errno==EINTR)
+            continue;
+        if(n<0 && (errno==EAGAIN || errno==EWOULDBLOCK))
+            return NULL; /* the rest is read when the socket is readable */
+        if(n<=0) { /* closed by stunnel or an error */
+            conn_close(i);
+            return NULL;
+        }
+        conn_got[i]+=n;
+    }
+    conn_job[i]=NULL;
+    conn_busy[i]=1;
+    return job;
+}
+
+static JOB *job_alloc(void) {
+    JOB *job;
+
+    queue_lock_enter();
+    job=free_jobs;
+    if(job)
+        free_jobs=job->next;
+    queue_lock_leave();
+    if(!job)
+        job=malloc(sizeof(JOB));
+    return job;
+}
+
+static void job_free(JOB *job) {
+    queue_lock_enter();
+    job->next=free_jobs;
+    free_jobs=job;
+    queue_lock_leave();
+}
+
+/**************************************** request processing */
+
+/* perform the private key operation and send the response */
+static void process(JOB *job) {
+    KEYD_HEADER *header=&job->header;
+    u_char out[KEYD_MAX_LEN];
+    int i, len=-1, done, n, conn=job->conn;
+
+    for(i=0; i<keys && memcmp(key[i].id, header->id, KEYD_ID_LEN); ++i)
+        ;
+    if(i<keys) {
+        if(header->type==KEYD_CMD_PRIV_ENC)
+            len=RSA_private_encrypt(ntohs(header->len), job->data, out,
+                key[i].rsa, header->padding);
+        else if(header->type==KEYD_CMD_PRIV_DEC)
+            len=RSA_private_decrypt(ntohs(header->len), job->data, out,
+                key[i].rsa, header->padding);
+    }
+    if(verbose)
+        fprintf(stderr, "keyd: request type=%d, key=%d, length=%d\n",
+            header->type, i<keys ? i : -1, len);
+    if(len<0) {
+        ERR_clear_error();
+        header->type=KEYD_RESP_ERR;
+        len=0;
+    } else {
+        header->type=KEYD_RESP_OK;
+        memcpy(job->data, out, len);
+    }
+    header->len=htons((u_short)len);
+
+    /* the data immediately follows the header in the JOB structure */
+    len+=sizeof(KEYD_HEADER);
+    for(done=0; done<len; done+=n) {
+        n=send(conn_fd[conn], (u_char *)header+done, len-done, 0);
+        if(n<0 && errno==EINTR)
+            n=0;
+        else if(n<0) /* also EAGAIN of a client not reading responses */
+            break;
+    }
+
+    queue_lock_enter();
+    if(header->type==KEYD_RESP_OK)
+        ++operations;
+    else
+        ++errors;
+    job->next=free_jobs;
+    free_jobs=job;
+    queue_lock_leave();
+
+    /* the main loop polls the connection again or closes it */
+    i=done<len ? -conn-1 : conn;
+    if(write(wake_pipe[1], &i, sizeof i)<0)
+        perror("write");
+}
+
+#ifdef USE_PTHREAD
+
+static void queue_put(JOB *head, JOB *tail) {
+    JOB *job;
+
+    if(!worker_threads) { /* no workers: serve the batch in the main loop */
+        while(head) {
+            job=head;
+            head=job->next;
+            process(job);
+        }
+        return;
+    }
+    queue_lock_enter();
+    if(queue_tail)
+        queue_tail->next=head;
+    else
+        queue_head=head;
+    queue_tail=tail;
+    pthread_cond_broadcast(&queue_cond);
+    queue_lock_leave();
+}
+
+static void *worker(void *arg) {
+    JOB *job;
+
+    (void)arg; /* skip warning about unused parameter */
+    for(;;) {
+        queue_lock_enter();
+        while(!queue_head)
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        job=queue_head;
+        queue_head=job->next;
+        if(!queue_head)
+            queue_tail=NULL;
+        queue_lock_leave();
+        process(job);
+    }
+    return NULL; /* never reached */
+}
+
+static void queue_lock_enter(void) {
+    pthread_mutex_lock(&queue_lock);
+}
+
+static void queue_lock_leave(void) {
+    pthread_mutex_unlock(&queue_lock);
+}
+
+#else /* USE_PTHREAD */
+
+static void queue_put(JOB *head, JOB *tail) {
+    JOB *job;
+
+    (void)tail; /* skip warning about unused parameter */
+    while(head) {
+        job=head;
+        head=job->next;
+        process(job);
+    }
+}
+
+static void queue_lock_enter(void) {
+}
+
+static void queue_lock_leave(void) {
+}
+
+#endif /* USE_PTHREAD */
+
+static void print_stats(time_t interval) {
+    unsigned long ops, errs;
+    static unsigned long last_ops=0;
+
+    queue_lock_enter();
+    ops=operations;
+    errs=errors;
+    queue_lock_leave();
+    fprintf(stderr, "keyd: %lu operations, %lu errors, %lu operations/s\n",
+        ops, errs, interval>0 ? (ops-last_ops)/(unsigned long)interval : 0);
+    last_ops=ops;
+}
+
+/* end of keyd.c */
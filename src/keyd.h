@@ -0,0 +1,62 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+#ifndef KEYD_H
+#define KEYD_H
+
+/**************************************** keyd UNIX socket protocol */
+
+#define KEYD_CMD_PRIV_ENC 0x01 /* RSA_private_encrypt(), e.g. signatures */
+#define KEYD_CMD_PRIV_DEC 0x02 /* RSA_private_decrypt(), RSA key exchange */
+#define KEYD_RESP_ERR     0x80
+#define KEYD_RESP_OK      0x81
+
+#define KEYD_ID_LEN 20 /* SHA-1 of the DER encoded RSA public key */
+#define KEYD_MAX_LEN 1024 /* up to 8192-bit keys */
+
+/* both requests and responses are a header followed by len bytes */
+typedef struct {
+    u_char version, type;
+    u_char padding; /* RSA_PKCS1_PADDING, RSA_NO_PADDING, etc. */
+    u_char reserved;
+    u_short len; /* network byte order */
+    u_char id[KEYD_ID_LEN]; /* selects one of the keys held by keyd */
+} KEYD_HEADER;
+
+#endif /* defined KEYD_H */
+
+/* end of keyd.h */
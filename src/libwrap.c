@@ -100,7 +100,9 @@ void libwrap_init(int num) {
 #endif /* USE_PTHREAD */
 }
 
-void libwrap_auth(CLI *c) {
+    /* returns 0 for a refused connection, as it is also called
+     * from the SNI callback, which must not longjmp() out of OpenSSL */
+int libwrap_auth(CLI *c) {
     int result=0; /* deny by default */
 #ifdef USE_PTHREAD
     static volatile int num_busy=0, roundrobin=0;
@@ -110,7 +112,7 @@ void libwrap_auth(CLI *c) {
 #endif /* USE_PTHREAD */
 
     if(!c->opt->option.libwrap) /* libwrap is disabled for this service */
-        return; /* allow connection */
+        return 1; /* allow connection */
 #ifdef USE_PTHREAD
     if(num_processes) {
         s_log(LOG_DEBUG, "Waiting for a libwrap process");
@@ -183,10 +185,11 @@ void libwrap_auth(CLI *c) {
         s_log(LOG_WARNING, "Service %s REFUSED by libwrap from %s",
             c->opt->servname, c->accepted_address);
         s_log(LOG_DEBUG, "See hosts_access(5) manual for details");
-        longjmp(c->err, 1);
+        return 0;
     }
     s_log(LOG_DEBUG, "Service %s permitted by libwrap from %s",
         c->opt->servname, c->accepted_address);
+    return 1;
 }
 
 static int check(char *name, int fd) {
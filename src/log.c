@@ -38,6 +38,59 @@
 #include "common.h"
 #include "prototypes.h"
 
+/* the ring buffers need atomic builtins */
+#if defined(USE_PTHREAD) && defined(__GNUC__)
+#define USE_LOG_WRITER
+#endif
+
+#ifdef USE_LOG_WRITER
+
+#define LOG_RING_SIZE 64  /* records in each per-thread ring, a power of 2 */
+#define LOG_TEXT_SIZE 232 /* longer texts are allocated separately */
+#define LOG_BATCH 64      /* records written with a single writev() */
+
+#define LOG_BARRIER() __sync_synchronize()
+
+#ifndef IOV_MAX
+#define IOV_MAX 16 /* _XOPEN_IOV_MAX */
+#endif
+
+typedef struct {
+    int level;
+    time_t gmt;
+    unsigned long tid;
+    char *long_text;                    /* malloc()ed for long messages */
+    char text[LOG_TEXT_SIZE];
+} LOG_RECORD;
+
+typedef struct log_ring { /* single producer, single consumer */
+    struct log_ring *next;              /* list of rings, only prepended */
+    volatile unsigned int head;         /* advanced by the owner thread */
+    volatile unsigned int tail;         /* advanced by the writer thread */
+    volatile unsigned long dropped;     /* records lost on overflow */
+    unsigned long reported;             /* dropped records already logged */
+    volatile int idle;                  /* the owner thread has exited */
+    LOG_RECORD record[LOG_RING_SIZE];
+} LOG_RING;
+
+typedef struct {
+    LOG_RING *ring;
+    LOG_RECORD *record;                 /* NULL for overflow reports */
+    char note[64];
+} LOG_ENTRY;
+
+static LOG_RING *log_ring_get(void);
+static void log_ring_release(void *);
+static LOG_RECORD *log_reserve(LOG_RING *, int);
+static void log_commit(LOG_RING *);
+static void *log_writer(void *);
+static int log_pending(void);
+static void log_drain(void);
+static void log_write(LOG_ENTRY *, int);
+static void log_writev(int, struct iovec *, int);
+
+#endif /* USE_LOG_WRITER */
+
 static void log_raw(const int, const char *, const char *, const char *);
 
 static DISK_FILE *outfile=NULL;
@@ -48,6 +101,19 @@ static struct LIST { /* single-linked list of log lines */
 } *head=NULL, *tail=NULL;
 static LOG_MODE mode=LOG_MODE_NONE;
 
+#ifdef USE_LOG_WRITER
+static LOG_RING *volatile log_rings=NULL;
+static pthread_key_t log_key;
+static unsigned long log_pid=0;
+static int log_writer_ready=0;
+static volatile int log_writer_idle=0;
+/* log_write_mutex serializes the output, log_wake_mutex the idle writer */
+static pthread_mutex_t log_write_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_ring_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t log_wake_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_wake_cond=PTHREAD_COND_INITIALIZER;
+#endif /* USE_LOG_WRITER */
+
 #if !defined(USE_WIN32) && !defined(__vms)
 
 void syslog_open(void) {
@@ -77,11 +143,18 @@ void log_open(void) {
 }
 
 void log_close(void) {
+#ifdef USE_LOG_WRITER
+    pthread_mutex_lock(&log_write_mutex);
+    log_drain(); /* queued records go to the old output file */
+#endif /* USE_LOG_WRITER */
     mode=LOG_MODE_NONE;
     if(outfile) {
         file_close(outfile);
         outfile=NULL;
     }
+#ifdef USE_LOG_WRITER
+    pthread_mutex_unlock(&log_write_mutex);
+#endif /* USE_LOG_WRITER */
 }
 
 void log_flush(LOG_MODE new_mode) {
@@ -92,6 +165,12 @@ void log_flush(LOG_MODE new_mode) {
     if(mode==LOG_MODE_NONE)
         mode=new_mode;
 
+#ifdef USE_LOG_WRITER
+    pthread_mutex_lock(&log_write_mutex);
+    log_drain();
+    pthread_mutex_unlock(&log_write_mutex);
+#endif /* USE_LOG_WRITER */
+
     while(head) {
         log_raw(head->level, head->stamp, head->id, head->text);
         str_free(head->stamp);
@@ -112,6 +191,37 @@ void s_log(int level, const char *format, ...) {
 #if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
     struct tm timestruct;
 #endif
+#ifdef USE_LOG_WRITER
+    LOG_RING *ring;
+    LOG_RECORD *record;
+    int len;
+#endif /* USE_LOG_WRITER */
+
+    /* all the outputs skip messages above the configured level */
+    if(mode==LOG_MODE_FULL && level>global_options.debug_level)
+        return;
+
+#ifdef USE_LOG_WRITER
+    ring=log_ring_get();
+    if(ring) { /* queue the record for the writer thread */
+        record=log_reserve(ring, level);
+        if(!record) /* the ring is full */
+            return;
+        va_start(ap, format);
+        len=vsnprintf(record->text, LOG_TEXT_SIZE, format, ap);
+        va_end(ap);
+        if(len>=LOG_TEXT_SIZE) { /* truncated */
+            record->long_text=malloc(len+1);
+            if(record->long_text) {
+                va_start(ap, format);
+                vsnprintf(record->long_text, len+1, format, ap);
+                va_end(ap);
+            }
+        }
+        log_commit(ring);
+        return;
+    }
+#endif /* USE_LOG_WRITER */
 
     time(&gmt);
 #if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
@@ -180,6 +290,285 @@ static void log_raw(const int level, const char *stamp,
     str_free(line);
 }
 
+/**************************************** log writer thread */
+
+#ifdef USE_LOG_WRITER
+
+int log_writer_init(void) {
+    pthread_t thread;
+    pthread_attr_t pth_attr;
+    int error;
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    sigset_t new_set, old_set;
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+
+    /* the rings of exited threads are released for reuse */
+    error=pthread_key_create(&log_key, log_ring_release);
+    if(error) {
+        errno=error;
+        ioerror("pthread_key_create");
+        return 0; /* FAILED */
+    }
+    log_pid=stunnel_process_id();
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    /* signals are only handled by the main thread */
+    sigfillset(&new_set);
+    pthread_sigmask(SIG_SETMASK, &new_set, &old_set); /* block signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    pthread_attr_init(&pth_attr);
+    pthread_attr_setdetachstate(&pth_attr, PTHREAD_CREATE_DETACHED);
+    error=pthread_create(&thread, &pth_attr, log_writer, NULL);
+    pthread_attr_destroy(&pth_attr);
+#if defined(HAVE_PTHREAD_SIGMASK) && !defined(__APPLE__)
+    pthread_sigmask(SIG_SETMASK, &old_set, NULL); /* unblock signals */
+#endif /* HAVE_PTHREAD_SIGMASK && !__APPLE__*/
+    if(error) {
+        errno=error;
+        ioerror("pthread_create");
+        return 0; /* FAILED */
+    }
+    log_writer_ready=1;
+    return 1; /* OK */
+}
+
+    /* returns the ring of the current thread or NULL to log synchronously */
+static LOG_RING *log_ring_get(void) {
+    LOG_RING *ring;
+
+    /* a forked child process has no writer thread */
+    if(!log_writer_ready || !global_options.option.log_async ||
+            mode!=LOG_MODE_FULL || stunnel_process_id()!=log_pid)
+        return NULL;
+    ring=pthread_getspecific(log_key);
+    if(ring)
+        return ring;
+    for(ring=log_rings; ring; ring=ring->next) /* reuse a drained ring */
+        if(ring->idle && ring->head==ring->tail &&
+                __sync_bool_compare_and_swap(&ring->idle, 1, 0))
+            break;
+    if(!ring) {
+        ring=calloc(1, sizeof(LOG_RING));
+        if(!ring)
+            return NULL;
+        pthread_mutex_lock(&log_ring_mutex);
+        ring->next=log_rings;
+        LOG_BARRIER(); /* the writer thread walks the list without locking */
+        log_rings=ring;
+        pthread_mutex_unlock(&log_ring_mutex);
+    }
+    pthread_setspecific(log_key, ring);
+    return ring;
+}
+
+static void log_ring_release(void *ring) { /* thread exit */
+    LOG_BARRIER();
+    ((LOG_RING *)ring)->idle=1;
+}
+
+static LOG_RECORD *log_reserve(LOG_RING *ring, int level) {
+    LOG_RECORD *record;
+
+    if(ring->head-ring->tail>=LOG_RING_SIZE) { /* the writer is behind */
+        ++ring->dropped;
+        return NULL;
+    }
+    record=ring->record+ring->head%LOG_RING_SIZE;
+    record->level=level;
+    time(&record->gmt);
+    record->tid=stunnel_thread_id();
+    record->long_text=NULL;
+    return record;
+}
+
+static void log_commit(LOG_RING *ring) {
+    LOG_BARRIER(); /* the record is complete before the head is advanced */
+    ++ring->head;
+    LOG_BARRIER(); /* the head is visible before log_writer_idle is read */
+    if(log_writer_idle) {
+        pthread_mutex_lock(&log_wake_mutex);
+        pthread_cond_signal(&log_wake_cond);
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+}
+
+static void *log_writer(void *arg) {
+    (void)arg; /* skip warning about unused parameter */
+    s_log(LOG_DEBUG, "Log writer thread initialized");
+    for(;;) {
+        pthread_mutex_lock(&log_write_mutex);
+        log_drain();
+        pthread_mutex_unlock(&log_write_mutex);
+        pthread_mutex_lock(&log_wake_mutex);
+        log_writer_idle=1;
+        LOG_BARRIER(); /* see log_commit() */
+        /* log_flush() drains the records queued while the log was closed */
+        while(mode!=LOG_MODE_FULL || !log_pending())
+            pthread_cond_wait(&log_wake_cond, &log_wake_mutex);
+        log_writer_idle=0;
+        pthread_mutex_unlock(&log_wake_mutex);
+    }
+    return NULL; /* it should never be executed */
+}
+
+static int log_pending(void) {
+    LOG_RING *ring;
+
+    for(ring=log_rings; ring; ring=ring->next)
+        if(ring->head!=ring->tail || ring->dropped!=ring->reported)
+            return 1;
+    return 0;
+}
+
+    /* called with log_write_mutex locked */
+static void log_drain(void) {
+    LOG_ENTRY entry[LOG_BATCH];
+    LOG_RING *ring;
+    unsigned int pos, last;
+    unsigned long dropped;
+    int num=0;
+
+    if(mode==LOG_MODE_NONE) /* keep the records until log_open() */
+        return;
+    for(ring=log_rings; ring; ring=ring->next) {
+        last=ring->head;
+        LOG_BARRIER(); /* the records up to last are complete */
+        for(pos=ring->tail; pos!=last; ++pos) {
+            entry[num].ring=ring;
+            entry[num].record=ring->record+pos%LOG_RING_SIZE;
+            if(++num==LOG_BATCH) {
+                log_write(entry, num);
+                num=0;
+            }
+        }
+        dropped=ring->dropped;
+        if(dropped!=ring->reported) {
+            entry[num].ring=ring;
+            entry[num].record=NULL;
+            sprintf(entry[num].note, "Log buffer overflow: %lu message(s) dropped",
+                dropped-ring->reported);
+            ring->reported=dropped;
+            if(++num==LOG_BATCH) {
+                log_write(entry, num);
+                num=0;
+            }
+        }
+    }
+    if(num)
+        log_write(entry, num);
+}
+
+    /* format and write a batch of records, then release them */
+static void log_write(LOG_ENTRY *entry, int num) {
+    static time_t stamp_time=(time_t)-1;
+    static char stamp[72]; /* large enough for any struct tm values */
+    struct iovec iov[3*LOG_BATCH], iov_copy[3*LOG_BATCH];
+    char prefix[LOG_BATCH][160], id[64], *text;
+    int i, len, level, iov_num=0;
+    time_t gmt;
+    unsigned long tid;
+    struct tm *timeptr;
+#if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
+    struct tm timestruct;
+#endif
+
+    for(i=0; i<num; ++i) {
+        if(entry[i].record) {
+            level=entry[i].record->level;
+            gmt=entry[i].record->gmt;
+            tid=entry[i].record->tid;
+            text=entry[i].record->long_text ?
+                entry[i].record->long_text : entry[i].record->text;
+        } else { /* overflow report */
+            level=LOG_WARNING;
+            time(&gmt);
+            tid=stunnel_thread_id();
+            text=entry[i].note;
+        }
+        if(mode==LOG_MODE_ERROR) { /* no time stamp in error mode */
+            iov[iov_num].iov_base=text;
+            iov[iov_num++].iov_len=strlen(text);
+        } else {
+            if(level>global_options.debug_level)
+                continue;
+            if(gmt!=stamp_time) { /* localtime() once per second */
+#if defined(HAVE_LOCALTIME_R) && defined(_REENTRANT)
+                timeptr=localtime_r(&gmt, &timestruct);
+#else
+                timeptr=localtime(&gmt);
+#endif
+                sprintf(stamp, "%04d.%02d.%02d %02d:%02d:%02d",
+                    timeptr->tm_year+1900, timeptr->tm_mon+1, timeptr->tm_mday,
+                    timeptr->tm_hour, timeptr->tm_min, timeptr->tm_sec);
+                stamp_time=gmt;
+            }
+            sprintf(id, "LOG%d[%lu:%lu]", level, log_pid, tid);
+            len=sprintf(prefix[i], "%s %s: ", stamp, id);
+#if !defined(USE_WIN32) && !defined(__vms)
+            if(global_options.option.syslog)
+                syslog(level, "%s: %s", id, text);
+#endif /* USE_WIN32, __vms */
+            iov[iov_num].iov_base=prefix[i];
+            iov[iov_num++].iov_len=len;
+            iov[iov_num].iov_base=text;
+            iov[iov_num++].iov_len=strlen(text);
+        }
+        iov[iov_num].iov_base="\n";
+        iov[iov_num++].iov_len=1;
+    }
+
+    if(iov_num) {
+        if(mode==LOG_MODE_ERROR) { /* always log LOG_MODE_ERROR to stderr */
+            log_writev(2, iov, iov_num);
+        } else {
+            if(global_options.option.foreground) {
+                memcpy(iov_copy, iov, iov_num*sizeof(struct iovec));
+                log_writev(2, iov_copy, iov_num);
+            }
+            if(outfile)
+                log_writev(outfile->fd, iov, iov_num);
+        }
+    }
+
+    for(i=0; i<num; ++i)
+        if(entry[i].record) {
+            free(entry[i].record->long_text);
+            LOG_BARRIER(); /* the record is released after it was read */
+            ++entry[i].ring->tail;
+        }
+}
+
+static void log_writev(int fd, struct iovec *iov, int iov_num) {
+    ssize_t num;
+
+    while(iov_num>0) {
+        num=writev(fd, iov, iov_num>IOV_MAX ? IOV_MAX : iov_num);
+        if(num<0 && errno==EINTR)
+            continue;
+        if(num<=0) /* nowhere to report the error */
+            return;
+        while(iov_num>0 && (size_t)num>=iov->iov_len) { /* written */
+            num-=iov->iov_len;
+            ++iov;
+            --iov_num;
+        }
+        if(iov_num>0) { /* partially written */
+            iov->iov_base=(char *)iov->iov_base+num;
+            iov->iov_len-=num;
+        }
+    }
+}
+
+#else /* USE_LOG_WRITER */
+
+int log_writer_init(void) {
+    if(global_options.option.log_async)
+        s_log(LOG_WARNING,
+            "logAsync is not supported with this threading model");
+    return 1; /* OK */
+}
+
+#endif /* USE_LOG_WRITER */
+
 void ioerror(const char *txt) { /* input/output error */
     log_error(LOG_ERR, get_last_error(), txt);
 }
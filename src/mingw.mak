@@ -54,10 +54,10 @@ OBJ=$(OBJROOT)/$(TARGETCPU)
 BINROOT=../bin
 BIN=$(BINROOT)/$(TARGETCPU)
 
-#OBJS=stunnel.o ssl.o ctx.o verify.o file.o client.o protocol.o sthreads.o log.o options.o network.o resolver.o gui.o resources.o version.o str.c
+#OBJS=stunnel.o ssl.o ctx.o verify.o file.o client.o protocol.o sthreads.o cron.o mux.o cache.o crlindex.o log.o options.o network.o resolver.o gui.o resources.o version.o str.c
 
 OBJS=$(OBJ)/stunnel.o $(OBJ)/ssl.o $(OBJ)/ctx.o $(OBJ)/verify.o $(OBJ)/file.o $(OBJ)/client.o   \
-	$(OBJ)/protocol.o $(OBJ)/sthreads.o $(OBJ)/log.o $(OBJ)/options.o $(OBJ)/network.o \
+	$(OBJ)/protocol.o $(OBJ)/sthreads.o $(OBJ)/cron.o $(OBJ)/mux.o $(OBJ)/cache.o $(OBJ)/crlindex.o $(OBJ)/log.o $(OBJ)/options.o $(OBJ)/network.o \
 	$(OBJ)/resolver.o $(OBJ)/gui.o $(OBJ)/resources.o $(OBJ)\str.obj \
 	$(OBJ)/version.o
 
@@ -0,0 +1,837 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+
+#include "common.h"
+#include "prototypes.h"
+
+#ifdef USE_MUX
+
+#ifndef SHUT_WR
+#define SHUT_WR 1
+#endif
+
+/* a frame is an 8-byte header followed by up to MUX_MAX_DATA bytes:
+ * 32-bit stream id, 8-bit type, 8-bit reserved, 16-bit payload length */
+#define MUX_HEADER 8
+#define MUX_MAX_DATA (BUFFSIZE-MUX_HEADER)  /* a frame fits in BUFFSIZE */
+#define MUX_STREAMS 64                     /* streams per TLS connection */
+#define MUX_WINDOW (4*BUFFSIZE)           /* per-stream flow control window */
+#define MUX_BUFF (8*BUFFSIZE)             /* frames waiting for SSL_write() */
+/* control frames queued by a stream without reading SSL:
+ * up to 3 WINDOW frames for its buffered data, FIN, and RST */
+#define MUX_CONTROL (MUX_STREAMS*(3*(MUX_HEADER+4)+2*MUX_HEADER))
+/* replies to the frames of a full in_buff: an RST for each OPEN */
+#define MUX_REPLIES BUFFSIZE
+#define MUX_RESERVE (MUX_CONTROL+MUX_REPLIES) /* room for control frames */
+
+#define FRAME_OPEN   0 /* open a new stream (client to server only) */
+#define FRAME_DATA   1 /* stream payload */
+#define FRAME_FIN    2 /* no more data will be sent on the stream */
+#define FRAME_RST    3 /* the stream was aborted */
+#define FRAME_WINDOW 4 /* 32-bit flow control window increment */
+
+struct mux_channel_struct { /* shared with the threads attaching streams */
+    struct mux_channel_struct *next;
+    SERVICE_OPTIONS *opt;
+    int pipe_fd[2]; /* descriptors of the streams to be attached */
+    int streams; /* attached and pending streams, protected by CRIT_MUX */
+};
+
+typedef struct mux_stream_struct {
+    struct mux_stream_struct *next;
+    unsigned long id;
+    int fd; /* local (client) or remote (server) socket */
+    int connecting; /* non-blocking connect() in progress */
+    int sock_open_rd, sock_open_wr; /* logical socket directions */
+    int fin_received; /* the peer will not send any more data */
+    int credit; /* bytes the peer is ready to accept */
+    int consumed; /* bytes written to the socket since the last WINDOW */
+    char *buff; /* data received from the peer */
+    int ptr; /* index of first unused byte in buff */
+    int sock_bytes, ssl_bytes; /* bytes written to socket and SSL */
+} MUX_STREAM;
+
+typedef struct {
+    CLI *c;
+    MUX_CHANNEL *channel; /* NULL on the server side */
+    MUX_STREAM *streams;
+    int num; /* number of streams on the list */
+    unsigned long next_id;
+    unsigned char in_buff[BUFFSIZE]; /* frames read from SSL */
+    unsigned char out_buff[MUX_BUFF]; /* frames to be written to SSL */
+    int in_ptr, out_ptr;
+    int overflow; /* out_buff exhausted: internal error */
+} MUX;
+
+/**************************************** prototypes */
+
+static MUX_CHANNEL *channel_new(SERVICE_OPTIONS *);
+static void channel_unlink(MUX_CHANNEL *);
+static int channel_idle(MUX *);
+static int mux_loop(MUX *);
+static int mux_room(MUX *);
+static int mux_can_read(MUX *);
+
+static void streams_attach(MUX *);
+static void stream_connect(MUX *, unsigned long);
+static MUX_STREAM *stream_new(MUX *, unsigned long, int);
+static MUX_STREAM *stream_find(MUX *, unsigned long);
+static void stream_io(MUX *, MUX_STREAM *);
+static void stream_check(MUX *, MUX_STREAM *);
+static void stream_reset(MUX *, MUX_STREAM *);
+static void stream_close(MUX *, MUX_STREAM *, int);
+static int stream_retry(void);
+
+static int frames_parse(MUX *);
+static int frame_process(MUX *, unsigned long, int, unsigned char *, int);
+static void frame_header(unsigned char *, unsigned long, int, int);
+static void frame_send(MUX *, unsigned long, int, unsigned long);
+static unsigned long get32(unsigned char *);
+
+/**************************************** channel management */
+
+/* hand over an accepted local connection to a multiplexed channel */
+void mux_attach(CLI *c) {
+    MUX_CHANNEL *channel;
+    int written=-1;
+
+    enter_critical_section(CRIT_MUX);
+    for(channel=c->opt->mux_channels; channel; channel=channel->next)
+        if(channel->streams<MUX_STREAMS)
+            break;
+    if(!channel) /* all channels are full: start a new one */
+        channel=channel_new(c->opt);
+    if(channel) {
+        /* writes up to PIPE_BUF bytes are atomic */
+        written=write(channel->pipe_fd[1], &c->local_rfd.fd, sizeof(int));
+        if(written==sizeof(int))
+            ++channel->streams;
+    }
+    leave_critical_section(CRIT_MUX);
+    if(!channel)
+        longjmp(c->err, 1);
+    if(written!=sizeof(int)) {
+        ioerror("mux_attach: write");
+        longjmp(c->err, 1);
+    }
+    s_log(LOG_INFO, "Connection from %s attached to a mux channel",
+        c->accepted_address);
+    c->local_rfd.fd=c->local_wfd.fd=-1; /* owned by the channel thread */
+}
+
+static MUX_CHANNEL *channel_new(SERVICE_OPTIONS *opt) { /* under CRIT_MUX */
+    MUX_CHANNEL *channel;
+    CLI *arg;
+
+    /* str_alloc() cannot be used here, because corresponding
+       free() is called from a different thread */
+    channel=calloc(1, sizeof(MUX_CHANNEL));
+    if(!channel) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        return NULL;
+    }
+    channel->opt=opt;
+    if(s_pipe(channel->pipe_fd, 1, "mux pipe")<0) {
+        free(channel);
+        return NULL;
+    }
+    arg=alloc_client_session(opt, -1, -1);
+    if(!arg) {
+        close(channel->pipe_fd[0]);
+        close(channel->pipe_fd[1]);
+        free(channel);
+        return NULL;
+    }
+    arg->mux=channel;
+    enter_critical_section(CRIT_CLIENTS); /* for multi-cpu machines */
+    ++num_clients;
+    leave_critical_section(CRIT_CLIENTS);
+    if(create_client(-1, -1, arg, client)) { /* arg is released on failure */
+        s_log(LOG_ERR, "Mux channel rejected: create_client failed");
+        enter_critical_section(CRIT_CLIENTS); /* for multi-cpu machines */
+        --num_clients;
+        leave_critical_section(CRIT_CLIENTS);
+        close(channel->pipe_fd[0]);
+        close(channel->pipe_fd[1]);
+        free(channel);
+        return NULL;
+    }
+    channel->next=opt->mux_channels;
+    opt->mux_channels=channel;
+    s_log(LOG_DEBUG, "Service %s: new mux channel started", opt->servname);
+    return channel;
+}
+
+static void channel_unlink(MUX_CHANNEL *channel) { /* under CRIT_MUX */
+    MUX_CHANNEL **ptr;
+
+    for(ptr=&channel->opt->mux_channels; *ptr; ptr=&(*ptr)->next)
+        if(*ptr==channel) {
+            *ptr=channel->next;
+            break;
+        }
+}
+
+/* called by the channel thread when its TLS connection is gone */
+void mux_release(MUX_CHANNEL *channel) {
+    int fd;
+
+    enter_critical_section(CRIT_MUX);
+    channel_unlink(channel); /* no more streams can be attached */
+    leave_critical_section(CRIT_MUX);
+    while(read(channel->pipe_fd[0], &fd, sizeof fd)==sizeof fd) {
+        s_log(LOG_NOTICE, "Pending mux stream FD=%d reset", fd);
+        closesocket(fd);
+    }
+    close(channel->pipe_fd[0]);
+    close(channel->pipe_fd[1]);
+    free(channel);
+}
+
+static int channel_idle(MUX *m) { /* returns 1 if the channel can be closed */
+    int idle;
+
+    if(!m->channel) /* server side */
+        return 1;
+    enter_critical_section(CRIT_MUX);
+    idle=!m->channel->streams; /* a stream may be waiting in the pipe */
+    if(idle)
+        channel_unlink(m->channel);
+    leave_critical_section(CRIT_MUX);
+    return idle;
+}
+
+/**************************************** transfer data */
+
+void mux_transfer(CLI *c) {
+    MUX *m;
+    int error;
+
+    m=str_alloc(sizeof(MUX));
+    if(!m) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        longjmp(c->err, 1);
+    }
+    m->c=c;
+    m->channel=c->mux;
+    m->next_id=1;
+    s_log(LOG_INFO, "Mux channel established");
+    error=mux_loop(m);
+    while(m->streams) /* no more data can be exchanged with the peer */
+        stream_close(m, m->streams, 1);
+    str_free(m);
+    if(error)
+        longjmp(c->err, 1);
+}
+
+static int mux_loop(MUX *m) {
+    CLI *c=m->c;
+    MUX_STREAM *s, *next;
+    int num, err;
+    int ssl_open_rd=1;
+    int read_wants_read, read_wants_write=0;
+    int write_wants_read=0, write_wants_write;
+    int ssl_can_rd, ssl_can_wr, pending;
+
+    while(ssl_open_rd) {
+        /* DATA frames always leave MUX_RESERVE in out_buff, so reading SSL
+         * only waits for SSL_write() with a backlog of control frames,
+         * and a peer waiting for its SSL_write() cannot cause a deadlock */
+        read_wants_read=m->in_ptr<BUFFSIZE && !read_wants_write &&
+            mux_can_read(m);
+        write_wants_write=m->out_ptr && !write_wants_read;
+        /* records already decrypted by OpenSSL are not signaled by poll() */
+        pending=read_wants_read && SSL_pending(c->ssl);
+
+        /****************************** setup c->fds structure */
+        s_poll_init(&c->fds);
+        if(m->channel && mux_room(m))
+            s_poll_add(&c->fds, m->channel->pipe_fd[0], 1, 0);
+        for(s=m->streams; s; s=s->next) {
+            if(s->connecting)
+                s_poll_add(&c->fds, s->fd, 0, 1);
+            else if((s->sock_open_rd && s->credit && mux_room(m)) || s->ptr)
+                s_poll_add(&c->fds, s->fd,
+                    s->sock_open_rd && s->credit && mux_room(m), s->ptr);
+        }
+        if(read_wants_read || write_wants_read)
+            s_poll_add(&c->fds, c->ssl_rfd->fd, 1, 0);
+        if(read_wants_write || write_wants_write)
+            s_poll_add(&c->fds, c->ssl_wfd->fd, 0, 1);
+
+        /****************************** wait for an event */
+        switch(s_poll_wait(&c->fds, pending ? 0 : c->opt->timeout_idle, 0)) {
+        case -1:
+            sockerror("mux_loop: s_poll_wait");
+            return 1;
+        case 0: /* timeout */
+            if(pending)
+                break; /* read the pending records below */
+            if(!m->num) {
+                if(!channel_idle(m))
+                    continue; /* a new stream is being attached */
+                s_log(LOG_INFO, "Mux channel idle: closing");
+                SSL_shutdown(c->ssl); /* send close_notify */
+                return 0;
+            }
+            s_log(LOG_INFO, "mux_loop: s_poll_wait:"
+                " TIMEOUTidle exceeded: resetting %d stream(s)", m->num);
+            while(m->streams)
+                stream_reset(m, m->streams);
+            continue;
+        }
+
+        err=s_poll_error(&c->fds, c->ssl_rfd->fd);
+        if(err) {
+            s_log(LOG_NOTICE,
+                "Error detected on mux SSL file descriptor: %s (%d)",
+                s_strerror(err), err);
+            return 1;
+        }
+        ssl_can_rd=s_poll_canread(&c->fds, c->ssl_rfd->fd);
+        ssl_can_wr=s_poll_canwrite(&c->fds, c->ssl_wfd->fd);
+
+        /****************************** attach new local connections */
+        if(m->channel && s_poll_canread(&c->fds, m->channel->pipe_fd[0]))
+            streams_attach(m);
+
+        /****************************** local sockets */
+        for(s=m->streams; s; s=next) {
+            next=s->next; /* s may be released */
+            stream_io(m, s);
+        }
+
+        /****************************** read from SSL */
+        if((read_wants_read && (ssl_can_rd || SSL_pending(c->ssl))) ||
+                (read_wants_write && ssl_can_wr && mux_can_read(m))) {
+            read_wants_write=0;
+            do { /* consume the records already decrypted by OpenSSL */
+                num=SSL_read(c->ssl,
+                    m->in_buff+m->in_ptr, BUFFSIZE-m->in_ptr);
+                err=SSL_get_error(c->ssl, num);
+                if(err==SSL_ERROR_NONE) {
+                    m->in_ptr+=num;
+                    if(!frames_parse(m))
+                        return 1;
+                }
+            } while(err==SSL_ERROR_NONE && SSL_pending(c->ssl) &&
+                mux_can_read(m));
+            switch(err) {
+            case SSL_ERROR_NONE:
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                s_log(LOG_DEBUG, "SSL_read returned WANT_WRITE: retrying");
+                read_wants_write=1;
+                break;
+            case SSL_ERROR_WANT_READ: /* nothing unexpected */
+                break;
+            case SSL_ERROR_WANT_X509_LOOKUP:
+                s_log(LOG_DEBUG,
+                    "SSL_read returned WANT_X509_LOOKUP: retrying");
+                break;
+            case SSL_ERROR_SYSCALL:
+                if(!num) { /* EOF */
+                    s_log(LOG_DEBUG, "Mux SSL socket closed on SSL_read");
+                    ssl_open_rd=0; /* buggy peer: no close_notify */
+                } else if(!stream_retry()) {
+                    sockerror("SSL_read");
+                    return 1;
+                }
+                break;
+            case SSL_ERROR_ZERO_RETURN: /* close_notify received */
+                s_log(LOG_DEBUG, "Mux SSL closed on SSL_read");
+                ssl_open_rd=0;
+                break;
+            case SSL_ERROR_SSL:
+                sslerror("SSL_read");
+                return 1;
+            default:
+                s_log(LOG_ERR, "SSL_read/SSL_get_error returned %d", err);
+                return 1;
+            }
+        }
+
+        /****************************** deliver FIN and release streams */
+        for(s=m->streams; s; s=next) {
+            next=s->next; /* s may be released */
+            stream_check(m, s);
+        }
+        if(m->overflow) {
+            s_log(LOG_ERR, "INTERNAL ERROR: mux output buffer overflow");
+            return 1;
+        }
+
+        /****************************** write to SSL */
+        if((write_wants_read && ssl_can_rd) ||
+                (write_wants_write && ssl_can_wr)) {
+            write_wants_read=0;
+            num=SSL_write(c->ssl, m->out_buff, m->out_ptr);
+            switch(err=SSL_get_error(c->ssl, num)) {
+            case SSL_ERROR_NONE:
+                memmove(m->out_buff, m->out_buff+num, m->out_ptr-num);
+                m->out_ptr-=num;
+                c->ssl_bytes+=num;
+                break;
+            case SSL_ERROR_WANT_WRITE: /* nothing unexpected */
+                break;
+            case SSL_ERROR_WANT_READ:
+                s_log(LOG_DEBUG, "SSL_write returned WANT_READ: retrying");
+                write_wants_read=1;
+                break;
+            case SSL_ERROR_WANT_X509_LOOKUP:
+                s_log(LOG_DEBUG,
+                    "SSL_write returned WANT_X509_LOOKUP: retrying");
+                break;
+            case SSL_ERROR_SYSCALL: /* socket error */
+                if(!num) { /* EOF */
+                    s_log(LOG_DEBUG, "Mux SSL socket closed on SSL_write");
+                    ssl_open_rd=0;
+                } else if(!stream_retry()) {
+                    sockerror("SSL_write");
+                    return 1;
+                }
+                break;
+            case SSL_ERROR_ZERO_RETURN: /* close_notify received */
+                s_log(LOG_DEBUG, "Mux SSL closed on SSL_write");
+                ssl_open_rd=0;
+                break;
+            case SSL_ERROR_SSL:
+                sslerror("SSL_write");
+                return 1;
+            default:
+                s_log(LOG_ERR, "SSL_write/SSL_get_error returned %d", err);
+                return 1;
+            }
+        }
+    }
+    if(m->num) {
+        s_log(LOG_NOTICE, "Mux channel closed by peer with %d open stream(s)",
+            m->num);
+        return 1;
+    }
+    return 0;
+}
+
+/* room for a DATA frame in out_buff, keeping MUX_RESERVE for control frames */
+static int mux_room(MUX *m) {
+    int room;
+
+    room=MUX_BUFF-MUX_RESERVE-MUX_HEADER-m->out_ptr;
+    return room>0 ? room : 0;
+}
+
+/* room for the replies to a full in_buff and the control frames of the
+ * streams, so that SSL is only read when frame_send() cannot overflow */
+static int mux_can_read(MUX *m) {
+    return m->out_ptr<=MUX_BUFF-MUX_RESERVE;
+}
+
+/**************************************** streams */
+
+static void streams_attach(MUX *m) { /* client side */
+    int fd;
+    MUX_STREAM *s;
+
+    while(mux_room(m) &&
+            read(m->channel->pipe_fd[0], &fd, sizeof fd)==sizeof fd) {
+        s=stream_new(m, m->next_id++, fd);
+        if(s)
+            frame_send(m, s->id, FRAME_OPEN, 0);
+    }
+}
+
+static void stream_connect(MUX *m, unsigned long id) { /* server side */
+    SERVICE_OPTIONS *opt=m->c->opt;
+    SOCKADDR_UNION addr;
+    SOCKADDR_LIST resolved_list, *address_list;
+    MUX_STREAM *s;
+    int fd, ind_cur;
+
+    if(m->num>=MUX_STREAMS) {
+        s_log(LOG_WARNING, "Mux stream %lu rejected: too many streams", id);
+        frame_send(m, id, FRAME_RST, 0);
+        return;
+    }
+
+    /* setup address_list as connect_remote() does */
+    if(opt->option.delayed_lookup) {
+        resolved_list.num=0;
+        if(!name2addrlist(&resolved_list,
+                opt->remote_address, DEFAULT_LOOPBACK)) {
+            s_log(LOG_ERR, "No host resolved");
+            frame_send(m, id, FRAME_RST, 0);
+            return;
+        }
+        address_list=&resolved_list;
+    } else if(opt->remote_refresh) { /* refreshed by cron.c */
+        enter_critical_section(CRIT_ADDR);
+        memcpy(&resolved_list, &opt->remote_addr, sizeof(SOCKADDR_LIST));
+        if(resolved_list.num) /* advance the shared round-robin counter */
+            opt->remote_addr.cur=(resolved_list.cur+1)%resolved_list.num;
+        leave_critical_section(CRIT_ADDR);
+        address_list=&resolved_list;
+    } else /* use pre-resolved addresses */
+        address_list=&opt->remote_addr;
+    if(!address_list->num) {
+        frame_send(m, id, FRAME_RST, 0);
+        return;
+    }
+
+    /* a non-blocking connect() must not stall the other streams,
+     * so only a single address is tried for each stream */
+    if(opt->failover==FAILOVER_RR) {
+        ind_cur=address_list->cur;
+        /* the race condition here can be safely ignored */
+        address_list->cur=(ind_cur+1)%address_list->num;
+    } else { /* FAILOVER_PRIO */
+        ind_cur=0;
+    }
+    memcpy(&addr, address_list->addr+ind_cur, sizeof addr);
+
+    fd=s_socket(addr.sa.sa_family, SOCK_STREAM, 0, 1, "remote socket");
+    if(fd<0) {
+        frame_send(m, id, FRAME_RST, 0);
+        return;
+    }
+    if(connect(fd, &addr.sa, addr_len(addr)) &&
+            get_last_socket_error()!=EINPROGRESS &&
+            get_last_socket_error()!=EWOULDBLOCK) {
+        sockerror("connect");
+        closesocket(fd);
+        frame_send(m, id, FRAME_RST, 0);
+        return;
+    }
+    s=stream_new(m, id, fd);
+    if(!s) {
+        frame_send(m, id, FRAME_RST, 0);
+        return;
+    }
+    s->connecting=1;
+}
+
+static MUX_STREAM *stream_new(MUX *m, unsigned long id, int fd) {
+    MUX_STREAM *s;
+
+    s=str_alloc(sizeof(MUX_STREAM));
+    if(s)
+        s->buff=str_alloc(MUX_WINDOW);
+    if(!s || !s->buff) {
+        s_log(LOG_ERR, "Memory allocation failed");
+        str_free(s);
+        closesocket(fd);
+        if(m->channel) {
+            enter_critical_section(CRIT_MUX);
+            --m->channel->streams;
+            leave_critical_section(CRIT_MUX);
+        }
+        return NULL;
+    }
+    s->id=id;
+    s->fd=fd;
+    s->sock_open_rd=s->sock_open_wr=1;
+    s->credit=MUX_WINDOW;
+    s->next=m->streams;
+    m->streams=s;
+    ++m->num;
+    s_log(LOG_DEBUG, "Mux stream %lu opened: FD=%d", id, fd);
+    return s;
+}
+
+static MUX_STREAM *stream_find(MUX *m, unsigned long id) {
+    MUX_STREAM *s;
+
+    for(s=m->streams; s; s=s->next)
+        if(s->id==id)
+            return s;
+    return NULL;
+}
+
+static void stream_io(MUX *m, MUX_STREAM *s) {
+    s_poll_set *fds=&m->c->fds;
+    int num, err;
+
+    if(s->connecting) {
+        if(!s_poll_canwrite(fds, s->fd) && !s_poll_canread(fds, s->fd))
+            return; /* still in progress */
+        err=get_socket_error(s->fd);
+        if(err) {
+            log_error(LOG_ERR, err, "connect");
+            stream_reset(m, s);
+            return;
+        }
+        s->connecting=0;
+        if(set_socket_options(s->fd, 2)<0) {
+            stream_reset(m, s);
+            return;
+        }
+        s_log(LOG_DEBUG, "Mux stream %lu connected", s->id);
+        return;
+    }
+
+    err=s_poll_error(fds, s->fd);
+    if(err) {
+        s_log(LOG_NOTICE, "Error detected on mux stream %lu: %s (%d)",
+            s->id, s_strerror(err), err);
+        stream_reset(m, s);
+        return;
+    }
+
+    /* write to socket */
+    if(s->ptr && s_poll_canwrite(fds, s->fd)) {
+        num=writesocket(s->fd, s->buff, s->ptr);
+        if(num<0 && !stream_retry()) {
+            sockerror("writesocket");
+            stream_reset(m, s);
+            return;
+        }
+        if(num>0) {
+            memmove(s->buff, s->buff+num, s->ptr-num);
+            s->ptr-=num;
+            s->sock_bytes+=num;
+            m->c->sock_bytes+=num;
+            s->consumed+=num;
+            if(s->consumed>=MUX_WINDOW/2) { /* return the credit */
+                frame_send(m, s->id, FRAME_WINDOW, s->consumed);
+                s->consumed=0;
+            }
+        }
+    }
+
+    /* read from socket directly into a DATA frame */
+    num=mux_room(m);
+    if(num>s->credit)
+        num=s->credit;
+    if(num>MUX_MAX_DATA)
+        num=MUX_MAX_DATA;
+    if(s->sock_open_rd && num>0 && s_poll_canread(fds, s->fd)) {
+        num=readsocket(s->fd, m->out_buff+m->out_ptr+MUX_HEADER, num);
+        switch(num) {
+        case -1:
+            if(stream_retry())
+                break;
+            sockerror("readsocket");
+            stream_reset(m, s);
+            return;
+        case 0: /* EOF */
+            s_log(LOG_DEBUG, "Mux stream %lu: socket closed on read", s->id);
+            s->sock_open_rd=0;
+            frame_send(m, s->id, FRAME_FIN, 0);
+            break;
+        default:
+            frame_header(m->out_buff+m->out_ptr, s->id, FRAME_DATA, num);
+            m->out_ptr+=MUX_HEADER+num;
+            s->credit-=num;
+            s->ssl_bytes+=num;
+        }
+    }
+}
+
+static void stream_check(MUX *m, MUX_STREAM *s) {
+    if(s->sock_open_wr && s->fin_received && !s->ptr && !s->connecting) {
+        s_log(LOG_DEBUG, "Mux stream %lu: sending socket write shutdown",
+            s->id);
+        s->sock_open_wr=0; /* no further write allowed */
+        shutdown(s->fd, SHUT_WR); /* send TCP FIN */
+    }
+    if(!s->sock_open_rd && !s->sock_open_wr)
+        stream_close(m, s, 0);
+}
+
+static void stream_reset(MUX *m, MUX_STREAM *s) {
+    frame_send(m, s->id, FRAME_RST, 0);
+    stream_close(m, s, 1);
+}
+
+static void stream_close(MUX *m, MUX_STREAM *s, int error) {
+    MUX_STREAM **ptr;
+    struct linger l;
+
+    for(ptr=&m->streams; *ptr!=s; ptr=&(*ptr)->next)
+        ;
+    *ptr=s->next;
+    --m->num;
+    s_log(LOG_NOTICE,
+        "Mux stream %lu %s: %d bytes sent to SSL, %d bytes sent to socket",
+        s->id, error ? "reset" : "closed", s->ssl_bytes, s->sock_bytes);
+    if(error) { /* set lingering on a socket */
+        l.l_onoff=1;
+        l.l_linger=0;
+        if(setsockopt(s->fd, SOL_SOCKET, SO_LINGER, (void *)&l, sizeof l))
+            log_error(LOG_DEBUG, get_last_socket_error(), "linger (mux)");
+    }
+    closesocket(s->fd);
+    str_free(s->buff);
+    str_free(s);
+    if(m->channel) {
+        enter_critical_section(CRIT_MUX);
+        --m->channel->streams;
+        leave_critical_section(CRIT_MUX);
+    }
+}
+
+static int stream_retry(void) { /* returns 1 for transient socket errors */
+    switch(get_last_socket_error()) {
+    case EINTR:
+    case EWOULDBLOCK:
+#if EAGAIN!=EWOULDBLOCK
+    case EAGAIN:
+#endif
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**************************************** framing */
+
+static int frames_parse(MUX *m) { /* returns 0 on protocol error */
+    unsigned char *p;
+    int off=0, len;
+
+    while(m->in_ptr-off>=MUX_HEADER) {
+        p=m->in_buff+off;
+        len=p[6]<<8|p[7];
+        if(len>MUX_MAX_DATA) {
+            s_log(LOG_ERR, "Mux protocol error: frame too long");
+            return 0;
+        }
+        if(m->in_ptr-off<MUX_HEADER+len)
+            break; /* incomplete frame */
+        if(!frame_process(m, get32(p), p[4], p+MUX_HEADER, len))
+            return 0;
+        off+=MUX_HEADER+len;
+    }
+    memmove(m->in_buff, m->in_buff+off, m->in_ptr-off);
+    m->in_ptr-=off;
+    return 1;
+}
+
+static int frame_process(MUX *m, unsigned long id, int type,
+        unsigned char *data, int len) {
+    MUX_STREAM *s;
+
+    s=stream_find(m, id);
+    switch(type) {
+    case FRAME_OPEN:
+        if(m->channel || s || len) {
+            s_log(LOG_ERR, "Mux protocol error: unexpected OPEN");
+            return 0;
+        }
+        stream_connect(m, id);
+        break;
+    case FRAME_DATA:
+        if(!s) /* the stream was already reset */
+            break;
+        if(s->fin_received) {
+            s_log(LOG_ERR, "Mux protocol error: DATA after FIN");
+            return 0;
+        }
+        if(len>MUX_WINDOW-s->ptr) {
+            s_log(LOG_ERR, "Mux protocol error: flow control window exceeded");
+            return 0;
+        }
+        memcpy(s->buff+s->ptr, data, len);
+        s->ptr+=len;
+        break;
+    case FRAME_FIN:
+        if(s)
+            s->fin_received=1;
+        break;
+    case FRAME_RST:
+        if(s) {
+            s_log(LOG_INFO, "Mux stream %lu reset by peer", id);
+            stream_close(m, s, 1);
+        }
+        break;
+    case FRAME_WINDOW:
+        if(len!=4 || get32(data)>(unsigned long)MUX_WINDOW ||
+                (s && get32(data)>(unsigned long)(MUX_WINDOW-s->credit))) {
+            s_log(LOG_ERR, "Mux protocol error: bad WINDOW");
+            return 0;
+        }
+        if(s)
+            s->credit+=get32(data);
+        break;
+    default:
+        s_log(LOG_ERR, "Mux protocol error: unknown frame type %d", type);
+        return 0;
+    }
+    return 1;
+}
+
+static void frame_header(unsigned char *p, unsigned long id,
+        int type, int len) {
+    p[0]=(unsigned char)(id>>24);
+    p[1]=(unsigned char)(id>>16);
+    p[2]=(unsigned char)(id>>8);
+    p[3]=(unsigned char)id;
+    p[4]=(unsigned char)type;
+    p[5]=0; /* reserved */
+    p[6]=(unsigned char)(len>>8);
+    p[7]=(unsigned char)len;
+}
+
+/* append a control frame; WINDOW carries a 32-bit increment */
+static void frame_send(MUX *m, unsigned long id, int type,
+        unsigned long increment) {
+    int len=type==FRAME_WINDOW ? 4 : 0;
+    unsigned char *p;
+
+    if(m->out_ptr+MUX_HEADER+len>MUX_BUFF) {
+        m->overflow=1; /* checked in mux_loop() */
+        return;
+    }
+    p=m->out_buff+m->out_ptr;
+    frame_header(p, id, type, len);
+    if(len) {
+        p[8]=(unsigned char)(increment>>24);
+        p[9]=(unsigned char)(increment>>16);
+        p[10]=(unsigned char)(increment>>8);
+        p[11]=(unsigned char)increment;
+    }
+    m->out_ptr+=MUX_HEADER+len;
+}
+
+static unsigned long get32(unsigned char *p) {
+    return (unsigned long)p[0]<<24|(unsigned long)p[1]<<16|
+        (unsigned long)p[2]<<8|(unsigned long)p[3];
+}
+
+#endif /* USE_MUX */
+
+/* end of mux.c */
@@ -427,6 +427,7 @@ static void signal_pipe_empty(void) {
 #endif /* defined USE_FORK */
             break;
         case SIGHUP:
+            session_files_save(); /* to be loaded by the new contexts */
             log_close();
             parse_conf(NULL, CONF_RELOAD);
             log_open();
@@ -439,6 +440,7 @@ static void signal_pipe_empty(void) {
         default:
             s_log(sig==SIGTERM ? LOG_NOTICE : LOG_ERR,
                 "Received signal %d; terminating", sig);
+            session_files_save();
             str_stats();
             die(3);
         }
@@ -561,6 +563,7 @@ int connect_blocking(CLI *c, SOCKADDR_UNION *addr, socklen_t addrlen) {
     if(error!=EINPROGRESS && error!=EWOULDBLOCK) {
         s_log(LOG_ERR, "connect_blocking: connect %s: %s (%d)",
             dst, s_strerror(error), error);
+        set_last_socket_error(error); /* s_log() may have overwritten it */
         return -1;
     }
 
@@ -586,6 +589,7 @@ int connect_blocking(CLI *c, SOCKADDR_UNION *addr, socklen_t addrlen) {
             if(error) { /* really an error? */
                 s_log(LOG_ERR, "connect_blocking: getsockopt %s: %s (%d)",
                     dst, s_strerror(error), error);
+                set_last_socket_error(error); /* for the caller */
                 return -1;
             }
         }
@@ -64,6 +64,7 @@ static void syntax(CONF_TYPE);
 static void config_error(int, const char *, const char *);
 static void section_error(int, const char *, const char *);
 static char *str_dup_err(char *);
+static NAME_LIST *name_list_dup(NAME_LIST *);
 #ifndef USE_WIN32
 static char **argalloc(char *);
 #endif
@@ -272,6 +273,72 @@ static char *parse_global_option(CMD cmd, char *opt, char *arg) {
     }
 #endif
 
+    /* handshakeQueue */
+    switch(cmd) {
+    case CMD_INIT:
+        new_global_options.handshake_queue=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "handshakeQueue"))
+            break;
+        new_global_options.handshake_queue=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || new_global_options.handshake_queue<0)
+            return "Illegal handshake queue length";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        s_log(LOG_NOTICE, "%-15s = %s", "handshakeQueue", "0 (no limit)");
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = connections waiting for 'handshakeWorkers'",
+            "handshakeQueue");
+        break;
+    }
+
+    /* handshakeWorkers */
+    switch(cmd) {
+    case CMD_INIT:
+        new_global_options.handshake_workers=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "handshakeWorkers"))
+            break;
+        new_global_options.handshake_workers=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || new_global_options.handshake_workers<0)
+            return "Illegal number of handshake workers";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        s_log(LOG_NOTICE, "%-15s = %s", "handshakeWorkers", "0 (no limit)");
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = number of SSL handshakes computed at once",
+            "handshakeWorkers");
+        break;
+    }
+
+    /* logAsync */
+    switch(cmd) {
+    case CMD_INIT:
+        new_global_options.option.log_async=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "logAsync"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            new_global_options.option.log_async=1;
+        else if(!strcasecmp(arg, "no"))
+            new_global_options.option.log_async=0;
+        else
+            return "Argument should be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        s_log(LOG_NOTICE, "%-15s = no", "logAsync");
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = yes|no write log messages from a dedicated thread",
+            "logAsync");
+        break;
+    }
+
     /* output */
     switch(cmd) {
     case CMD_INIT:
@@ -533,8 +600,10 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         char *opt, char *arg) {
     char *tmpstr;
     int tmpnum;
+    NAME_LIST *name_list, *tmp_names;
 #ifndef OPENSSL_NO_TLSEXT
     SERVICE_OPTIONS *tmpsrv;
+    char *errstr;
 #endif /* OPENSSL_NO_TLSEXT */
 
     if(cmd==CMD_DEFAULT || cmd==CMD_HELP) {
@@ -592,6 +661,31 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+#ifndef USE_WIN32
+    /* CApathPreload */
+    switch(cmd) {
+    case CMD_INIT:
+        section->option.ca_dir_preload=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "CApathPreload"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.ca_dir_preload=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.ca_dir_preload=0;
+        else
+            return "Argument should be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = yes|no load CApath into memory at startup",
+            "CApathPreload");
+        break;
+    }
+#endif /* USE_WIN32 */
+
     /* CAfile */
     switch(cmd) {
     case CMD_INIT:
@@ -624,11 +718,23 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
     switch(cmd) {
     case CMD_INIT:
         section->cert=NULL;
+        section->extra_cert_num=0;
+        section->cert_defined=0;
         break;
     case CMD_EXEC:
         if(strcasecmp(opt, "cert"))
             break;
-        section->cert=str_dup_err(arg);
+        if(!section->cert_defined) { /* replace the inherited pairs */
+            section->cert=str_dup_err(arg);
+            section->extra_cert_num=0;
+            section->cert_defined=1;
+            return NULL; /* OK */
+        }
+        if(section->extra_cert_num>=EXTRA_CERTS)
+            return "Too many certificates";
+        section->extra_cert[section->extra_cert_num]=str_dup_err(arg);
+        section->extra_key[section->extra_cert_num]=NULL;
+        ++section->extra_cert_num;
         return NULL; /* OK */
     case CMD_DEFAULT:
 #ifdef CONFDIR
@@ -638,7 +744,8 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
 #endif
         break;
     case CMD_HELP:
-        s_log(LOG_NOTICE, "%-15s = certificate chain", "cert");
+        s_log(LOG_NOTICE, "%-15s = certificate chain (repeat for other key types)",
+            "cert");
         break;
     }
 
@@ -693,6 +800,7 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
     case CMD_INIT:
         section->option.remote=0;
         section->remote_address=NULL;
+        section->remote_names=NULL;
         section->remote_addr.num=0;
         section->host_name=NULL;
         break;
@@ -701,6 +809,21 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
             break;
         section->option.remote=1;
         section->remote_address=str_dup_err(arg);
+        /* keep every name, as remote_addr accumulates all of them */
+        name_list=calloc(1, sizeof(NAME_LIST));
+        if(!name_list) {
+            s_log(LOG_ERR, "Memory allocation failed");
+            die(1);
+        }
+        name_list->name=section->remote_address;
+        if(section->remote_names) {
+            for(tmp_names=section->remote_names; tmp_names->next;
+                    tmp_names=tmp_names->next)
+                ;
+            tmp_names->next=name_list;
+        } else {
+            section->remote_names=name_list;
+        }
         if(!section->option.delayed_lookup &&
                 !name2addrlist(&section->remote_addr, arg, DEFAULT_LOOPBACK)) {
             s_log(LOG_INFO, "Cannot resolve '%s' - delaying DNS lookup", arg);
@@ -722,10 +845,36 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+    /* connectRefresh */
+    switch(cmd) {
+    case CMD_INIT:
+        section->remote_refresh=0; /* disabled */
+        section->remote_refresh_time=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "connectRefresh"))
+            break;
+        section->remote_refresh=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || section->remote_refresh<0)
+            return "Illegal refresh interval";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = seconds between background 'connect' lookups",
+            "connectRefresh");
+        break;
+    }
+
     /* CRLpath */
     switch(cmd) {
     case CMD_INIT:
         section->crl_dir=NULL;
+        section->crl_cache=NULL;
+#ifdef USE_CRL_STORE
+        section->crl_store=NULL;
+        section->crl_dir_time=0;
+#endif
         break;
     case CMD_EXEC:
         if(strcasecmp(opt, "CRLpath"))
@@ -903,6 +1052,31 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+    /* fastOpen */
+#if defined(TCP_FASTOPEN) || defined(TCP_FASTOPEN_CONNECT)
+    switch(cmd) {
+    case CMD_INIT:
+        section->option.fastopen=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "fastOpen"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.fastopen=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.fastopen=0;
+        else
+            return "Argument should be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = yes|no TCP Fast Open on accept/connect sockets",
+            "fastOpen");
+        break;
+    }
+#endif /* TCP_FASTOPEN || TCP_FASTOPEN_CONNECT */
+
     /* ident */
     switch(cmd) {
     case CMD_INIT:
@@ -928,7 +1102,10 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
     case CMD_EXEC:
         if(strcasecmp(opt, "key"))
             break;
-        section->key=str_dup_err(arg);
+        if(section->cert_defined && section->extra_cert_num) /* last cert */
+            section->extra_key[section->extra_cert_num-1]=str_dup_err(arg);
+        else
+            section->key=str_dup_err(arg);
         return NULL; /* OK */
     case CMD_DEFAULT:
         break;
@@ -937,6 +1114,29 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+#ifdef USE_KEYD
+    /* keyd */
+    switch(cmd) {
+    case CMD_INIT:
+        section->keyd_path=NULL;
+        section->keyd_pool_num=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "keyd"))
+            break;
+        if(strlen(arg)>=sizeof(((struct sockaddr_un *)0)->sun_path))
+            return "keyd socket path too long";
+        section->keyd_path=str_dup_err(arg);
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = UNIX socket of keyd holding the private key",
+            "keyd");
+        break;
+    }
+#endif /* USE_KEYD */
+
 #ifdef USE_LIBWRAP
     switch(cmd) {
     case CMD_INIT:
@@ -966,6 +1166,7 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
     case CMD_INIT:
         memset(&section->source_addr, 0, sizeof(SOCKADDR_LIST));
         section->source_addr.addr[0].in.sin_family=AF_INET;
+        memset(section->source_unavail, 0, sizeof section->source_unavail);
         break;
     case CMD_EXEC:
         if(strcasecmp(opt, "local"))
@@ -976,17 +1177,49 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
     case CMD_DEFAULT:
         break;
     case CMD_HELP:
-        s_log(LOG_NOTICE, "%-15s = IP address to be used as source for remote"
+        s_log(LOG_NOTICE, "%-15s = IP address(es) to be used as source for remote"
             " connections", "local");
         break;
     }
 
+    /* mux */
+#ifdef USE_MUX
+    switch(cmd) {
+    case CMD_INIT:
+        section->option.mux=0;
+        section->mux_channels=NULL;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "mux"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.mux=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.mux=0;
+        else
+            return "Argument should be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = yes|no multiplex connections over shared SSL"
+            " connections", "mux");
+        break;
+    }
+#endif /* USE_MUX */
+
     /* OCSP */
     switch(cmd) {
     case CMD_INIT:
         section->option.ocsp=0;
+        section->ocsp_host=NULL;
+        section->ocsp_path=NULL;
         memset(&section->ocsp_addr, 0, sizeof(SOCKADDR_LIST));
         section->ocsp_addr.addr[0].in.sin_family=AF_INET;
+        section->ocsp_cache=NULL;
+        section->ocsp_hits=0;
+        section->ocsp_misses=0;
+        section->ocsp_negative_hits=0;
         break;
     case CMD_EXEC:
         if(strcasecmp(opt, "ocsp"))
@@ -1000,6 +1233,29 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+    /* OCSPaia */
+    switch(cmd) {
+    case CMD_INIT:
+        section->option.ocsp_aia=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "OCSPaia"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.ocsp_aia=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.ocsp_aia=0;
+        else
+            return "Argument should be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = yes|no use the OCSP server URL from certificates",
+            "OCSPaia");
+        break;
+    }
+
     /* OCSPflag */
     switch(cmd) {
     case CMD_INIT:
@@ -1020,6 +1276,54 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+#ifndef OPENSSL_NO_TLSEXT
+    /* OCSPstapling */
+    switch(cmd) {
+    case CMD_INIT:
+        section->option.ocsp_stapling=0;
+        section->ocsp_staple=NULL;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "OCSPstapling"))
+            break;
+        if(!strcasecmp(arg, "yes"))
+            section->option.ocsp_stapling=1;
+        else if(!strcasecmp(arg, "no"))
+            section->option.ocsp_stapling=0;
+        else
+            return "Argument should be either 'yes' or 'no'";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = yes|no staple the OCSP response for our certificate",
+            "OCSPstapling");
+        break;
+    }
+#endif /* OPENSSL_NO_TLSEXT */
+
+    /* OCSPtimeout */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ocsp_timeout=5000;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "OCSPtimeout"))
+            break;
+        section->ocsp_timeout=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || section->ocsp_timeout<1 ||
+                section->ocsp_timeout>600000)
+            return "Illegal OCSP timeout";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        s_log(LOG_NOTICE, "%-15s = %d milliseconds", "OCSPtimeout", 5000);
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = OCSP server timeout (in milliseconds)",
+            "OCSPtimeout");
+        break;
+    }
+
     /* options */
     switch(cmd) {
     case CMD_INIT:
@@ -1206,6 +1510,10 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         section->option.sessiond=0;
         memset(&section->sessiond_addr, 0, sizeof(SOCKADDR_LIST));
         section->sessiond_addr.addr[0].in.sin_family=AF_INET;
+        section->sessiond_pool_num=0;
+        section->sessiond_hits=0;
+        section->sessiond_misses=0;
+        section->sessiond_timeouts=0;
         break;
     case CMD_EXEC:
         if(strcasecmp(opt, "sessiond"))
@@ -1227,12 +1535,101 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+    /* sessiondTimeout */
+    switch(cmd) {
+    case CMD_INIT:
+        section->sessiond_timeout=200;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "sessiondTimeout"))
+            break;
+        section->sessiond_timeout=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || section->sessiond_timeout<1 ||
+                section->sessiond_timeout>60000)
+            return "Illegal sessiond timeout";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        s_log(LOG_NOTICE, "%-15s = %d milliseconds", "sessiondTimeout", 200);
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = sessiond response timeout (in milliseconds)",
+            "sessiondTimeout");
+        break;
+    }
+
+#ifndef USE_FORK
+    /* sessionFile */
+    switch(cmd) {
+    case CMD_INIT:
+        section->session_file=NULL;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "sessionFile"))
+            break;
+        if(arg[0]) /* not empty */
+            section->session_file=str_dup_err(arg);
+        else
+            section->session_file=NULL;
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = file to save the session cache across restarts",
+            "sessionFile");
+        break;
+    }
+
+    /* sessionFileInterval */
+    switch(cmd) {
+    case CMD_INIT:
+        section->session_file_interval=0; /* only on reload and exit */
+        section->session_file_time=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "sessionFileInterval"))
+            break;
+        section->session_file_interval=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || section->session_file_interval<0)
+            return "Illegal session file save interval";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = seconds between periodic session file saves",
+            "sessionFileInterval");
+        break;
+    }
+#endif /* USE_FORK */
+
+    /* sessionShm */
+#ifdef USE_SHM_CACHE
+    switch(cmd) {
+    case CMD_INIT:
+        section->session_shm=0;
+        section->shm_cache=NULL;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "sessionShm"))
+            break;
+        section->session_shm=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || section->session_shm<0 ||
+                section->session_shm>1048576)
+            return "Illegal shared session cache size";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = number of sessions in a shared memory cache",
+            "sessionShm");
+        break;
+    }
+#endif /* USE_SHM_CACHE */
+
 #ifndef OPENSSL_NO_TLSEXT
     /* sni */
     switch(cmd) {
     case CMD_INIT:
-        section->servername_list_head=NULL;
-        section->servername_list_tail=NULL;
+        section->sni_index=NULL;
         section->option.sni=0;
         break;
     case CMD_EXEC:
@@ -1249,25 +1646,13 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
             return "Section name not found";
         if(tmpsrv->option.client)
             return "SNI master service is a TLS client";
-        if(tmpsrv->servername_list_tail) {
-            tmpsrv->servername_list_tail->next=str_alloc(sizeof(SERVERNAME_LIST));
-            tmpsrv->servername_list_tail=tmpsrv->servername_list_tail->next;
-        } else { /* first virtual service */
-            tmpsrv->servername_list_head=
-                tmpsrv->servername_list_tail=
-                str_alloc(sizeof(SERVERNAME_LIST));
-            tmpsrv->ssl_options|=SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
-        }
-        if(!tmpsrv->servername_list_tail) {
-            s_log(LOG_ERR, "Fatal memory allocation error");
-            die(2);
-        }
-        tmpsrv->servername_list_tail->servername=str_dup_err(tmpstr);
-        tmpsrv->servername_list_tail->opt=section;
-        tmpsrv->servername_list_tail->next=NULL;
+        errstr=sni_index_add(tmpsrv, tmpstr, section);
+        if(errstr)
+            return errstr;
         section->option.sni=1;
         /* always negotiate a new session on renegotiation, as the SSL
          * context settings (including access control) may be different */
+        tmpsrv->ssl_options|=SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
         section->ssl_options|=SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION;
         return NULL; /* OK */
     case CMD_DEFAULT:
@@ -1377,6 +1762,52 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
     }
 #endif
 
+#ifndef OPENSSL_NO_TLSEXT
+    /* ticketKeys */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ticket_keys=NULL;
+        section->ticket_key_num=0;
+        section->ticket_keys_mtime=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "ticketKeys"))
+            break;
+        if(arg[0]) /* not empty */
+            section->ticket_keys=str_dup_err(arg);
+        else
+            section->ticket_keys=NULL;
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = session ticket key file or directory",
+            "ticketKeys");
+        break;
+    }
+
+    /* ticketRotate */
+    switch(cmd) {
+    case CMD_INIT:
+        section->ticket_rotate=0; /* disabled */
+        section->ticket_rotate_time=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "ticketRotate"))
+            break;
+        section->ticket_rotate=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || section->ticket_rotate<0)
+            return "Illegal ticket key rotation interval";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = seconds between generated session ticket keys",
+            "ticketRotate");
+        break;
+    }
+#endif /* OPENSSL_NO_TLSEXT */
+
     /* TIMEOUTbusy */
     switch(cmd) {
     case CMD_INIT:
@@ -1531,6 +1962,55 @@ static char *parse_service_option(CMD cmd, SERVICE_OPTIONS *section,
         break;
     }
 
+    /* verifyPins */
+    switch(cmd) {
+    case CMD_INIT:
+        section->pin_file=NULL;
+        section->pin_set=NULL;
+        section->pin_file_mtime=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "verifyPins"))
+            break;
+        if(arg[0]) /* not empty */
+            section->pin_file=str_dup_err(arg);
+        else
+            section->pin_file=NULL;
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = file with SHA-256 fingerprints of the peers",
+            "verifyPins");
+        break;
+    }
+
+    /* verifyCacheTTL */
+    switch(cmd) {
+    case CMD_INIT:
+        section->verify_cache_ttl=0;
+        section->verify_cache=NULL;
+        section->verify_generation=0;
+        section->verify_cache_hits=0;
+        section->verify_cache_misses=0;
+        break;
+    case CMD_EXEC:
+        if(strcasecmp(opt, "verifyCacheTTL"))
+            break;
+        section->verify_cache_ttl=strtol(arg, &tmpstr, 10);
+        if(tmpstr==arg || *tmpstr || section->verify_cache_ttl<0 ||
+                section->verify_cache_ttl>86400)
+            return "Illegal verify cache TTL";
+        return NULL; /* OK */
+    case CMD_DEFAULT:
+        s_log(LOG_NOTICE, "%-15s = %d seconds", "verifyCacheTTL", 0);
+        break;
+    case CMD_HELP:
+        s_log(LOG_NOTICE, "%-15s = seconds to cache accepted peer certificates",
+            "verifyCacheTTL");
+        break;
+    }
+
     if(cmd==CMD_EXEC)
         return option_not_found;
     return NULL; /* OK */
@@ -1658,7 +2138,16 @@ void parse_conf(char *name, CONF_TYPE type) {
             }
             memcpy(new_section, &new_service_options, sizeof(SERVICE_OPTIONS));
             new_section->servname=str_dup_err(config_opt);
-            new_section->session=NULL;
+            /* "connect" appends to the list, so it must not be shared */
+            new_section->remote_names=
+                name_list_dup(new_service_options.remote_names);
+            new_section->cert_defined=0;
+            memset(new_section->client_cache, 0,
+                sizeof new_section->client_cache);
+            new_section->client_cache_clock=0;
+            new_section->client_cache_hits=0;
+            new_section->client_cache_misses=0;
+            new_section->client_cache_stale=0;
             new_section->next=NULL;
             section->next=new_section;
             section=new_section;
@@ -1780,6 +2269,38 @@ static int section_init(int last_line, SERVICE_OPTIONS *section, int final) {
             return 0;
         }
     }
+#ifdef TCP_FASTOPEN_CONNECT
+    /* the SYN of a Fast Open connect is delayed until the first write,
+     * so a protocol reading the server greeting first would never start */
+    if(section->option.fastopen && section->protocol) {
+        section_error(last_line, section->servname,
+            "'fastOpen' is not allowed with 'protocol'");
+        return 0;
+    }
+#endif /* TCP_FASTOPEN_CONNECT */
+#ifdef USE_MUX
+    if(section->option.mux) {
+        if(!section->option.remote || section->option.program ||
+                section->protocol || section->option.sni ||
+                section->option.transparent_src ||
+                section->option.transparent_dst) {
+            section_error(last_line, section->servname,
+                "'mux' requires 'connect' without 'exec', 'protocol',"
+                " 'sni' or 'transparent'");
+            return 0;
+        }
+        if(section->option.client && section==&new_service_options) {
+            section_error(last_line, section->servname,
+                "'mux' client is not allowed in inetd mode");
+            return 0;
+        }
+        if(!section->option.client && section->source_addr.num) {
+            section_error(last_line, section->servname,
+                "'local' is not supported by 'mux' server");
+            return 0;
+        }
+    }
+#endif /* USE_MUX */
     return 1; /* all tests passed -- continue program execution */
 }
 
@@ -2136,6 +2657,7 @@ static char *parse_ocsp_url(SERVICE_OPTIONS *section, char *arg) {
             " - additional stunnel service needs to be defined";
     if(!hostport2addrlist(&section->ocsp_addr, host, port))
         return "Failed to resolve OCSP server address";
+    section->ocsp_host=str_dup_err(host);
     section->ocsp_path=str_dup_err(path);
     if(host)
         OPENSSL_free(host);
@@ -2228,6 +2750,21 @@ static char *str_dup_err(char *str) { /* str_dup() with error checking */
     return retval;
 }
 
+static NAME_LIST *name_list_dup(NAME_LIST *src) { /* copy the nodes */
+    NAME_LIST *retval=NULL, **tail=&retval;
+
+    for(; src; src=src->next) {
+        *tail=calloc(1, sizeof(NAME_LIST));
+        if(!*tail) {
+            s_log(LOG_ERR, "Fatal memory allocation error");
+            die(2);
+        }
+        (*tail)->name=src->name;
+        tail=&(*tail)->next;
+    }
+    return retval;
+}
+
 #ifndef USE_WIN32
 
 static char **argalloc(char *str) { /* allocate 'exec' argumets */
@@ -44,7 +44,7 @@ openssldir = u:/extras
 #syslogdir = /unixos2/workdir/syslog
 INCLUDES = -I$(openssldir)/outinc
 LIBS = -lsocket -L$(openssldir)/out -lssl -lcrypto -lz -lsyslog
-OBJS = file.o client.o log.o options.o protocol.o network.o ssl.o ctx.o verify.o sthreads.o stunnel.o pty.o resolver.o str.o
+OBJS = file.o client.o log.o options.o protocol.o network.o ssl.o ctx.o verify.o sthreads.o cron.o mux.o cache.o crlindex.o stunnel.o pty.o resolver.o str.o
 libdir = .
 cflags = -O2 -Wall -Wshadow -Wcast-align -Wpointer-arith
 
@@ -65,9 +65,13 @@ options.o: options.c common.h prototypes.h
 protocol.o: protocol.c common.h prototypes.h
 pty.o: pty.c common.h prototypes.h
 ssl.o: ssl.c common.h prototypes.h
-ctx.o: ctx.c common.h prototypes.h
+ctx.o: ctx.c common.h prototypes.h sessiond.h
 verify.o: verify.c common.h prototypes.h
 sthreads.o: sthreads.c common.h prototypes.h
+cron.o: cron.c common.h prototypes.h
+mux.o: mux.c common.h prototypes.h
+cache.o: cache.c common.h prototypes.h
+crlindex.o: crlindex.c crlindex.h
 stunnel.o: stunnel.c common.h prototypes.h
 resolver.o: resolver.c common.h prototypes.h
 str.o: str.c common.h prototypes.h
@@ -43,6 +43,12 @@
 /**************************************** data structures */
 
 #define MAX_HOSTS 16
+#define SESSIOND_POOL 16 /* idle sessiond sockets kept for each service */
+#define KEYD_POOL 16         /* idle keyd sockets kept for each service */
+#define TICKET_KEYS_MAX 16
+#define EXTRA_CERTS 3  /* cert/key pairs of other key types, e.g. ECDSA */
+#define CLIENT_CACHE_DESTS 16     /* destinations with cached client sessions */
+#define CLIENT_CACHE_SESSIONS 4      /* sessions cached for each destination */
 
 typedef enum {LOG_MODE_NONE, LOG_MODE_ERROR, LOG_MODE_FULL} LOG_MODE;
 
@@ -81,6 +87,10 @@ typedef struct {
     int uid, gid;
 #endif
 
+        /* handshake admission for sthreads.c */
+    int handshake_workers;              /* concurrent handshakes, 0=no limit */
+    int handshake_queue;              /* connections waiting for a handshake */
+
         /* Win32 specific data for gui.c */
 #if defined(USE_WIN32) && !defined(_WIN32_WCE)
     char *win32_service;
@@ -102,6 +112,7 @@ typedef struct {
         unsigned int foreground:1;
         unsigned int syslog:1;
 #endif
+        unsigned int log_async:1;             /* log from a dedicated thread */
 #ifdef USE_FIPS
         unsigned int fips:1;                       /* enable FIPS 140-2 mode */
 #endif
@@ -110,7 +121,27 @@ typedef struct {
 
 extern GLOBAL_OPTIONS global_options;
 
-typedef struct servername_list_struct SERVERNAME_LIST; /* forward declaration */
+typedef struct name_list_struct NAME_LIST; /* forward declaration */
+typedef struct sni_index_struct SNI_INDEX; /* forward declaration */
+typedef struct mux_channel_struct MUX_CHANNEL; /* forward declaration */
+typedef struct shm_cache_struct SHM_CACHE; /* forward declaration */
+typedef struct ocsp_cache_struct OCSP_CACHE; /* forward declaration */
+typedef struct ocsp_staple_struct OCSP_STAPLE; /* forward declaration */
+typedef struct crl_cache_struct CRL_CACHE; /* forward declaration */
+typedef struct crl_store_struct CRL_STORE; /* forward declaration */
+typedef struct verify_cache_struct VERIFY_CACHE; /* forward declaration */
+typedef struct pin_set_struct PIN_SET; /* forward declaration */
+
+typedef struct {
+    unsigned char name[16], hmac_key[16], aes_key[16];
+    time_t created;                      /* for generated keys, 0 otherwise */
+} TICKET_KEY;
+
+typedef struct {
+    SOCKADDR_UNION addr;                        /* destination of the entry */
+    SSL_SESSION *session[CLIENT_CACHE_SESSIONS];    /* most recent first */
+    unsigned long last_used;                  /* for LRU entry replacement */
+} CLIENT_CACHE;
 
 typedef struct service_options_struct {
     SSL_CTX *ctx;                                            /*  SSL context */
@@ -120,7 +151,9 @@ typedef struct service_options_struct {
 #endif
     struct service_options_struct *next;   /* next node in the services list */
     char *servname;        /* service name for logging & permission checking */
-    SSL_SESSION *session;                           /* jecently used session */
+    CLIENT_CACHE client_cache[CLIENT_CACHE_DESTS]; /* client mode sessions */
+    unsigned long client_cache_clock;         /* client cache LRU timestamp */
+    unsigned long client_cache_hits, client_cache_misses, client_cache_stale;
     char local_address[IPLEN];             /* dotted-decimal address to bind */
 #ifndef USE_FORK
     int stack_size;                            /* stack size for this thread */
@@ -131,20 +164,62 @@ typedef struct service_options_struct {
     char *ca_file;                       /* file containing bunches of certs */
     char *crl_dir;                              /* directory for hashed CRLs */
     char *crl_file;                       /* file containing bunches of CRLs */
+    CRL_CACHE *crl_cache;              /* indexed CRLs, most recent first */
+#ifdef USE_CRL_STORE
+    CRL_STORE *crl_store;                    /* CRLs loaded from crl_dir */
+    time_t crl_dir_time;                          /* next check of crl_dir */
+#endif
     char *cipher_list;
     char *cert;                                             /* cert filename */
     char *key;                               /* pem (priv key/cert) filename */
+    char *extra_cert[EXTRA_CERTS], *extra_key[EXTRA_CERTS];
+    int extra_cert_num;
+    int cert_defined;              /* cert specified in the current section */
     long session_timeout;
     int verify_level;
     int verify_use_only_my;
+    char *pin_file;                  /* SHA-256 fingerprints of the peers */
+    PIN_SET *pin_set;                        /* protected by CRIT_PIN */
+    time_t pin_file_mtime;                                  /* for cron.c */
     int curve;
     long ssl_options;
     SOCKADDR_LIST ocsp_addr;
-    char *ocsp_path;
+    char *ocsp_host, *ocsp_path;
+    int ocsp_timeout;                  /* OCSP responder timeout (in ms) */
     unsigned long ocsp_flags;
+    OCSP_CACHE *ocsp_cache;                   /* verified OCSP responses */
+    unsigned long ocsp_hits, ocsp_misses, ocsp_negative_hits;
+    long verify_cache_ttl;        /* seconds to remember accepted certificates */
+    VERIFY_CACHE *verify_cache;
+    unsigned long verify_generation;  /* changed on CRL or OCSP revocations */
+    unsigned long verify_cache_hits, verify_cache_misses;
+#ifndef OPENSSL_NO_TLSEXT
+    OCSP_STAPLE *ocsp_staple;            /* OCSP response for our certificate */
+#endif
     SSL_METHOD *client_method, *server_method;
     SOCKADDR_LIST sessiond_addr;
-    SERVERNAME_LIST *servername_list_head, *servername_list_tail;
+    int sessiond_timeout;                   /* sessiond timeout (in ms) */
+    int sessiond_pool[SESSIOND_POOL], sessiond_pool_num;   /* idle sockets */
+    unsigned long sessiond_hits, sessiond_misses, sessiond_timeouts;
+#ifdef USE_KEYD
+    char *keyd_path;                       /* UNIX socket of the keyd server */
+    int keyd_pool[KEYD_POOL], keyd_pool_num;                 /* idle sockets */
+#endif
+#ifdef USE_SHM_CACHE
+    int session_shm;                           /* shared session cache size */
+    SHM_CACHE *shm_cache;                   /* shared session cache segment */
+#endif
+    char *session_file;                   /* sessions saved across restarts */
+    long session_file_interval;      /* seconds between periodic saves or 0 */
+    time_t session_file_time;                         /* next periodic save */
+#ifndef OPENSSL_NO_TLSEXT
+    char *ticket_keys;                 /* session ticket key file or directory */
+    long ticket_rotate;                 /* seconds between generated ticket keys */
+    TICKET_KEY ticket_key[TICKET_KEYS_MAX];    /* the current key goes first */
+    int ticket_key_num;
+    time_t ticket_keys_mtime, ticket_rotate_time;       /* for cron.c */
+#endif
+    SNI_INDEX *sni_index;         /* virtual services indexed by host name */
 
         /* service-specific data for client.c */
     int fd;        /* file descriptor accepting connections for this service */
@@ -155,14 +230,21 @@ typedef struct service_options_struct {
     char **execargs; /* program arguments for local mode */
 #endif
     SOCKADDR_LIST local_addr, remote_addr, source_addr;
+    unsigned long source_unavail[MAX_HOSTS]; /* source_addr exhaustion */
     char *username;
     char *remote_address;
+    NAME_LIST *remote_names; /* all "connect" names for remote_refresh */
+    int remote_refresh; /* remote_addr refresh interval */
+    time_t remote_refresh_time; /* next remote_addr refresh in cron.c */
     char *host_name;
     int timeout_busy; /* maximum waiting for data time */
     int timeout_close; /* maximum close_notify time */
     int timeout_connect; /* maximum connect() time */
     int timeout_idle; /* maximum idle connection time */
     enum {FAILOVER_RR, FAILOVER_PRIO} failover; /* failover strategy */
+#ifdef USE_MUX
+    MUX_CHANNEL *mux_channels; /* outgoing mux channels in mux.c */
+#endif
 
         /* protocol name for protocol.c */
     char *protocol;
@@ -181,24 +263,34 @@ typedef struct service_options_struct {
         unsigned int sessiond:1;
         unsigned int program:1;
         unsigned int sni:1;
+#if defined(TCP_FASTOPEN) || defined(TCP_FASTOPEN_CONNECT)
+        unsigned int fastopen:1;
+#endif
 #ifndef USE_WIN32
         unsigned int pty:1;
         unsigned int transparent_src:1;
         unsigned int transparent_dst:1;
 #endif
         unsigned int ocsp:1;
+        unsigned int ocsp_aia:1;
+        unsigned int ocsp_stapling:1;
+#ifndef USE_WIN32
+        unsigned int ca_dir_preload:1;
+#endif
 #ifdef USE_LIBWRAP
         unsigned int libwrap:1;
+#endif
+#ifdef USE_MUX
+        unsigned int mux:1;
 #endif
     } option;
 } SERVICE_OPTIONS;
 
 extern SERVICE_OPTIONS service_options;
 
-struct servername_list_struct {
-    char *servername;
-    SERVICE_OPTIONS *opt;
-    struct servername_list_struct *next;
+struct name_list_struct {
+    char *name;
+    struct name_list_struct *next;
 };
 
 typedef enum {
@@ -253,6 +345,9 @@ typedef struct disk_file {
 /**************************************** prototypes for stunnel.c */
 
 extern volatile int num_clients;
+#ifdef HAVE_CHROOT
+extern int root_changed;
+#endif
 
 void main_initialize(char *, char *);
 void main_execute(void);
@@ -265,6 +360,7 @@ int s_pipe(int [2], int, char *);
 int s_socketpair(int, int, int, int [2], int, char *);
 int s_accept(int, struct sockaddr *, socklen_t *, int, char *);
 void stunnel_info(int);
+char *chroot_path(char *);
 void die(int);
 void set_nonblock(int, unsigned long);
 
@@ -277,6 +373,7 @@ void syslog_close(void);
 void log_open(void);
 void log_close(void);
 void log_flush(LOG_MODE);
+int log_writer_init(void);
 void s_log(int, const char *, ...)
 #ifdef __GNUC__
     __attribute__ ((format (printf, 2, 3)));
@@ -313,11 +410,30 @@ void parse_conf(char *, CONF_TYPE);
 /**************************************** prototypes for ctx.c */
 
 int context_init(SERVICE_OPTIONS *);
+void session_file_save(SERVICE_OPTIONS *);
+void session_files_save(void);
+#ifndef OPENSSL_NO_TLSEXT
+int ticket_keys_load(SERVICE_OPTIONS *);
+void ticket_keys_rotate(SERVICE_OPTIONS *);
+char *sni_index_add(SERVICE_OPTIONS *, char *, SERVICE_OPTIONS *);
+#endif
+#if (defined(USE_PTHREAD) || defined(USE_WIN32)) && !defined(OPENSSL_NO_RSA)
+void tmp_rsa_refresh(time_t);
+#endif
 void sslerror(char *);
 
 /**************************************** prototypes for verify.c */
 
 int verify_init(SERVICE_OPTIONS *);
+int pin_set_load(SERVICE_OPTIONS *);
+void ocsp_resolve_refresh(SERVICE_OPTIONS *, time_t);
+#ifdef USE_CRL_STORE
+void crl_store_refresh(SERVICE_OPTIONS *, time_t);
+#endif
+#ifndef OPENSSL_NO_TLSEXT
+int ocsp_staple_init(SERVICE_OPTIONS *);
+void ocsp_staple_refresh(SERVICE_OPTIONS *, time_t);
+#endif
 
 /**************************************** prototypes for network.c */
 
@@ -355,6 +471,8 @@ typedef struct {
         /* IP for explicit local bind or transparent proxy */
     unsigned long pid; /* PID of the local process */
     int fd; /* temporary file descriptor */
+    int handshake; /* a handshake slot is held */
+    time_t verify_expires; /* verify cache expiry of the current cert */
 
     /* data for transfer() function */
     char sock_buff[BUFFSIZE]; /* socket read buffer */
@@ -364,6 +482,9 @@ typedef struct {
     FD *ssl_rfd, *ssl_wfd; /* read and write SSL descriptors */
     int sock_bytes, ssl_bytes; /* bytes written to socket and SSL */
     s_poll_set fds; /* file descriptors */
+#ifdef USE_MUX
+    MUX_CHANNEL *mux; /* outgoing mux channel served by this thread */
+#endif
 } CLI;
 
 CLI *alloc_client_session(SERVICE_OPTIONS *, int, int);
@@ -398,7 +519,9 @@ char *s_ntop(char *, SOCKADDR_UNION *);
 
 typedef enum {
     CRIT_KEYGEN, CRIT_INET, CRIT_CLIENTS,
-    CRIT_WIN_LOG, CRIT_SESSION, CRIT_LIBWRAP,
+    CRIT_WIN_LOG, CRIT_SESSION, CRIT_LIBWRAP, CRIT_ADDR, CRIT_MUX,
+    CRIT_SESSION_FILE, CRIT_OCSP, CRIT_CRL, CRIT_VERIFY, CRIT_PIN,
+    CRIT_HANDSHAKE, CRIT_KEYD,
 #if OPENSSL_VERSION_NUMBER<0x1000002f
     CRIT_SSL,
 #endif /* OpenSSL version < 1.0.0b */
@@ -411,6 +534,10 @@ void sthreads_init(void);
 unsigned long stunnel_process_id(void);
 unsigned long stunnel_thread_id(void);
 int create_client(int, int, CLI *, void *(*)(void *));
+int handshake_enter(int);
+void handshake_leave(void);
+void handshake_pause(void);
+void handshake_resume(void);
 #ifdef USE_UCONTEXT
 typedef struct CONTEXT_STRUCTURE {
     char *stack; /* CPU stack for this thread */
@@ -433,6 +560,30 @@ void _endthread(void);
 void stack_info(int);
 #endif
 
+/**************************************** prototypes for cron.c */
+
+int cron_init(void);
+
+/**************************************** prototypes for mux.c */
+
+#ifdef USE_MUX
+void mux_attach(CLI *);
+void mux_transfer(CLI *);
+void mux_release(MUX_CHANNEL *);
+#endif
+
+/**************************************** prototypes for cache.c */
+
+#ifdef USE_SHM_CACHE
+SHM_CACHE *shm_cache_create(char *, int);
+void shm_cache_new(SHM_CACHE *, const unsigned char *, unsigned int,
+    const unsigned char *, unsigned int, long);
+unsigned char *shm_cache_get(SHM_CACHE *, const unsigned char *,
+    unsigned int, unsigned int *);
+void shm_cache_remove(SHM_CACHE *, const unsigned char *, unsigned int);
+void shm_cache_stats(SHM_CACHE *);
+#endif
+
 /**************************************** prototypes for gui.c */
 
 typedef struct {
@@ -478,7 +629,7 @@ LPSTR tstr2str(const LPTSTR);
 /**************************************** prototypes for libwrap.c */
 
 void libwrap_init(int);
-void libwrap_auth(CLI *);
+int libwrap_auth(CLI *);
 
 /**************************************** prototypes for str.c */
 
@@ -0,0 +1,308 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+/* sessbench: a load generator for sessiond */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "sessiond.h"
+
+static int sock, val_len=200, timeout=1000;
+static u_char key_base[CACHE_KEY_LEN];
+
+static void usage(const char *);
+static int connect_socket(const char *);
+static int send_request(int, unsigned long);
+static int wait_responses(unsigned long *, unsigned long *);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+    int i, concurrency=64, get_percent=90, outstanding;
+    long value;
+    unsigned long keys=10000, requests=100000, issued, done,
+        key, hits=0, misses=0, lost=0, added=0;
+    char *end;
+    double start, elapsed;
+
+    for(i=1; i<argc-1 && argv[i][0]=='-'; i+=2) {
+        value=strtol(argv[i+1], &end, 10);
+        if(end==argv[i+1] || *end || value<0)
+            usage(argv[0]);
+        switch(argv[i][1]) {
+        case 'c':
+            concurrency=value;
+            break;
+        case 'n':
+            requests=value;
+            break;
+        case 'k':
+            keys=value;
+            break;
+        case 'l':
+            val_len=value;
+            break;
+        case 'g':
+            get_percent=value;
+            break;
+        case 'w':
+            timeout=value;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(i!=argc-1 || concurrency<1 || keys<1 || val_len>MAX_VAL_LEN ||
+            get_percent>100 || timeout<1)
+        usage(argv[0]);
+
+    sock=connect_socket(argv[i]);
+    if(sock<0)
+        return 1;
+    srand((unsigned int)time(NULL)^(unsigned int)getpid());
+    for(i=0; i<CACHE_KEY_LEN; ++i)
+        key_base[i]=rand();
+
+    /* store all the keys, pacing with a get after each window */
+    start=now();
+    for(key=0; key<keys; ++key) {
+        if(send_request(CACHE_CMD_NEW, key))
+            return 1;
+        if((key+1)%concurrency && key+1<keys)
+            continue;
+        if(send_request(CACHE_CMD_GET, key))
+            return 1;
+        outstanding=1;
+        while(outstanding) {
+            i=wait_responses(&hits, &misses);
+            if(i<0)
+                return 1;
+            outstanding-=i ? i : outstanding; /* a timeout */
+        }
+    }
+    fprintf(stderr, "sessbench: %lu keys stored in %.3f s\n",
+        keys, now()-start);
+    hits=misses=0;
+
+    /* keep a window of concurrent get requests in flight */
+    start=now();
+    issued=done=0;
+    outstanding=0;
+    while(done<requests) {
+        while(outstanding<concurrency && issued<requests) {
+            key=(unsigned long)rand()%keys;
+            if(rand()%100<get_percent) {
+                if(send_request(CACHE_CMD_GET, key))
+                    return 1;
+                ++outstanding;
+            } else {
+                if(send_request(CACHE_CMD_NEW, key))
+                    return 1;
+                ++added;
+                ++done;
+            }
+            ++issued;
+        }
+        if(!outstanding)
+            continue;
+        i=wait_responses(&hits, &misses);
+        if(i<0)
+            return 1;
+        if(!i) { /* timeout: consider all outstanding requests lost */
+            lost+=outstanding;
+            done+=outstanding;
+            outstanding=0;
+            continue;
+        }
+        if(i>outstanding) /* late responses to lost requests */
+            i=outstanding;
+        outstanding-=i;
+        done+=i;
+    }
+    elapsed=now()-start;
+    printf("%lu requests in %.3f s: %.0f requests/s\n",
+        requests, elapsed, elapsed>0 ? requests/elapsed : 0.0);
+    printf("%lu hits, %lu misses, %lu lost, %lu new\n",
+        hits, misses, lost, added);
+    return 0;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-c concurrency] [-n requests] [-k keys] "
+        "[-l length] [-g get_percent] [-w timeout] [host:]port\n", name);
+    fprintf(stderr, "  -c  requests in flight (default 64)\n");
+    fprintf(stderr, "  -n  number of requests (default 100000)\n");
+    fprintf(stderr, "  -k  number of distinct sessions (default 10000)\n");
+    fprintf(stderr, "  -l  encoded session length (default 200)\n");
+    fprintf(stderr, "  -g  percentage of get requests (default 90)\n");
+    fprintf(stderr, "  -w  response timeout in milliseconds (default 1000)\n");
+    exit(1);
+}
+
+static int connect_socket(const char *address) {
+    struct addrinfo hints, *res;
+    char *host, *port;
+    int s, err, opt;
+
+    host=strdup(address);
+    if(!host) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    port=strrchr(host, ':');
+    if(port) {
+        *port++='\0';
+    } else { /* only the port was specified */
+        port=host;
+        host="localhost";
+    }
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_DGRAM;
+    err=getaddrinfo(host, port, &hints, &res);
+    if(err) {
+        fprintf(stderr, "getaddrinfo: %s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+    s=socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(s<0) {
+        perror("socket");
+        freeaddrinfo(res);
+        return -1;
+    }
+    opt=1<<22; /* absorb bursts of responses */
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, (void *)&opt, sizeof opt);
+    if(connect(s, res->ai_addr, res->ai_addrlen)) {
+        perror("connect");
+        close(s);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    fcntl(s, F_SETFL, O_NONBLOCK);
+    return s;
+}
+
+static int send_request(int type, unsigned long key) {
+    CACHE_PACKET packet;
+    int len=CACHE_HEADER_LEN;
+
+    memset(&packet, 0, CACHE_HEADER_LEN);
+    packet.version=1;
+    packet.type=type;
+    packet.timeout=htons(3600);
+    memcpy(packet.key, key_base, CACHE_KEY_LEN);
+    packet.key[0]=(u_char)(key>>24);
+    packet.key[1]=(u_char)(key>>16);
+    packet.key[2]=(u_char)(key>>8);
+    packet.key[3]=(u_char)key;
+    if(type==CACHE_CMD_NEW) {
+        memset(packet.val, (int)(key&0xff), val_len);
+        len+=val_len;
+    }
+    while(send(sock, (void *)&packet, len, 0)<0) {
+        if(errno==EAGAIN || errno==EWOULDBLOCK || errno==ENOBUFS) {
+            usleep(100); /* the socket buffer is full */
+            continue;
+        }
+        if(errno==EINTR || errno==ECONNREFUSED)
+            continue; /* ECONNREFUSED is reported for an earlier datagram */
+        perror("send");
+        return 1;
+    }
+    return 0;
+}
+
+/* returns the number of responses received, 0 on timeout, -1 on error */
+static int wait_responses(unsigned long *hits, unsigned long *misses) {
+    struct pollfd pfd;
+    CACHE_PACKET packet;
+    int num=0, len;
+
+    pfd.fd=sock;
+    pfd.events=POLLIN;
+    switch(poll(&pfd, 1, timeout)) {
+    case -1:
+        if(errno==EINTR)
+            return 0;
+        perror("poll");
+        return -1;
+    case 0:
+        return 0;
+    }
+    for(;;) {
+        len=recv(sock, (void *)&packet, sizeof packet, 0);
+        if(len<0) {
+            if(errno==EAGAIN || errno==EWOULDBLOCK || errno==EINTR)
+                return num;
+            if(errno==ECONNREFUSED) {
+                fprintf(stderr, "sessbench: sessiond is not running\n");
+                return -1;
+            }
+            perror("recv");
+            return -1;
+        }
+        if(len<(int)CACHE_HEADER_LEN)
+            continue;
+        if(packet.type==CACHE_RESP_OK)
+            ++*hits;
+        else
+            ++*misses;
+        ++num;
+    }
+}
+
+static double now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec+tv.tv_usec/1000000.0;
+}
+
+/* end of sessbench.c */
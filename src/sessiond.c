@@ -0,0 +1,586 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+/* sessiond: a standalone session cache server for the "sessiond" option */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif /* USE_PTHREAD */
+
+#include "sessiond.h"
+
+/* number of shards: each one has its own lock, table and LRU list */
+#define SHARDS 64
+/* initial number of slots in each shard table (a power of 2) */
+#define INITIAL_SLOTS 256
+/* number of datagrams received or sent with a single system call */
+#define BATCH 64
+
+typedef struct entry_struct {
+    struct entry_struct *prev, *next; /* LRU list, most recent first */
+    time_t expire;
+    unsigned int hash;
+    unsigned int val_len;
+    u_char key[CACHE_KEY_LEN];
+    u_char val[1]; /* allocated with val_len bytes */
+} ENTRY;
+
+typedef struct {
+#ifdef USE_PTHREAD
+    pthread_mutex_t lock;
+#endif /* USE_PTHREAD */
+    ENTRY **slot; /* open addressing with linear probing */
+    unsigned int mask, used, deleted;
+    ENTRY *head, *tail;
+    size_t memory, limit;
+    unsigned long added, hits, misses, expired, evicted, removed;
+} SHARD;
+
+static ENTRY deleted_entry; /* marks a deleted slot */
+#define DELETED (&deleted_entry)
+
+static SHARD shard[SHARDS];
+static unsigned int hash_seed;
+static int sock, stats_interval=0, verbose=0;
+static time_t next_stats;
+
+static void usage(const char *);
+static int bind_socket(const char *);
+static void cache_init(size_t);
+static unsigned int cache_hash(const u_char *);
+static int slot_find(SHARD *, unsigned int, const u_char *);
+static void slot_resize(SHARD *, unsigned int);
+static void entry_delete(SHARD *, int);
+static void cache_new(const u_char *, const u_char *, unsigned int, time_t);
+static int cache_get(const u_char *, u_char *);
+static void cache_remove(const u_char *);
+static int process(u_char *, int);
+static void print_stats(void);
+static void *worker(void *);
+static void shard_lock(SHARD *);
+static void shard_unlock(SHARD *);
+
+int main(int argc, char *argv[]) {
+    int i, threads=1;
+    long memory=64; /* megabytes */
+    char *arg, *end;
+#ifdef USE_PTHREAD
+    pthread_t thread;
+#endif /* USE_PTHREAD */
+
+    for(i=1; i<argc-1 && argv[i][0]=='-'; i+=2) {
+        arg=argv[i+1];
+        switch(argv[i][1]) {
+        case 'm':
+            memory=strtol(arg, &end, 10);
+            if(end==arg || *end || memory<1 || memory>65536)
+                usage(argv[0]);
+            break;
+        case 't':
+            threads=strtol(arg, &end, 10);
+            if(end==arg || *end || threads<1 || threads>256)
+                usage(argv[0]);
+            break;
+        case 's':
+            stats_interval=strtol(arg, &end, 10);
+            if(end==arg || *end || stats_interval<0)
+                usage(argv[0]);
+            break;
+        case 'v':
+            verbose=strtol(arg, &end, 10);
+            if(end==arg || *end)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if(i!=argc-1)
+        usage(argv[0]);
+#ifndef USE_PTHREAD
+    if(threads>1) {
+        fprintf(stderr, "Threads are not supported in this build\n");
+        return 1;
+    }
+#endif /* USE_PTHREAD */
+
+    sock=bind_socket(argv[i]);
+    if(sock<0)
+        return 1;
+    cache_init((size_t)memory<<20);
+    next_stats=time(NULL)+stats_interval;
+    fprintf(stderr, "sessiond: listening on %s with %ld MB and %d thread(s)\n",
+        argv[i], memory, threads);
+
+#ifdef USE_PTHREAD
+    for(i=1; i<threads; ++i)
+        if(pthread_create(&thread, NULL, worker, NULL)) {
+            perror("pthread_create");
+            return 1;
+        }
+#endif /* USE_PTHREAD */
+    worker(NULL);
+    return 0; /* never reached */
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-m megabytes] [-t threads] "
+        "[-s stats_interval] [-v level] [host:]port\n", name);
+    fprintf(stderr, "  -m  memory limit for cached sessions (default 64)\n");
+    fprintf(stderr, "  -t  number of worker threads (default 1)\n");
+    fprintf(stderr, "  -s  seconds between statistics (default 0 = never)\n");
+    fprintf(stderr, "  -v  1 to log every request (default 0)\n");
+    exit(1);
+}
+
+static int bind_socket(const char *address) {
+    struct addrinfo hints, *res;
+    char *host, *port;
+    int s, err, opt;
+
+    host=strdup(address);
+    if(!host) {
+        fprintf(stderr, "Out of memory\n");
+        return -1;
+    }
+    port=strrchr(host, ':');
+    if(port) {
+        *port++='\0';
+    } else { /* only the port was specified */
+        port=host;
+        host=NULL;
+    }
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family=AF_UNSPEC;
+    hints.ai_socktype=SOCK_DGRAM;
+    hints.ai_flags=AI_PASSIVE;
+    err=getaddrinfo(host, port, &hints, &res);
+    if(err) {
+        fprintf(stderr, "getaddrinfo: %s: %s\n", address, gai_strerror(err));
+        return -1;
+    }
+    s=socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(s<0) {
+        perror("socket");
+        freeaddrinfo(res);
+        return -1;
+    }
+    opt=1<<22; /* absorb bursts of requests */
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, (void *)&opt, sizeof opt);
+    if(bind(s, res->ai_addr, res->ai_addrlen)) {
+        perror("bind");
+        close(s);
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    return s;
+}
+
+/**************************************** sharded hash table */
+
+static void cache_init(size_t memory) {
+    int i, fd;
+
+    fd=open("/dev/urandom", O_RDONLY);
+    if(fd<0 || read(fd, &hash_seed, sizeof hash_seed)!=sizeof hash_seed)
+        hash_seed=(unsigned int)time(NULL)^(unsigned int)getpid();
+    if(fd>=0)
+        close(fd);
+    for(i=0; i<SHARDS; ++i) {
+#ifdef USE_PTHREAD
+        pthread_mutex_init(&shard[i].lock, NULL);
+#endif /* USE_PTHREAD */
+        shard[i].slot=calloc(INITIAL_SLOTS, sizeof(ENTRY *));
+        if(!shard[i].slot) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        shard[i].mask=INITIAL_SLOTS-1;
+        shard[i].limit=memory/SHARDS;
+    }
+}
+
+static unsigned int cache_hash(const u_char *key) { /* seeded FNV-1a */
+    unsigned int i, h=2166136261U^hash_seed;
+
+    for(i=0; i<CACHE_KEY_LEN; ++i) {
+        h^=key[i];
+        h*=16777619U;
+    }
+    return h;
+}
+
+#define SHARD_OF(h) (&shard[(h)>>26]) /* the top 6 bits of the hash */
+
+static int slot_find(SHARD *sh, unsigned int hash, const u_char *key) {
+    unsigned int i;
+    ENTRY *e;
+
+    for(i=hash&sh->mask; (e=sh->slot[i]); i=(i+1)&sh->mask)
+        if(e!=DELETED && e->hash==hash && !memcmp(e->key, key, CACHE_KEY_LEN))
+            return i;
+    return -1;
+}
+
+static void slot_resize(SHARD *sh, unsigned int size) {
+    ENTRY **old=sh->slot;
+    unsigned int i, j, old_size=sh->mask+1;
+
+    sh->slot=calloc(size, sizeof(ENTRY *));
+    if(!sh->slot) { /* keep the old table */
+        sh->slot=old;
+        return;
+    }
+    sh->mask=size-1;
+    sh->deleted=0;
+    for(i=0; i<old_size; ++i) {
+        if(!old[i] || old[i]==DELETED)
+            continue;
+        for(j=old[i]->hash&sh->mask; sh->slot[j]; j=(j+1)&sh->mask)
+            ;
+        sh->slot[j]=old[i];
+    }
+    free(old);
+}
+
+static void entry_delete(SHARD *sh, int i) {
+    ENTRY *e=sh->slot[i];
+
+    /* a deleted marker is only needed within a probe sequence */
+    if(sh->slot[(i+1)&sh->mask])
+        sh->slot[i]=DELETED, ++sh->deleted;
+    else
+        sh->slot[i]=NULL;
+    --sh->used;
+    if(e->prev)
+        e->prev->next=e->next;
+    else
+        sh->head=e->next;
+    if(e->next)
+        e->next->prev=e->prev;
+    else
+        sh->tail=e->prev;
+    sh->memory-=sizeof(ENTRY)+e->val_len+sizeof(ENTRY *);
+    free(e);
+}
+
+static void cache_new(const u_char *key, const u_char *val,
+        unsigned int val_len, time_t timeout) {
+    unsigned int hash=cache_hash(key), i;
+    size_t size=sizeof(ENTRY)+val_len+sizeof(ENTRY *);
+    SHARD *sh=SHARD_OF(hash);
+    ENTRY *e;
+    int found;
+
+    if(size>sh->limit) /* would never fit */
+        return;
+    e=malloc(sizeof(ENTRY)+val_len);
+    if(!e)
+        return;
+    e->expire=time(NULL)+timeout;
+    e->hash=hash;
+    e->val_len=val_len;
+    memcpy(e->key, key, CACHE_KEY_LEN);
+    memcpy(e->val, val, val_len);
+
+    shard_lock(sh);
+    found=slot_find(sh, hash, key);
+    if(found>=0) /* replace the previous value */
+        entry_delete(sh, found);
+    while(sh->memory+size>sh->limit) { /* evict the least recently used */
+        found=slot_find(sh, sh->tail->hash, sh->tail->key);
+        if(sh->tail->expire<=time(NULL))
+            ++sh->expired;
+        else
+            ++sh->evicted;
+        entry_delete(sh, found);
+    }
+    if((sh->used+sh->deleted+1)*4>(sh->mask+1)*3) /* over 75% full */
+        slot_resize(sh, (sh->used+1)*2>sh->mask+1 ? 2*(sh->mask+1) : sh->mask+1);
+    for(i=hash&sh->mask; sh->slot[i] && sh->slot[i]!=DELETED;
+            i=(i+1)&sh->mask)
+        ;
+    if(sh->slot[i]==DELETED)
+        --sh->deleted;
+    sh->slot[i]=e;
+    ++sh->used;
+    e->prev=NULL;
+    e->next=sh->head;
+    if(sh->head)
+        sh->head->prev=e;
+    else
+        sh->tail=e;
+    sh->head=e;
+    sh->memory+=size;
+    ++sh->added;
+    shard_unlock(sh);
+}
+
+static int cache_get(const u_char *key, u_char *val) {
+    unsigned int hash=cache_hash(key);
+    SHARD *sh=SHARD_OF(hash);
+    ENTRY *e;
+    int i, val_len=-1;
+
+    shard_lock(sh);
+    i=slot_find(sh, hash, key);
+    if(i<0) {
+        ++sh->misses;
+    } else if(sh->slot[i]->expire<=time(NULL)) {
+        ++sh->misses;
+        ++sh->expired;
+        entry_delete(sh, i);
+    } else {
+        ++sh->hits;
+        e=sh->slot[i];
+        if(e->prev) { /* move to the head of the LRU list */
+            e->prev->next=e->next;
+            if(e->next)
+                e->next->prev=e->prev;
+            else
+                sh->tail=e->prev;
+            e->prev=NULL;
+            e->next=sh->head;
+            sh->head->prev=e;
+            sh->head=e;
+        }
+        val_len=e->val_len;
+        memcpy(val, e->val, val_len);
+    }
+    shard_unlock(sh);
+    return val_len;
+}
+
+static void cache_remove(const u_char *key) {
+    unsigned int hash=cache_hash(key);
+    SHARD *sh=SHARD_OF(hash);
+    int i;
+
+    shard_lock(sh);
+    i=slot_find(sh, hash, key);
+    if(i>=0) {
+        entry_delete(sh, i);
+        ++sh->removed;
+    }
+    shard_unlock(sh);
+}
+
+#ifdef USE_PTHREAD
+
+static void shard_lock(SHARD *sh) {
+    pthread_mutex_lock(&sh->lock);
+}
+
+static void shard_unlock(SHARD *sh) {
+    pthread_mutex_unlock(&sh->lock);
+}
+
+#else /* USE_PTHREAD */
+
+static void shard_lock(SHARD *sh) {
+    (void)sh; /* skip warning about unused parameter */
+}
+
+static void shard_unlock(SHARD *sh) {
+    (void)sh; /* skip warning about unused parameter */
+}
+
+#endif /* USE_PTHREAD */
+
+static void print_stats(void) {
+    int i;
+    unsigned long entries=0, memory=0, added=0, hits=0, misses=0,
+        expired=0, evicted=0, removed=0;
+
+    for(i=0; i<SHARDS; ++i) {
+        shard_lock(&shard[i]);
+        entries+=shard[i].used;
+        memory+=shard[i].memory;
+        added+=shard[i].added;
+        hits+=shard[i].hits;
+        misses+=shard[i].misses;
+        expired+=shard[i].expired;
+        evicted+=shard[i].evicted;
+        removed+=shard[i].removed;
+        shard_unlock(&shard[i]);
+    }
+    fprintf(stderr, "sessiond: %lu entries, %lu KB, %lu added, %lu hits, "
+        "%lu misses, %lu expired, %lu evicted, %lu removed\n",
+        entries, memory>>10, added, hits, misses, expired, evicted, removed);
+}
+
+/**************************************** request processing */
+
+/* process a request in place and return the length of the response */
+static int process(u_char *buf, int len) {
+    CACHE_PACKET *packet=(CACHE_PACKET *)buf;
+    int val_len;
+
+    if(len<(int)CACHE_HEADER_LEN || packet->version!=1) {
+        if(verbose)
+            fprintf(stderr, "sessiond: malformed packet (%d bytes)\n", len);
+        return 0;
+    }
+    if(verbose)
+        fprintf(stderr, "sessiond: request type=%d, length=%d\n",
+            packet->type, len-(int)CACHE_HEADER_LEN);
+    switch(packet->type) {
+    case CACHE_CMD_NEW:
+        cache_new(packet->key, packet->val, len-CACHE_HEADER_LEN,
+            ntohs(packet->timeout));
+        return 0; /* no response */
+    case CACHE_CMD_GET:
+        val_len=cache_get(packet->key, packet->val);
+        if(val_len<0) {
+            packet->type=CACHE_RESP_ERR;
+            return CACHE_HEADER_LEN;
+        }
+        packet->type=CACHE_RESP_OK;
+        return CACHE_HEADER_LEN+val_len;
+    case CACHE_CMD_REMOVE:
+        cache_remove(packet->key);
+        return 0; /* no response */
+    default:
+        return 0; /* ignore unknown requests */
+    }
+}
+
+#if defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+
+static void *worker(void *arg) {
+    struct mmsghdr in[BATCH], out[BATCH];
+    struct iovec in_iov[BATCH], out_iov[BATCH];
+    struct sockaddr_storage addr[BATCH];
+    u_char buf[BATCH][sizeof(CACHE_PACKET)];
+    int i, n, num, sent, len;
+
+    (void)arg; /* skip warning about unused parameter */
+    for(;;) {
+        for(i=0; i<BATCH; ++i) {
+            in_iov[i].iov_base=buf[i];
+            in_iov[i].iov_len=sizeof(CACHE_PACKET);
+            memset(&in[i].msg_hdr, 0, sizeof(struct msghdr));
+            in[i].msg_hdr.msg_name=&addr[i];
+            in[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_storage);
+            in[i].msg_hdr.msg_iov=&in_iov[i];
+            in[i].msg_hdr.msg_iovlen=1;
+        }
+        /* block for the first datagram, then take whatever is queued */
+        n=recvmmsg(sock, in, BATCH, MSG_WAITFORONE, NULL);
+        if(n<0) {
+            if(errno!=EINTR)
+                perror("recvmmsg");
+            continue;
+        }
+        num=0;
+        for(i=0; i<n; ++i) {
+            len=process(buf[i], in[i].msg_len);
+            if(!len)
+                continue;
+            out_iov[num].iov_base=buf[i];
+            out_iov[num].iov_len=len;
+            memset(&out[num].msg_hdr, 0, sizeof(struct msghdr));
+            out[num].msg_hdr.msg_name=&addr[i];
+            out[num].msg_hdr.msg_namelen=in[i].msg_hdr.msg_namelen;
+            out[num].msg_hdr.msg_iov=&out_iov[num];
+            out[num].msg_hdr.msg_iovlen=1;
+            ++num;
+        }
+        for(sent=0; sent<num; ) {
+            n=sendmmsg(sock, out+sent, num-sent, 0);
+            if(n<0) {
+                if(errno==EINTR)
+                    continue;
+                perror("sendmmsg");
+                break;
+            }
+            sent+=n;
+        }
+        if(stats_interval && time(NULL)>=next_stats) {
+            next_stats=time(NULL)+stats_interval;
+            print_stats();
+        }
+    }
+    return NULL; /* never reached */
+}
+
+#else /* HAVE_RECVMMSG && HAVE_SENDMMSG */
+
+static void *worker(void *arg) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    u_char buf[sizeof(CACHE_PACKET)];
+    int len;
+
+    (void)arg; /* skip warning about unused parameter */
+    for(;;) {
+        addr_len=sizeof addr;
+        len=recvfrom(sock, (void *)buf, sizeof buf, 0,
+            (struct sockaddr *)&addr, &addr_len);
+        if(len<0) {
+            if(errno!=EINTR)
+                perror("recvfrom");
+            continue;
+        }
+        len=process(buf, len);
+        if(len && sendto(sock, (void *)buf, len, 0,
+                (struct sockaddr *)&addr, addr_len)<0)
+            perror("sendto");
+        if(stats_interval && time(NULL)>=next_stats) {
+            next_stats=time(NULL)+stats_interval;
+            print_stats();
+        }
+    }
+    return NULL; /* never reached */
+}
+
+#endif /* HAVE_RECVMMSG && HAVE_SENDMMSG */
+
+/* end of sessiond.c */
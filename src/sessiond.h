@@ -0,0 +1,63 @@
+/*
+ *   stunnel       Universal SSL tunnel
+ *   Copyright (C) 1998-2011 Michal Trojnara <Michal.Trojnara@mirt.net>
+ *
+ *   This program is free software; you can redistribute it and/or modify it
+ *   under the terms of the GNU General Public License as published by the
+ *   Free Software Foundation; either version 2 of the License, or (at your
+ *   option) any later version.
+ * 
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *   See the GNU General Public License for more details.
+ * 
+ *   You should have received a copy of the GNU General Public License along
+ *   with this program; if not, see <http://www.gnu.org/licenses>.
+ * 
+ *   Linking stunnel statically or dynamically with other modules is making
+ *   a combined work based on stunnel. Thus, the terms and conditions of
+ *   the GNU General Public License cover the whole combination.
+ * 
+ *   In addition, as a special exception, the copyright holder of stunnel
+ *   gives you permission to combine stunnel with free software programs or
+ *   libraries that are released under the GNU LGPL and with code included
+ *   in the standard release of OpenSSL under the OpenSSL License (or
+ *   modified versions of such code, with unchanged license). You may copy
+ *   and distribute such a system following the terms of the GNU GPL for
+ *   stunnel and the licenses of the other code concerned.
+ * 
+ *   Note that people who make modified versions of stunnel are not obligated
+ *   to grant this special exception for their modified versions; it is their
+ *   choice whether to do so. The GNU General Public License gives permission
+ *   to release a modified version without this exception; this exception
+ *   also makes it possible to release a modified version which carries
+ *   forward this exception.
+ */
+
+#ifndef SESSIOND_H
+#define SESSIOND_H
+
+/**************************************** sessiond UDP protocol */
+
+#define CACHE_CMD_NEW     0x00
+#define CACHE_CMD_GET     0x01
+#define CACHE_CMD_REMOVE  0x02
+#define CACHE_RESP_ERR    0x80
+#define CACHE_RESP_OK     0x81
+
+#define CACHE_KEY_LEN 32 /* SSL_MAX_SSL_SESSION_ID_LENGTH */
+#define MAX_VAL_LEN 512
+
+typedef struct {
+    u_char version, type;
+    u_short timeout; /* in seconds, network byte order */
+    u_char key[CACHE_KEY_LEN];
+    u_char val[MAX_VAL_LEN];
+} CACHE_PACKET;
+
+#define CACHE_HEADER_LEN (sizeof(CACHE_PACKET)-MAX_VAL_LEN)
+
+#endif /* defined SESSIOND_H */
+
+/* end of sessiond.h */
@@ -218,9 +218,27 @@ int create_client(int ls, int s, CLI *arg, void *(*cli)(void *)) {
 
 #endif /* USE_FORK */
 
+#if defined(USE_PTHREAD) || defined(USE_WIN32)
+
+/* per-thread handshake slot state */
+#define HANDSHAKE_HELD ((void *)1)
+#define HANDSHAKE_PAUSED ((void *)2)
+
+static void handshake_log(int retval, int waiting) {
+    if(!retval)
+        s_log(LOG_WARNING, waiting ? "Handshake queue timeout exceeded" :
+            "Handshake queue full: %d connection(s) waiting",
+            global_options.handshake_queue);
+    else if(waiting)
+        s_log(LOG_DEBUG, "Handshake started after waiting in the queue");
+}
+
+#endif /* USE_PTHREAD || USE_WIN32 */
+
 #ifdef USE_PTHREAD
 
 static pthread_mutex_t stunnel_cs[CRIT_SECTIONS];
+static pthread_key_t handshake_key;
 static pthread_mutex_t lock_cs[CRYPTO_NUM_LOCKS];
 
 void enter_critical_section(SECTION_CODE i) {
@@ -306,6 +324,9 @@ void sthreads_init(void) {
     CRYPTO_set_dynlock_create_callback(dyn_create_function);
     CRYPTO_set_dynlock_lock_callback(dyn_lock_function);
     CRYPTO_set_dynlock_destroy_callback(dyn_destroy_function);
+
+    /* initialize the per-thread handshake slot state */
+    pthread_key_create(&handshake_key, NULL);
 }
 
 int create_client(int ls, int s, CLI *arg, void *(*cli)(void *)) {
@@ -348,12 +369,79 @@ int create_client(int ls, int s, CLI *arg, void *(*cli)(void *)) {
     return 0;
 }
 
+    /* a bounded number of CPU-bound handshakes keeps the latency of the
+     * established connections low, other connections wait in a queue */
+static pthread_cond_t handshake_cond=PTHREAD_COND_INITIALIZER;
+static int handshake_active=0, handshake_waiting=0;
+
+static void *handshake_state_get(void) {
+    return pthread_getspecific(handshake_key);
+}
+
+static void handshake_state_set(void *state) {
+    pthread_setspecific(handshake_key, state);
+}
+
+    /* a negative timeout waits without the queue limit and timeout */
+int handshake_enter(int timeout) {
+    struct timespec ts;
+    int retval=1, waiting=0;
+
+    /* also counted without a limit, as handshakeWorkers may be reloaded */
+    pthread_mutex_lock(stunnel_cs+CRIT_HANDSHAKE);
+    if(global_options.handshake_workers &&
+            handshake_active>=global_options.handshake_workers) {
+        if(timeout>=0 && global_options.handshake_queue &&
+                handshake_waiting>=global_options.handshake_queue) {
+            retval=0; /* the queue is full */
+        } else {
+            waiting=++handshake_waiting;
+            ts.tv_sec=time(NULL)+timeout;
+            ts.tv_nsec=0;
+            while(global_options.handshake_workers &&
+                    handshake_active>=global_options.handshake_workers)
+                if(timeout<0)
+                    pthread_cond_wait(&handshake_cond,
+                        stunnel_cs+CRIT_HANDSHAKE);
+                else if(pthread_cond_timedwait(&handshake_cond,
+                        stunnel_cs+CRIT_HANDSHAKE, &ts)==ETIMEDOUT) {
+                    retval=0;
+                    break;
+                }
+            --handshake_waiting;
+        }
+    }
+    if(retval)
+        ++handshake_active;
+    pthread_mutex_unlock(stunnel_cs+CRIT_HANDSHAKE);
+    if(retval)
+        handshake_state_set(HANDSHAKE_HELD);
+    handshake_log(retval, waiting);
+    return retval;
+}
+
+void handshake_leave(void) {
+    void *state=handshake_state_get();
+
+    handshake_state_set(NULL);
+    if(state!=HANDSHAKE_HELD) /* already released by handshake_pause() */
+        return;
+    pthread_mutex_lock(stunnel_cs+CRIT_HANDSHAKE);
+    --handshake_active;
+    if(handshake_waiting)
+        pthread_cond_signal(&handshake_cond);
+    pthread_mutex_unlock(stunnel_cs+CRIT_HANDSHAKE);
+}
+
 #endif /* USE_PTHREAD */
 
 #ifdef USE_WIN32
 
 static CRITICAL_SECTION stunnel_cs[CRIT_SECTIONS];
 static CRITICAL_SECTION lock_cs[CRYPTO_NUM_LOCKS];
+static HANDLE handshake_sem; /* released for the waiting connections */
+static DWORD handshake_tls;
+static int handshake_active=0, handshake_waiting=0;
 
 void enter_critical_section(SECTION_CODE i) {
     EnterCriticalSection(stunnel_cs+i);
@@ -427,6 +515,16 @@ void sthreads_init(void) {
     /* initialize stunnel critical sections */
     for(i=0; i<CRIT_SECTIONS; i++)
         InitializeCriticalSection(stunnel_cs+i);
+    handshake_sem=CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    if(!handshake_sem) {
+        ioerror("CreateSemaphore");
+        die(1);
+    }
+    handshake_tls=TlsAlloc();
+    if(handshake_tls==TLS_OUT_OF_INDEXES) {
+        ioerror("TlsAlloc");
+        die(1);
+    }
 
     /* initialize OpenSSL locking callback */
     for(i=0; i<CRYPTO_NUM_LOCKS; i++)
@@ -454,8 +552,87 @@ int create_client(int ls, int s, CLI *arg, void *(*cli)(void *)) {
     return 0;
 }
 
+static void *handshake_state_get(void) {
+    return TlsGetValue(handshake_tls);
+}
+
+static void handshake_state_set(void *state) {
+    TlsSetValue(handshake_tls, state);
+}
+
+    /* a negative timeout waits without the queue limit and timeout */
+int handshake_enter(int timeout) {
+    DWORD finish, now;
+    int retval=1, waiting=0;
+
+    finish=GetTickCount()+1000*timeout;
+    EnterCriticalSection(stunnel_cs+CRIT_HANDSHAKE);
+    if(global_options.handshake_workers &&
+            handshake_active>=global_options.handshake_workers) {
+        if(timeout>=0 && global_options.handshake_queue &&
+                handshake_waiting>=global_options.handshake_queue) {
+            retval=0; /* the queue is full */
+        } else {
+            waiting=++handshake_waiting;
+            while(global_options.handshake_workers &&
+                    handshake_active>=global_options.handshake_workers) {
+                LeaveCriticalSection(stunnel_cs+CRIT_HANDSHAKE);
+                now=GetTickCount();
+                if(timeout<0)
+                    WaitForSingleObject(handshake_sem, INFINITE);
+                else if((long)(finish-now)<=0 || WaitForSingleObject(
+                        handshake_sem, finish-now)!=WAIT_OBJECT_0)
+                    retval=0;
+                EnterCriticalSection(stunnel_cs+CRIT_HANDSHAKE);
+                if(!retval)
+                    break;
+            }
+            --handshake_waiting;
+        }
+    }
+    if(retval)
+        ++handshake_active;
+    LeaveCriticalSection(stunnel_cs+CRIT_HANDSHAKE);
+    if(retval)
+        handshake_state_set(HANDSHAKE_HELD);
+    handshake_log(retval, waiting);
+    return retval;
+}
+
+void handshake_leave(void) {
+    void *state=handshake_state_get();
+
+    handshake_state_set(NULL);
+    if(state!=HANDSHAKE_HELD) /* already released by handshake_pause() */
+        return;
+    EnterCriticalSection(stunnel_cs+CRIT_HANDSHAKE);
+    --handshake_active;
+    if(handshake_waiting)
+        ReleaseSemaphore(handshake_sem, 1, NULL);
+    LeaveCriticalSection(stunnel_cs+CRIT_HANDSHAKE);
+}
+
 #endif /* USE_WIN32 */
 
+#if defined(USE_PTHREAD) || defined(USE_WIN32)
+
+    /* the slot is released while a handshake callback waits for a server,
+     * e.g. an OCSP responder, so that it does not block other handshakes */
+void handshake_pause(void) {
+    if(handshake_state_get()!=HANDSHAKE_HELD)
+        return; /* not called from a handshake, e.g. the cron thread */
+    handshake_leave();
+    handshake_state_set(HANDSHAKE_PAUSED);
+}
+
+void handshake_resume(void) {
+    if(handshake_state_get()!=HANDSHAKE_PAUSED)
+        return;
+    handshake_enter(-1); /* the connection was already admitted */
+}
+
+#endif /* USE_PTHREAD || USE_WIN32 */
+
 #ifdef USE_OS2
 
 void enter_critical_section(SECTION_CODE i) {
@@ -498,6 +675,24 @@ int create_client(int ls, int s, CLI *arg, void *(*cli)(void *)) {
 
 #endif /* USE_OS2 */
 
+#if defined(USE_UCONTEXT) || defined(USE_FORK) || defined(USE_OS2)
+
+int handshake_enter(int timeout) {
+    (void)timeout; /* skip warning about unused parameter */
+    return 1; /* handshakeWorkers is not supported */
+}
+
+void handshake_leave(void) {
+}
+
+void handshake_pause(void) {
+}
+
+void handshake_resume(void) {
+}
+
+#endif /* USE_UCONTEXT || USE_FORK || USE_OS2 */
+
 #ifdef _WIN32_WCE
 
 long _beginthread(void (*start_address)(void *),
@@ -57,6 +57,9 @@ static int max_fds;
 static int max_clients=0;
 
 int volatile num_clients=0; /* current number of clients */
+#ifdef HAVE_CHROOT
+int root_changed=0; /* paths are relative to chroot_dir afterwards */
+#endif
 s_poll_set fds; /* file descriptors of listening sockets */
 #if !defined(USE_WIN32) && !defined(USE_OS2)
 int signal_fd;
@@ -131,6 +134,10 @@ void main_initialize(char *arg1, char *arg2) {
 void main_execute(void) {
     if(service_options.next) { /* there are service sections -> daemon mode */
         num_clients=0;
+        /* cron_init() and log_writer_init() must be called after
+         * daemonize() since fork() only duplicates the calling thread */
+        if(!cron_init() || !log_writer_init())
+            die(1);
         while(1)
             daemon_loop();
     } else { /* inetd mode */
@@ -237,6 +244,16 @@ int bind_ports(void) {
                 return 0;
             if(set_socket_options(opt->fd, 0)<0)
                 return 0;
+#ifdef TCP_FASTOPEN
+            if(opt->option.fastopen) {
+                int qlen=SOMAXCONN; /* pending TFO requests */
+
+                if(setsockopt(opt->fd, IPPROTO_TCP, TCP_FASTOPEN,
+                        (void *)&qlen, sizeof qlen))
+                    sockerror("setsockopt TCP_FASTOPEN");
+                /* ignore the error: the kernel may have TFO disabled */
+            }
+#endif /* TCP_FASTOPEN */
             s_ntop(opt->local_address, &addr);
             if(bind(opt->fd, &addr.sa, addr_len(addr))) {
                 s_log(LOG_ERR, "Error binding %s to %s",
@@ -310,10 +327,22 @@ static void change_root(void) {
             sockerror("chdir");
             die(1);
         }
+        root_changed=1;
     }
 }
 #endif /* HAVE_CHROOT */
 
+    /* a file accessed both before and after chroot is always
+     * relative to the chroot directory */
+char *chroot_path(char *path) { /* allocated with str_alloc() */
+#ifdef HAVE_CHROOT
+    if(global_options.chroot_dir && !root_changed) /* startup */
+        return str_printf("%s%s%s", global_options.chroot_dir,
+            path[0]=='/' ? "" : "/", path);
+#endif
+    return str_dup(path);
+}
+
 #if !defined(USE_WIN32) && !defined(__vms) && !defined(USE_OS2)
 
 void drop_privileges(void) {
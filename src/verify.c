@@ -37,25 +37,203 @@
 
 #include "common.h"
 #include "prototypes.h"
+#include "crlindex.h"
+
+/**************************************** CRL cache */
+
+#define CRL_CACHE_MAX 16 /* indexed CRLs in each service */
+
+struct crl_cache_struct {
+    CRL_CACHE *next;
+    X509_CRL *crl;             /* referenced, so the pointer is not reused */
+    CRL_INDEX *index;
+};
+
+/* a store without a cache (e.g. the hash_dir lookup of CRLpath) returns
+ * a new copy of the same CRL for each lookup, so entries are also matched
+ * by the issuer name and lastUpdate */
+#define CRL_CACHE_MATCH(entry, x) ((entry)->crl==(x) || \
+    (!X509_NAME_cmp(X509_CRL_get_issuer((entry)->crl), \
+        X509_CRL_get_issuer(x)) && \
+    !ASN1_STRING_cmp(X509_CRL_get_lastUpdate((entry)->crl), \
+        X509_CRL_get_lastUpdate(x))))
+
+/**************************************** CRLpath store */
+
+#ifdef USE_CRL_STORE
+
+#define CRL_STORE_INTERVAL 5 /* seconds between CRLpath checks */
+
+struct crl_store_struct {
+    X509_STORE *store;                   /* CRLs only, without any lookups */
+    int refs;                                  /* protected by CRIT_CRL */
+    unsigned long fingerprint;    /* names, sizes and mtimes of the files */
+};
+
+#endif /* USE_CRL_STORE */
+
+/**************************************** verify cache */
+
+#define VERIFY_CACHE_SIZE 1024 /* direct-mapped slots in each service */
+#define VERIFY_KEY_LEN 32 /* SHA-256 fingerprint */
+
+typedef struct {
+    unsigned char key[VERIFY_KEY_LEN];
+    int depth;
+    unsigned long generation;     /* verify_generation of the verdict */
+    time_t expires;                               /* 0 for an empty slot */
+} VERIFY_CACHE_ENTRY;
+
+struct verify_cache_struct {
+    VERIFY_CACHE_ENTRY slot[VERIFY_CACHE_SIZE];
+};
+
+/**************************************** fingerprint pinning */
+
+#define PIN_LEN 32 /* SHA-256 fingerprint */
+#define PIN_SET_MIN 16 /* initial number of slots */
+#define PIN_LINE_MAX 256
+
+typedef struct {
+    unsigned char fingerprint[PIN_LEN];
+    int used;
+} PIN_ENTRY;
+
+struct pin_set_struct {
+    PIN_ENTRY *slot;          /* open addressing with linear probing */
+    unsigned long size;                             /* a power of two */
+    unsigned long num;                /* kept below half of the size */
+};
+
+/**************************************** OCSP cache */
+
+#define OCSP_CACHE_SIZE 1024 /* direct-mapped slots in each service */
+#define OCSP_KEY_MAX 128 /* DER-encoded CertID */
+#define OCSP_MARGIN 60 /* seconds before nextUpdate to refresh a response */
+#define OCSP_MAX_AGE 3600 /* for responses without nextUpdate */
+#define OCSP_NEGATIVE_TTL 30 /* seconds to remember a failed request */
+#define OCSP_FAILED -1 /* status of a failed request */
+#define OCSP_NOT_CACHED -2 /* returned by ocsp_cache_get() */
+#define OCSP_RESPONDERS 16 /* resolved AIA responders in each service */
+#define OCSP_RESOLVE_TTL 600 /* seconds to use a resolved responder */
+#define OCSP_RESOLVE_REFRESH 300 /* seconds before cron resolves it again */
+
+typedef struct {
+    unsigned char key[OCSP_KEY_MAX];
+    int key_len;                                   /* 0 for an empty slot */
+    int status;                    /* V_OCSP_CERTSTATUS_* or OCSP_FAILED */
+    time_t expires;
+    ASN1_GENERALIZEDTIME *next_update;           /* NULL if not specified */
+} OCSP_CACHE_ENTRY;
+
+typedef struct {
+    char host[256], port[16];              /* empty host for an empty slot */
+    SOCKADDR_UNION addr;
+    time_t refresh, expires;
+} OCSP_RESOLVED_ENTRY;
+
+struct ocsp_cache_struct {
+    OCSP_CACHE_ENTRY slot[OCSP_CACHE_SIZE];
+    OCSP_RESOLVED_ENTRY resolved[OCSP_RESPONDERS];
+};
+
+typedef struct {
+    SOCKADDR_UNION addr;
+    char *host, *path;                      /* allocated with str_alloc() */
+} OCSP_RESPONDER;
+
+/**************************************** OCSP stapling */
+
+#ifndef OPENSSL_NO_TLSEXT
+
+#define OCSP_STAPLE_MARGIN 300 /* seconds before nextUpdate to refresh */
+#define OCSP_STAPLE_RETRY 60 /* seconds between failed requests */
+
+struct ocsp_staple_struct {
+    X509 *cert, *issuer;
+    OCSP_CERTID *certID;
+    unsigned char *der;      /* DER-encoded response protected by CRIT_OCSP */
+    int der_len;                                    /* 0 if not available */
+    ASN1_GENERALIZEDTIME *next_update; /* NULL if not specified, CRIT_OCSP */
+    time_t refresh_time, retry_time;
+};
+
+#endif /* OPENSSL_NO_TLSEXT */
 
 /**************************************** prototypes */
 
 /* verify initialization */
 static int load_file_lookup(X509_STORE *, char *);
 static int add_dir_lookup(X509_STORE *, char *);
+#ifdef USE_CRL_STORE
+static CRL_STORE *crl_store_new(char *, unsigned long);
+static void crl_store_release(CRL_STORE *);
+static unsigned long crl_dir_fingerprint(char *);
+#endif
+#ifndef USE_WIN32
+static int load_dir_certs(SERVICE_OPTIONS *);
+static void load_dir_file(SERVICE_OPTIONS *, char *, int *, int *,
+    unsigned long *);
+#endif
+
+/* fingerprint pinning */
+static PIN_SET *pin_set_read(char *);
+static int pin_set_add(PIN_SET *, const unsigned char *);
+static int pin_set_find(const PIN_SET *, const unsigned char *);
+static void pin_set_free(PIN_SET *);
+static int pin_parse(char *, unsigned char *);
 
 /* verify callback */
 static int verify_callback(int, X509_STORE_CTX *);
+static int verify_cache_key(X509_STORE_CTX *, unsigned char *);
+static VERIFY_CACHE_ENTRY *verify_cache_slot(SERVICE_OPTIONS *,
+    const unsigned char *, int);
+static int verify_cache_get(CLI *c, const unsigned char *, int);
+static void verify_cache_put(CLI *c, const unsigned char *, int);
+static void verify_cache_until(CLI *c, time_t);
+static void verify_cache_until_asn1(CLI *c, ASN1_TIME *);
+static void verify_cache_flush(SERVICE_OPTIONS *);
 static int cert_check(CLI *c, X509_STORE_CTX *, int);
+static int pin_check(CLI *c, X509 *);
 static int crl_check(CLI *c, X509_STORE_CTX *);
+static int crl_lookup(CLI *c, X509_NAME *, X509_OBJECT *);
+static int crl_revoked(SERVICE_OPTIONS *, X509_CRL *, ASN1_INTEGER *);
+static CRL_CACHE *crl_cache_new(X509_CRL *);
 static int ocsp_check(CLI *c, X509_STORE_CTX *);
+static int ocsp_responder(CLI *c, X509 *, int, OCSP_RESPONDER *);
+static int ocsp_resolve(SERVICE_OPTIONS *, char *, char *, SOCKADDR_UNION *);
+static OCSP_RESOLVED_ENTRY *ocsp_resolved_slot(SERVICE_OPTIONS *,
+    char *, char *);
+static char *ocsp_aia_url(X509 *);
+static int ocsp_request(CLI *c, OCSP_CERTID *, OCSP_RESPONDER *, X509 *,
+    ASN1_GENERALIZEDTIME **, OCSP_RESPONSE **);
+#ifndef X509_V_FLAG_PARTIAL_CHAIN
+static int ocsp_issuer_cb(int, X509_STORE_CTX *);
+#endif
+static OCSP_CACHE_ENTRY *ocsp_cache_slot(SERVICE_OPTIONS *,
+    const unsigned char *, int);
+static int ocsp_cache_get(CLI *c, const unsigned char *, int);
+static void ocsp_cache_put(CLI *c, const unsigned char *, int,
+    int, ASN1_GENERALIZEDTIME *);
+#ifndef OPENSSL_NO_TLSEXT
+static X509 *ocsp_staple_issuer(SERVICE_OPTIONS *, X509 *, BIO *);
+static int ocsp_staple_cb(SSL *, void *);
+static int ocsp_staple_fetch(SERVICE_OPTIONS *, time_t);
+#endif
 
 /* utility functions */
+#ifndef USE_WIN32
+static int hashed_name(const char *, int);
+#endif
 static void log_time(const int, const char *, ASN1_TIME *);
 
 /**************************************** verify initialization */
 
 int verify_init(SERVICE_OPTIONS *section) {
+#ifdef USE_CRL_STORE
+    char *crl_dir;
+#endif
+
     if(section->verify_level<0)
         return 1; /* no certificate verification */
 
@@ -71,6 +249,15 @@ int verify_init(SERVICE_OPTIONS *section) {
         return 0;
     }
 
+    if(section->pin_file) {
+        if(!section->verify_use_only_my) {
+            s_log(LOG_ERR, "verifyPins requires verify = 3");
+            return 0;
+        }
+        if(!pin_set_load(section))
+            return 0;
+    }
+
     if(section->ca_file) {
         if(!SSL_CTX_load_verify_locations(section->ctx,
                 section->ca_file, NULL)) {
@@ -88,6 +275,12 @@ int verify_init(SERVICE_OPTIONS *section) {
             return 0;
     }
 
+#ifndef USE_WIN32
+    if(section->ca_dir && section->option.ca_dir_preload) {
+        if(!load_dir_certs(section))
+            return 0;
+    } else
+#endif
     if(section->ca_dir) {
         if(!SSL_CTX_load_verify_locations(section->ctx,
                 NULL, section->ca_dir)) {
@@ -105,8 +298,46 @@ int verify_init(SERVICE_OPTIONS *section) {
             return 0;
 
     if(section->crl_dir) {
+#ifdef USE_CRL_STORE
+        /* loaded once, and reloaded by the cron thread when modified */
+#ifdef HAVE_CHROOT
+        if(global_options.chroot_dir && !root_changed) /* startup */
+            crl_dir=str_printf("%s%s%s", global_options.chroot_dir,
+                section->crl_dir[0]=='/' ? "" : "/", section->crl_dir);
+        else
+#endif
+            crl_dir=str_dup(section->crl_dir);
+        if(!crl_dir) {
+            s_log(LOG_ERR, "CRL: Memory allocation failed");
+            return 0;
+        }
+        section->crl_store=crl_store_new(crl_dir,
+            crl_dir_fingerprint(crl_dir));
+        str_free(crl_dir);
+        if(!section->crl_store)
+            return 0;
+#else
         section->revocation_store->cache=0; /* don't cache CRLs */
         add_dir_lookup(section->revocation_store, section->crl_dir);
+#endif
+    }
+
+    if(section->verify_cache_ttl) {
+        /* never released, as the contexts of reloaded sections */
+        section->verify_cache=calloc(1, sizeof(VERIFY_CACHE));
+        if(!section->verify_cache) {
+            s_log(LOG_ERR, "Verify cache allocation failed");
+            return 0;
+        }
+    }
+
+    if(section->option.ocsp || section->option.ocsp_aia) {
+        /* never released, as the contexts of reloaded sections */
+        section->ocsp_cache=calloc(1, sizeof(OCSP_CACHE));
+        if(!section->ocsp_cache) {
+            s_log(LOG_ERR, "OCSP cache allocation failed");
+            return 0;
+        }
     }
 
     SSL_CTX_set_verify(section->ctx, section->verify_level==SSL_VERIFY_NONE ?
@@ -151,6 +382,407 @@ static int add_dir_lookup(X509_STORE *store, char *name) {
     return 1; /* OK */
 }
 
+/**************************************** CApath preloading */
+
+#ifndef USE_WIN32
+
+    /* the hashed certificates and CRLs are added to both stores
+     * instead of the lookups reading them on each verification */
+static int load_dir_certs(SERVICE_OPTIONS *section) {
+    DIR *dir;
+    struct dirent *entry;
+    char *ca_dir, *name;
+    struct timeval start, end;
+    int files=0, certs=0, crls=0;
+    unsigned long bytes=0;
+
+    /* the same directory at startup and after chroot */
+#ifdef HAVE_CHROOT
+    if(global_options.chroot_dir && !root_changed) /* startup */
+        ca_dir=str_printf("%s%s%s", global_options.chroot_dir,
+            section->ca_dir[0]=='/' ? "" : "/", section->ca_dir);
+    else
+#endif
+        ca_dir=str_dup(section->ca_dir);
+    if(!ca_dir) {
+        s_log(LOG_ERR, "CApath: Memory allocation failed");
+        return 0;
+    }
+
+    gettimeofday(&start, NULL);
+    dir=opendir(ca_dir);
+    if(!dir) {
+        ioerror(ca_dir);
+        str_free(ca_dir);
+        return 0;
+    }
+    while((entry=readdir(dir))) {
+        if(!hashed_name(entry->d_name, 0) && !hashed_name(entry->d_name, 1))
+            continue;
+        name=str_printf("%s/%s", ca_dir, entry->d_name);
+        if(!name)
+            continue;
+        ++files;
+        load_dir_file(section, name, &certs, &crls, &bytes);
+        str_free(name);
+    }
+    closedir(dir);
+    ERR_clear_error(); /* ignore duplicates and unparsable files */
+    gettimeofday(&end, NULL);
+    s_log(LOG_INFO,
+        "Preloaded %d certificate(s) and %d CRL(s) from %d file(s) in %s",
+        certs, crls, files, ca_dir);
+    str_free(ca_dir);
+    s_log(LOG_INFO, "CApath parsed in %ld ms, %lu bytes DER-encoded",
+        (long)(end.tv_sec-start.tv_sec)*1000+
+        (long)(end.tv_usec-start.tv_usec)/1000, bytes);
+    return 1; /* OK */
+}
+
+static void load_dir_file(SERVICE_OPTIONS *section, char *name,
+        int *certs, int *crls, unsigned long *bytes) {
+    BIO *bio;
+    STACK_OF(X509_INFO) *info;
+    X509_INFO *item;
+    X509_STORE *ctx_store;
+    int i;
+
+    bio=BIO_new_file(name, "r");
+    if(!bio) {
+        s_log(LOG_WARNING, "Cannot open %s", name);
+        return;
+    }
+    info=PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if(!info) {
+        s_log(LOG_WARNING, "No certificates or CRLs found in %s", name);
+        return;
+    }
+    ctx_store=SSL_CTX_get_cert_store(section->ctx);
+    for(i=0; i<sk_X509_INFO_num(info); ++i) {
+        item=sk_X509_INFO_value(info, i);
+        if(item->x509 && X509_STORE_add_cert(ctx_store, item->x509)) {
+            /* the revocation store shares the same object */
+            X509_STORE_add_cert(section->revocation_store, item->x509);
+            *bytes+=i2d_X509(item->x509, NULL);
+            ++*certs;
+        }
+        if(item->crl &&
+                X509_STORE_add_crl(section->revocation_store, item->crl)) {
+            *bytes+=i2d_X509_CRL(item->crl, NULL);
+            ++*crls;
+        }
+    }
+    sk_X509_INFO_pop_free(info, X509_INFO_free);
+}
+
+#endif /* USE_WIN32 */
+
+/**************************************** CRLpath store */
+
+#ifdef USE_CRL_STORE
+
+void crl_store_refresh(SERVICE_OPTIONS *opt, time_t now) {
+    CRL_STORE *crl_store, *old_store;
+    unsigned long fingerprint;
+
+    if(now<opt->crl_dir_time)
+        return;
+    opt->crl_dir_time=now+CRL_STORE_INTERVAL;
+    fingerprint=crl_dir_fingerprint(opt->crl_dir);
+    if(fingerprint==opt->crl_store->fingerprint) /* only cron updates it */
+        return; /* not modified */
+    crl_store=crl_store_new(opt->crl_dir, fingerprint);
+    if(!crl_store) {
+        s_log(LOG_WARNING, "Service %s: keeping the old CRLs from %s",
+            opt->servname, opt->crl_dir);
+        return;
+    }
+    enter_critical_section(CRIT_CRL);
+    old_store=opt->crl_store;
+    opt->crl_store=crl_store;
+    leave_critical_section(CRIT_CRL);
+    crl_store_release(old_store);
+    verify_cache_flush(opt); /* cached verdicts predate the new CRLs */
+}
+
+    /* the files are loaded with a fingerprint taken before reading them,
+     * so a file modified in the meantime is reloaded with the next check */
+static CRL_STORE *crl_store_new(char *dir_name, unsigned long fingerprint) {
+    CRL_STORE *crl_store;
+    X509_LOOKUP *lookup;
+    DIR *dir;
+    struct dirent *entry;
+    char *name;
+    int num=0, files=0, loaded;
+
+    crl_store=calloc(1, sizeof(CRL_STORE));
+    if(!crl_store) {
+        s_log(LOG_ERR, "CRL: Memory allocation failed");
+        return NULL;
+    }
+    crl_store->store=X509_STORE_new();
+    if(!crl_store->store) {
+        sslerror("X509_STORE_new");
+        free(crl_store);
+        return NULL;
+    }
+    crl_store->refs=1; /* the reference of the service */
+    crl_store->fingerprint=fingerprint;
+
+    /* a temporary file lookup only used to parse the files */
+    lookup=X509_STORE_add_lookup(crl_store->store, X509_LOOKUP_file());
+    if(!lookup) {
+        sslerror("X509_STORE_add_lookup");
+        X509_STORE_free(crl_store->store);
+        free(crl_store);
+        return NULL;
+    }
+    /* a partially loaded directory would accept revoked certificates */
+    dir=opendir(dir_name);
+    if(!dir) {
+        ioerror(dir_name);
+        crl_store_release(crl_store);
+        return NULL;
+    }
+    while((entry=readdir(dir))) {
+        if(!hashed_name(entry->d_name, 1))
+            continue;
+        name=str_printf("%s/%s", dir_name, entry->d_name);
+        if(!name || !(loaded=X509_load_crl_file(lookup, name,
+                X509_FILETYPE_PEM))) {
+            s_log(LOG_ERR, "CRL: Failed to load %s",
+                name ? name : entry->d_name);
+            sslerror("X509_load_crl_file");
+            str_free(name);
+            closedir(dir);
+            crl_store_release(crl_store);
+            return NULL;
+        }
+        ++files;
+        num+=loaded;
+        str_free(name);
+    }
+    closedir(dir);
+    s_log(LOG_INFO, "CRL: Loaded %d CRL(s) from %d file(s) in %s",
+        num, files, dir_name);
+    return crl_store;
+}
+
+static void crl_store_release(CRL_STORE *crl_store) {
+    int refs;
+
+    enter_critical_section(CRIT_CRL);
+    refs=--crl_store->refs;
+    leave_critical_section(CRIT_CRL);
+    if(refs)
+        return;
+    X509_STORE_free(crl_store->store);
+    free(crl_store);
+}
+
+static unsigned long crl_dir_fingerprint(char *dir_name) {
+    unsigned long hash=2166136261UL; /* FNV-1a */
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char *name;
+    unsigned char buff[sizeof(time_t)+sizeof(off_t)];
+    unsigned int i;
+
+    dir=opendir(dir_name);
+    if(!dir)
+        return 0;
+    while((entry=readdir(dir))) {
+        if(!hashed_name(entry->d_name, 1))
+            continue;
+        name=str_printf("%s/%s", dir_name, entry->d_name);
+        if(!name)
+            continue;
+        if(!stat(name, &st)) { /* the target of a c_rehash symlink */
+            memcpy(buff, &st.st_mtime, sizeof(time_t));
+            memcpy(buff+sizeof(time_t), &st.st_size, sizeof(off_t));
+            for(i=0; name[i]; ++i)
+                hash=((hash^(unsigned char)name[i])*16777619UL)&0xffffffffUL;
+            for(i=0; i<sizeof buff; ++i)
+                hash=((hash^buff[i])*16777619UL)&0xffffffffUL;
+        }
+        str_free(name);
+    }
+    closedir(dir);
+    return hash;
+}
+
+#endif /* USE_CRL_STORE */
+
+/**************************************** fingerprint pinning */
+
+int pin_set_load(SERVICE_OPTIONS *section) {
+    PIN_SET *pin_set, *old_set;
+    struct stat st;
+    char *name;
+
+    /* also reloaded by the cron thread after chroot */
+    name=chroot_path(section->pin_file);
+    if(!name) {
+        s_log(LOG_ERR, "PIN: Memory allocation failed");
+        return 0;
+    }
+    if(stat(name, &st)) {
+        ioerror(name);
+        str_free(name);
+        return 0;
+    }
+    pin_set=pin_set_read(name);
+    if(!pin_set) {
+        str_free(name);
+        return 0;
+    }
+    enter_critical_section(CRIT_PIN);
+    old_set=section->pin_set;
+    section->pin_set=pin_set;
+    section->pin_file_mtime=st.st_mtime;
+    leave_critical_section(CRIT_PIN);
+    /* lookups are only performed within CRIT_PIN */
+    if(old_set) {
+        pin_set_free(old_set);
+        verify_cache_flush(section); /* some peers may have been removed */
+    }
+    s_log(LOG_INFO, "Service %s: %lu fingerprint(s) loaded from %s",
+        section->servname, pin_set->num, name);
+    str_free(name);
+    return 1; /* OK */
+}
+
+static PIN_SET *pin_set_read(char *name) {
+    PIN_SET *pin_set;
+    FILE *file;
+    char line[PIN_LINE_MAX];
+    unsigned char fingerprint[PIN_LEN];
+    int line_number=0;
+
+    pin_set=calloc(1, sizeof(PIN_SET));
+    if(!pin_set) {
+        s_log(LOG_ERR, "PIN: Memory allocation failed");
+        return NULL;
+    }
+    file=fopen(name, "r");
+    if(!file) {
+        ioerror(name);
+        free(pin_set);
+        return NULL;
+    }
+    while(fgets(line, sizeof line, file)) {
+        ++line_number;
+        switch(pin_parse(line, fingerprint)) {
+        case 0: /* empty line or comment */
+            continue;
+        case 1:
+            if(pin_set_add(pin_set, fingerprint))
+                continue;
+            s_log(LOG_ERR, "PIN: Memory allocation failed");
+            break;
+        default:
+            s_log(LOG_ERR, "%s:%d: Invalid SHA-256 fingerprint",
+                name, line_number);
+        }
+        fclose(file);
+        pin_set_free(pin_set);
+        return NULL;
+    }
+    fclose(file);
+    return pin_set;
+}
+
+    /* 1 if added or already present, 0 on allocation failure */
+static int pin_set_add(PIN_SET *pin_set, const unsigned char *fingerprint) {
+    PIN_ENTRY *old_slot;
+    unsigned long old_size, h, i;
+
+    if(pin_set_find(pin_set, fingerprint))
+        return 1; /* duplicate */
+    if(2*(pin_set->num+1)>pin_set->size) { /* grow and rehash */
+        old_slot=pin_set->slot;
+        old_size=pin_set->size;
+        pin_set->size=old_size ? 2*old_size : PIN_SET_MIN;
+        pin_set->slot=calloc(pin_set->size, sizeof(PIN_ENTRY));
+        if(!pin_set->slot) {
+            pin_set->slot=old_slot;
+            pin_set->size=old_size;
+            return 0;
+        }
+        pin_set->num=0;
+        for(i=0; i<old_size; ++i)
+            if(old_slot[i].used)
+                pin_set_add(pin_set, old_slot[i].fingerprint);
+        free(old_slot);
+    }
+    /* the fingerprint is already uniformly distributed */
+    h=((unsigned long)fingerprint[0]<<24|(unsigned long)fingerprint[1]<<16|
+        (unsigned long)fingerprint[2]<<8|(unsigned long)fingerprint[3]);
+    for(h&=pin_set->size-1; pin_set->slot[h].used; h=(h+1)&(pin_set->size-1))
+        ;
+    memcpy(pin_set->slot[h].fingerprint, fingerprint, PIN_LEN);
+    pin_set->slot[h].used=1;
+    ++pin_set->num;
+    return 1;
+}
+
+static int pin_set_find(const PIN_SET *pin_set,
+        const unsigned char *fingerprint) {
+    unsigned long h;
+
+    if(!pin_set->size)
+        return 0; /* empty set */
+    h=((unsigned long)fingerprint[0]<<24|(unsigned long)fingerprint[1]<<16|
+        (unsigned long)fingerprint[2]<<8|(unsigned long)fingerprint[3]);
+    for(h&=pin_set->size-1; pin_set->slot[h].used; h=(h+1)&(pin_set->size-1))
+        if(!memcmp(pin_set->slot[h].fingerprint, fingerprint, PIN_LEN))
+            return 1; /* found */
+    return 0; /* not found */
+}
+
+static void pin_set_free(PIN_SET *pin_set) {
+    free(pin_set->slot);
+    free(pin_set);
+}
+
+    /* "AB:CD:..." with an optional "SHA256 Fingerprint=" prefix
+     * returns 1 for a fingerprint, 0 for a comment, -1 on error */
+static int pin_parse(char *line, unsigned char *fingerprint) {
+    char *p;
+    int digits=0, value;
+
+    p=strchr(line, '#');
+    if(p)
+        *p='\0'; /* strip the comment */
+    p=strchr(line, '=');
+    if(p)
+        line=p+1; /* skip the prefix */
+    for(p=line; *p; ++p) {
+        if(*p==':' || isspace((unsigned char)*p))
+            continue;
+        if(*p>='0' && *p<='9')
+            value=*p-'0';
+        else if(*p>='a' && *p<='f')
+            value=*p-'a'+10;
+        else if(*p>='A' && *p<='F')
+            value=*p-'A'+10;
+        else
+            return -1; /* invalid character */
+        if(digits==2*PIN_LEN)
+            return -1; /* too long */
+        if(digits%2)
+            fingerprint[digits/2]|=value;
+        else
+            fingerprint[digits/2]=value<<4;
+        ++digits;
+    }
+    if(!digits)
+        return 0; /* empty line */
+    return digits==2*PIN_LEN ? 1 : -1;
+}
+
 /**************************************** verify callback */
 
 static int verify_callback(int preverify_ok, X509_STORE_CTX *callback_ctx) {
@@ -158,6 +790,8 @@ static int verify_callback(int preverify_ok, X509_STORE_CTX *callback_ctx) {
     SSL *ssl;
     CLI *c;
     char *subject_name;
+    unsigned char key[VERIFY_KEY_LEN];
+    int cacheable;
 
     /* retrieve application specific data */
     ssl=X509_STORE_CTX_get_ex_data(callback_ctx,
@@ -170,6 +804,19 @@ static int verify_callback(int preverify_ok, X509_STORE_CTX *callback_ctx) {
 
     s_log(LOG_DEBUG, "Starting certificate verification: depth=%d, %s",
         callback_ctx->error_depth, subject_name);
+
+    /* only certificates accepted by OpenSSL are looked up and cached */
+    cacheable=c->opt->verify_cache && preverify_ok &&
+        verify_cache_key(callback_ctx, key);
+    /* lowered by the CRL and OCSP checks below */
+    c->verify_expires=time(NULL)+c->opt->verify_cache_ttl;
+    if(cacheable && verify_cache_get(c, key, callback_ctx->error_depth)) {
+        s_log(LOG_NOTICE, "Certificate accepted from cache: depth=%d, %s",
+            callback_ctx->error_depth, subject_name);
+        OPENSSL_free(subject_name);
+        return 1; /* accept connection */
+    }
+
     if(!cert_check(c, callback_ctx, preverify_ok)) {
         s_log(LOG_WARNING, "Certificate check failed: depth=%d, %s",
             callback_ctx->error_depth, subject_name);
@@ -182,19 +829,112 @@ static int verify_callback(int preverify_ok, X509_STORE_CTX *callback_ctx) {
         OPENSSL_free(subject_name);
         return 0; /* reject connection */
     }
-    if(c->opt->option.ocsp && !ocsp_check(c, callback_ctx)) {
+    if((c->opt->option.ocsp || c->opt->option.ocsp_aia) &&
+            !ocsp_check(c, callback_ctx)) {
         s_log(LOG_WARNING, "OCSP check failed: depth=%d, %s",
             callback_ctx->error_depth, subject_name);
         OPENSSL_free(subject_name);
         return 0; /* reject connection */
     }
     /* errnum=X509_STORE_CTX_get_error(ctx); */
+    if(cacheable)
+        verify_cache_put(c, key, callback_ctx->error_depth);
     s_log(LOG_NOTICE, "Certificate accepted: depth=%d, %s",
         callback_ctx->error_depth, subject_name);
     OPENSSL_free(subject_name);
     return 1; /* accept connection */
 }
 
+/**************************************** verify cache */
+
+    /* SHA-256 fingerprint of the current certificate */
+static int verify_cache_key(X509_STORE_CTX *callback_ctx, unsigned char *key) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+
+    if(!X509_digest(callback_ctx->current_cert, EVP_sha256(), md, &md_len) ||
+            md_len!=VERIFY_KEY_LEN) {
+        sslerror("Verify cache: X509_digest");
+        return 0; /* not cached */
+    }
+    memcpy(key, md, VERIFY_KEY_LEN);
+    return 1;
+}
+
+static VERIFY_CACHE_ENTRY *verify_cache_slot(SERVICE_OPTIONS *opt,
+        const unsigned char *key, int depth) {
+    unsigned long hash;
+
+    /* the fingerprint is already uniformly distributed */
+    hash=((unsigned long)key[0]<<24|(unsigned long)key[1]<<16|
+        (unsigned long)key[2]<<8|(unsigned long)key[3])+(unsigned long)depth;
+    return opt->verify_cache->slot+hash%VERIFY_CACHE_SIZE;
+}
+
+    /* 1 if the certificate was accepted within the TTL, 0 otherwise */
+static int verify_cache_get(CLI *c, const unsigned char *key, int depth) {
+    VERIFY_CACHE_ENTRY *entry;
+    int found;
+
+    enter_critical_section(CRIT_VERIFY);
+    entry=verify_cache_slot(c->opt, key, depth);
+    found=entry->expires && time(NULL)<entry->expires &&
+        entry->depth==depth &&
+        entry->generation==c->opt->verify_generation &&
+        !memcmp(entry->key, key, VERIFY_KEY_LEN);
+    if(found)
+        ++c->opt->verify_cache_hits;
+    else
+        ++c->opt->verify_cache_misses;
+    leave_critical_section(CRIT_VERIFY);
+    return found;
+}
+
+static void verify_cache_put(CLI *c, const unsigned char *key, int depth) {
+    VERIFY_CACHE_ENTRY *entry;
+
+    if(c->verify_expires<=time(NULL))
+        return; /* a CRL or an OCSP response is about to expire */
+    enter_critical_section(CRIT_VERIFY);
+    entry=verify_cache_slot(c->opt, key, depth);
+    memcpy(entry->key, key, VERIFY_KEY_LEN);
+    entry->depth=depth;
+    entry->generation=c->opt->verify_generation;
+    entry->expires=c->verify_expires;
+    leave_critical_section(CRIT_VERIFY);
+}
+
+    /* the verdict must not outlive the CRLs and OCSP responses it used */
+static void verify_cache_until(CLI *c, time_t expires) {
+    if(expires<c->verify_expires)
+        c->verify_expires=expires;
+}
+
+static void verify_cache_until_asn1(CLI *c, ASN1_TIME *next_update) {
+#if OPENSSL_VERSION_NUMBER>=0x10002000L
+    int day, sec;
+
+    if(ASN1_TIME_diff(&day, &sec, NULL, next_update)) {
+        verify_cache_until(c, time(NULL)+(time_t)day*86400+sec);
+        return;
+    }
+#endif /* OpenSSL version >= 1.0.2 */
+    /* without ASN1_TIME_diff() it is only known whether it expires
+     * before the verdict, which is then not cached */
+    if(X509_cmp_time(next_update, &c->verify_expires)<0)
+        c->verify_expires=0;
+}
+
+    /* invalidate all the cached verdicts of the service */
+static void verify_cache_flush(SERVICE_OPTIONS *opt) {
+    if(!opt->verify_cache)
+        return;
+    enter_critical_section(CRIT_VERIFY);
+    ++opt->verify_generation;
+    leave_critical_section(CRIT_VERIFY);
+    s_log(LOG_INFO, "Service %s: verify cache flushed", opt->servname);
+}
+
 /**************************************** certificate checking */
 
 static int cert_check(CLI *c, X509_STORE_CTX *callback_ctx, int preverify_ok) {
@@ -211,6 +951,9 @@ static int cert_check(CLI *c, X509_STORE_CTX *callback_ctx, int preverify_ok) {
             X509_verify_cert_error_string(callback_ctx->error));
         return 0; /* reject connection */
     }
+    if(c->opt->verify_use_only_my && callback_ctx->error_depth==0 &&
+            c->opt->pin_file)
+        return pin_check(c, callback_ctx->current_cert);
     if(c->opt->verify_use_only_my && callback_ctx->error_depth==0) {
         if(X509_STORE_get_by_subject(callback_ctx, X509_LU_X509,
                 X509_get_subject_name(callback_ctx->current_cert), &obj)!=1) {
@@ -228,20 +971,40 @@ static int cert_check(CLI *c, X509_STORE_CTX *callback_ctx, int preverify_ok) {
     return 1; /* accept connection */
 }
 
+static int pin_check(CLI *c, X509 *cert) {
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    int found;
+
+    if(!X509_digest(cert, EVP_sha256(), md, &md_len) || md_len!=PIN_LEN) {
+        sslerror("PIN: X509_digest");
+        return 0; /* reject connection */
+    }
+    enter_critical_section(CRIT_PIN);
+    found=pin_set_find(c->opt->pin_set, md);
+    leave_critical_section(CRIT_PIN);
+    if(!found) {
+        s_log(LOG_WARNING, "CERT: Certificate fingerprint not found in %s",
+            c->opt->pin_file);
+        return 0; /* reject connection */
+    }
+    s_log(LOG_INFO, "CERT: Certificate fingerprint found in %s",
+        c->opt->pin_file);
+    return 1; /* accept connection */
+}
+
 /**************************************** CRL checking */
 
 /* based on BSD-style licensed code of mod_ssl */
 static int crl_check(CLI *c, X509_STORE_CTX *callback_ctx) {
-    X509_STORE_CTX store_ctx;
     X509_OBJECT obj;
     X509_NAME *subject;
     X509_NAME *issuer;
     X509 *cert;
     X509_CRL *crl;
-    X509_REVOKED *revoked;
     EVP_PKEY *pubkey;
     long serial;
-    int i, n, rc;
+    int rc;
     char *cp;
     ASN1_TIME *last_update=NULL, *next_update=NULL;
 
@@ -253,9 +1016,7 @@ static int crl_check(CLI *c, X509_STORE_CTX *callback_ctx) {
     /* try to retrieve a CRL corresponding to the _subject_ of
      * the current certificate in order to verify it's integrity */
     memset((char *)&obj, 0, sizeof obj);
-    X509_STORE_CTX_init(&store_ctx, c->opt->revocation_store, NULL, NULL);
-    rc=X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, subject, &obj);
-    X509_STORE_CTX_cleanup(&store_ctx);
+    rc=crl_lookup(c, subject, &obj);
     crl=obj.data.crl;
     if(rc>0 && crl) {
         cp=X509_NAME_oneline(subject, NULL, 0);
@@ -294,96 +1055,461 @@ static int crl_check(CLI *c, X509_STORE_CTX *callback_ctx) {
             X509_OBJECT_free_contents(&obj);
             return 0; /* reject connection */
         }
+        verify_cache_until_asn1(c, next_update);
         X509_OBJECT_free_contents(&obj);
     }
 
     /* try to retrieve a CRL corresponding to the _issuer_ of
      * the current certificate in order to check for revocation */
     memset((char *)&obj, 0, sizeof obj);
-    X509_STORE_CTX_init(&store_ctx, c->opt->revocation_store, NULL, NULL);
-    rc=X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, issuer, &obj);
-    X509_STORE_CTX_cleanup(&store_ctx);
+    rc=crl_lookup(c, issuer, &obj);
     crl=obj.data.crl;
     if(rc>0 && crl) {
         /* check if the current certificate is revoked by this CRL */
-        n=sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl));
-        for(i=0; i<n; i++) {
-            revoked=sk_X509_REVOKED_value(X509_CRL_get_REVOKED(crl), i);
-            if(ASN1_INTEGER_cmp(revoked->serialNumber,
-                    X509_get_serialNumber(cert)) == 0) {
-                serial=ASN1_INTEGER_get(revoked->serialNumber);
-                cp=X509_NAME_oneline(issuer, NULL, 0);
-                s_log(LOG_WARNING, "CRL: Certificate with serial %ld (0x%lX) "
-                    "revoked per CRL from issuer %s", serial, serial, cp);
-                OPENSSL_free(cp);
-                X509_STORE_CTX_set_error(callback_ctx, X509_V_ERR_CERT_REVOKED);
-                X509_OBJECT_free_contents(&obj);
-                return 0; /* reject connection */
-            }
+        if(X509_CRL_get_nextUpdate(crl))
+            verify_cache_until_asn1(c, X509_CRL_get_nextUpdate(crl));
+        if(crl_revoked(c->opt, crl, X509_get_serialNumber(cert))) {
+            serial=ASN1_INTEGER_get(X509_get_serialNumber(cert));
+            cp=X509_NAME_oneline(issuer, NULL, 0);
+            s_log(LOG_WARNING, "CRL: Certificate with serial %ld (0x%lX) "
+                "revoked per CRL from issuer %s", serial, serial, cp);
+            OPENSSL_free(cp);
+            X509_STORE_CTX_set_error(callback_ctx, X509_V_ERR_CERT_REVOKED);
+            X509_OBJECT_free_contents(&obj);
+            return 0; /* reject connection */
         }
         X509_OBJECT_free_contents(&obj);
     }
     return 1; /* accept connection */
 }
 
+    /* CRLpath is searched before the CRLfile/CAfile/CApath store */
+static int crl_lookup(CLI *c, X509_NAME *name, X509_OBJECT *obj) {
+    X509_STORE_CTX store_ctx;
+    int rc=0;
+#ifdef USE_CRL_STORE
+    CRL_STORE *crl_store;
+
+    enter_critical_section(CRIT_CRL);
+    crl_store=c->opt->crl_store;
+    if(crl_store)
+        ++crl_store->refs;
+    leave_critical_section(CRIT_CRL);
+    if(crl_store) { /* the returned object holds a reference to the CRL */
+        X509_STORE_CTX_init(&store_ctx, crl_store->store, NULL, NULL);
+        rc=X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, name, obj);
+        X509_STORE_CTX_cleanup(&store_ctx);
+        crl_store_release(crl_store);
+        if(rc>0)
+            return rc;
+        memset((char *)obj, 0, sizeof(X509_OBJECT));
+    }
+#endif /* USE_CRL_STORE */
+    X509_STORE_CTX_init(&store_ctx, c->opt->revocation_store, NULL, NULL);
+    rc=X509_STORE_get_by_subject(&store_ctx, X509_LU_CRL, name, obj);
+    X509_STORE_CTX_cleanup(&store_ctx);
+    return rc;
+}
+
+    /* look up the serial in a hashed index built on the first use of a CRL */
+static int crl_revoked(SERVICE_OPTIONS *opt, X509_CRL *crl,
+        ASN1_INTEGER *serial) {
+    CRL_CACHE *entry, *new_entry=NULL, **prev, *old=NULL, *tmp;
+    X509_REVOKED *revoked;
+    int i, n, found=0;
+
+    for(;;) {
+        enter_critical_section(CRIT_CRL);
+        for(prev=&opt->crl_cache; *prev; prev=&(*prev)->next)
+            if(CRL_CACHE_MATCH(*prev, crl))
+                break;
+        entry=*prev;
+        if(entry) { /* move to front */
+            *prev=entry->next;
+        } else if(new_entry) { /* not inserted concurrently */
+            entry=new_entry;
+            new_entry=NULL;
+        }
+        if(entry) {
+            entry->next=opt->crl_cache;
+            opt->crl_cache=entry;
+            for(i=1, prev=&entry->next; *prev && i<CRL_CACHE_MAX;
+                    prev=&(*prev)->next, ++i)
+                ;
+            old=*prev; /* detach the least recently used entries */
+            *prev=NULL;
+            found=crl_index_find(entry->index, serial)!=NULL;
+        }
+        leave_critical_section(CRIT_CRL);
+        if(entry || new_entry)
+            break;
+        /* large CRLs are indexed without holding CRIT_CRL */
+        new_entry=crl_cache_new(crl);
+        if(!new_entry)
+            break;
+        n=sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl)); /* -1 if empty */
+        s_log(LOG_DEBUG, "CRL: Indexed %d revoked certificate(s)",
+            n>0 ? n : 0);
+    }
+    if(new_entry) { /* indexed concurrently by another thread */
+        new_entry->next=old;
+        old=new_entry;
+    }
+
+    while(old) {
+        tmp=old;
+        old=old->next;
+        crl_index_free(tmp->index);
+        X509_CRL_free(tmp->crl);
+        free(tmp);
+    }
+    if(entry)
+        return found;
+    /* out of memory: fall back to a linear search */
+    n=sk_X509_REVOKED_num(X509_CRL_get_REVOKED(crl)); /* -1 if empty */
+    for(i=0; i<n; i++) {
+        revoked=sk_X509_REVOKED_value(X509_CRL_get_REVOKED(crl), i);
+        if(!ASN1_INTEGER_cmp(revoked->serialNumber, serial))
+            return 1;
+    }
+    return 0;
+}
+
+static CRL_CACHE *crl_cache_new(X509_CRL *crl) {
+    CRL_CACHE *entry;
+
+    entry=calloc(1, sizeof(CRL_CACHE));
+    if(!entry)
+        return NULL;
+    entry->index=crl_index_new(crl);
+    if(!entry->index) {
+        free(entry);
+        return NULL;
+    }
+#if OPENSSL_VERSION_NUMBER>=0x10100000L
+    X509_CRL_up_ref(crl);
+#else
+    CRYPTO_add(&crl->references, 1, CRYPTO_LOCK_X509_CRL);
+#endif
+    entry->crl=crl;
+    return entry;
+}
+
 /**************************************** OCSP checking */
-/* TODO: check OCSP server specified in the certificate */
 
 static int ocsp_check(CLI *c, X509_STORE_CTX *callback_ctx) {
-    int error, retval=0;
-    SOCKADDR_UNION addr;
     X509 *cert;
     X509 *issuer=NULL;
     OCSP_CERTID *certID;
-    BIO *bio=NULL;
-    OCSP_REQUEST *request=NULL;
-    OCSP_RESPONSE *response=NULL;
-    OCSP_BASICRESP *basicResponse=NULL;
-    ASN1_GENERALIZEDTIME *revoked_at=NULL,
-        *this_update=NULL, *next_update=NULL;
-    int status, reason;
-
-    /* connect specified OCSP server (responder) */
-    c->fd=s_socket(c->opt->ocsp_addr.addr[0].sa.sa_family, SOCK_STREAM, 0,
-        0, "OCSP: socket (auth_user)");
-    if(c->fd<0)
-        return 0; /* reject connection */
-    memcpy(&addr, &c->opt->ocsp_addr.addr[0], sizeof addr);
-    if(connect_blocking(c, &addr, addr_len(addr)))
-        goto cleanup;
-    s_log(LOG_DEBUG, "OCSP: server connected");
+    unsigned char key[OCSP_KEY_MAX], *key_tmp;
+    int key_len, status;
+    OCSP_RESPONDER responder;
+    ASN1_GENERALIZEDTIME *next_update=NULL;
 
     /* get current certificate ID */
     cert=X509_STORE_CTX_get_current_cert(callback_ctx); /* get current cert */
     if(X509_STORE_CTX_get1_issuer(&issuer, callback_ctx, cert)!=1) {
         sslerror("OCSP: X509_STORE_CTX_get1_issuer");
-        goto cleanup;
+        return 0; /* reject connection */
     }
     certID=OCSP_cert_to_id(0, cert, issuer);
+    X509_free(issuer);
     if(!certID) {
         sslerror("OCSP: OCSP_cert_to_id");
+        return 0; /* reject connection */
+    }
+
+    /* the DER-encoded CertID is the cache key */
+    key_len=i2d_OCSP_CERTID(certID, NULL);
+    if(key_len>0 && key_len<=OCSP_KEY_MAX) {
+        key_tmp=key;
+        i2d_OCSP_CERTID(certID, &key_tmp);
+    } else
+        key_len=0; /* not cached */
+    if(key_len) {
+        status=ocsp_cache_get(c, key, key_len);
+        if(status!=OCSP_NOT_CACHED) { /* found */
+            OCSP_CERTID_free(certID);
+            return status!=OCSP_FAILED && status!=V_OCSP_CERTSTATUS_REVOKED;
+        }
+    }
+
+    memset(&responder, 0, sizeof responder);
+    switch(ocsp_responder(c, cert, c->opt->option.ocsp_aia, &responder)) {
+    case 0:
+        s_log(LOG_INFO, "OCSP: No responder URL for the certificate");
+        OCSP_CERTID_free(certID);
+        return 1; /* accept connection */
+    case 1:
+        status=ocsp_request(c, certID, &responder, NULL, &next_update, NULL);
+        break;
+    default:
+        OCSP_CERTID_free(certID);
+        status=OCSP_FAILED;
+    }
+    str_free(responder.host);
+    str_free(responder.path);
+    if(status==V_OCSP_CERTSTATUS_REVOKED) /* may be cached as an issuer */
+        verify_cache_flush(c->opt);
+    if(next_update)
+        verify_cache_until_asn1(c, next_update);
+    else
+        verify_cache_until(c, time(NULL)+OCSP_MAX_AGE);
+    if(key_len)
+        ocsp_cache_put(c, key, key_len, status, next_update);
+    else if(next_update)
+        ASN1_STRING_free(next_update);
+    return status!=OCSP_FAILED && status!=V_OCSP_CERTSTATUS_REVOKED;
+}
+
+    /* 1 if found, 0 if none is available, -1 on error */
+static int ocsp_responder(CLI *c, X509 *cert, int aia,
+        OCSP_RESPONDER *responder) {
+    char *url, *host=NULL, *port=NULL, *path=NULL;
+    int ssl, retval=-1;
+
+    url=aia ? ocsp_aia_url(cert) : NULL;
+    if(!url) { /* use the configured responder */
+        if(!c->opt->option.ocsp)
+            return 0;
+        memcpy(&responder->addr, &c->opt->ocsp_addr.addr[0],
+            sizeof(SOCKADDR_UNION));
+        if(c->opt->ocsp_host)
+            responder->host=str_dup(c->opt->ocsp_host);
+        responder->path=str_dup(c->opt->ocsp_path);
+        return 1;
+    }
+
+    s_log(LOG_DEBUG, "OCSP: Responder URL from the certificate: %s", url);
+    if(!OCSP_parse_url(url, &host, &port, &path, &ssl)) {
+        s_log(LOG_ERR, "OCSP: Failed to parse the responder URL %s", url);
         goto cleanup;
     }
+    if(!ocsp_resolve(c->opt, host, port, &responder->addr))
+        goto cleanup;
+    responder->host=str_dup(host);
+    responder->path=str_dup(path);
+    retval=1;
+cleanup:
+    if(host)
+        OPENSSL_free(host);
+    if(port)
+        OPENSSL_free(port);
+    if(path)
+        OPENSSL_free(path);
+    str_free(url);
+    return retval;
+}
+
+    /* the address of an AIA responder is cached, so that the blocking
+     * resolver is only called on the first use, and then from cron */
+static int ocsp_resolve(SERVICE_OPTIONS *opt, char *host, char *port,
+        SOCKADDR_UNION *addr) {
+    OCSP_RESOLVED_ENTRY *entry=NULL;
+    SOCKADDR_LIST addr_list;
+    time_t now;
+    int found=0;
+
+    time(&now);
+    if(opt->ocsp_cache && strlen(host)<sizeof entry->host &&
+            strlen(port)<sizeof entry->port) {
+        enter_critical_section(CRIT_OCSP);
+        entry=ocsp_resolved_slot(opt, host, port);
+        if(!strcmp(entry->host, host) && !strcmp(entry->port, port) &&
+                now<entry->expires) {
+            memcpy(addr, &entry->addr, sizeof(SOCKADDR_UNION));
+            found=1;
+        }
+        leave_critical_section(CRIT_OCSP);
+    }
+    if(found)
+        return 1;
+
+    memset(&addr_list, 0, sizeof addr_list);
+    handshake_pause(); /* while the name is resolved */
+    found=hostport2addrlist(&addr_list, host, port);
+    handshake_resume();
+    if(!found) {
+        s_log(LOG_ERR, "OCSP: Failed to resolve the responder %s", host);
+        return 0;
+    }
+    memcpy(addr, &addr_list.addr[0], sizeof(SOCKADDR_UNION));
+    if(entry) { /* replace the slot */
+        enter_critical_section(CRIT_OCSP);
+        strcpy(entry->host, host);
+        strcpy(entry->port, port);
+        memcpy(&entry->addr, addr, sizeof(SOCKADDR_UNION));
+        entry->refresh=now+OCSP_RESOLVE_REFRESH;
+        entry->expires=now+OCSP_RESOLVE_TTL;
+        leave_critical_section(CRIT_OCSP);
+    }
+    return 1;
+}
+
+static OCSP_RESOLVED_ENTRY *ocsp_resolved_slot(SERVICE_OPTIONS *opt,
+        char *host, char *port) {
+    unsigned long hash=2166136261UL; /* FNV-1a */
+
+    for(; *host; ++host)
+        hash=((hash^(unsigned char)*host)*16777619UL)&0xffffffffUL;
+    for(; *port; ++port)
+        hash=((hash^(unsigned char)*port)*16777619UL)&0xffffffffUL;
+    return opt->ocsp_cache->resolved+hash%OCSP_RESPONDERS;
+}
+
+    /* called from the cron thread to resolve the responders again
+     * before they expire, so handshakes never wait for the resolver */
+void ocsp_resolve_refresh(SERVICE_OPTIONS *opt, time_t now) {
+    OCSP_RESOLVED_ENTRY *entry;
+    SOCKADDR_LIST addr_list;
+    char host[sizeof entry->host], port[sizeof entry->port];
+    int i, ok;
+
+    for(i=0; i<OCSP_RESPONDERS; ++i) {
+        entry=opt->ocsp_cache->resolved+i;
+        enter_critical_section(CRIT_OCSP);
+        strcpy(host, entry->host);
+        strcpy(port, entry->port);
+        ok=*host && now>=entry->refresh;
+        leave_critical_section(CRIT_OCSP);
+        if(!ok)
+            continue; /* empty or not yet */
+        memset(&addr_list, 0, sizeof addr_list);
+        ok=hostport2addrlist(&addr_list, host, port);
+        if(!ok)
+            s_log(LOG_WARNING,
+                "Service %s: OCSP: Cannot refresh the responder %s",
+                opt->servname, host);
+        enter_critical_section(CRIT_OCSP);
+        if(!strcmp(entry->host, host) && !strcmp(entry->port, port)) {
+            if(ok) {
+                memcpy(&entry->addr, &addr_list.addr[0],
+                    sizeof(SOCKADDR_UNION));
+                entry->refresh=now+OCSP_RESOLVE_REFRESH;
+                entry->expires=now+OCSP_RESOLVE_TTL;
+            } else /* retry until expired */
+                entry->refresh=now+OCSP_NEGATIVE_TTL;
+        } /* otherwise the slot was replaced in the meantime */
+        leave_critical_section(CRIT_OCSP);
+    }
+}
+
+    /* the first http URL of the OCSP responder from the AIA extension */
+static char *ocsp_aia_url(X509 *cert) {
+#if OPENSSL_VERSION_NUMBER>=0x10000000L
+    STACK_OF(OPENSSL_STRING) *aia;
+    char *url=NULL;
+    int i;
+
+    aia=X509_get1_ocsp(cert);
+    if(!aia)
+        return NULL;
+    for(i=0; i<sk_OPENSSL_STRING_num(aia); ++i)
+        if(!strncasecmp(sk_OPENSSL_STRING_value(aia, i), "http://", 7)) {
+            url=str_dup(sk_OPENSSL_STRING_value(aia, i));
+            break;
+        }
+    X509_email_free(aia);
+    return url;
+#else /* OpenSSL version < 1.0.0 */
+    (void)cert; /* skip warning about unused parameter */
+    return NULL;
+#endif /* OpenSSL version >= 1.0.0 */
+}
+
+    /* query the responder, return V_OCSP_CERTSTATUS_* or OCSP_FAILED
+     * the issuer is only known (and trusted) for our own certificate */
+static int ocsp_request(CLI *c, OCSP_CERTID *certID,
+        OCSP_RESPONDER *responder, X509 *issuer,
+        ASN1_GENERALIZEDTIME **next_update_ret,
+        OCSP_RESPONSE **response_ret) {
+    int error, retval=OCSP_FAILED;
+    int sec, msec;
+    STACK_OF(X509) *issuer_certs=NULL;
+    X509_STORE *store=NULL;
+    BIO *bio=NULL;
+    OCSP_REQ_CTX *req_ctx=NULL;
+    OCSP_REQUEST *request=NULL;
+    OCSP_RESPONSE *response=NULL;
+    OCSP_BASICRESP *basicResponse=NULL;
+    ASN1_GENERALIZEDTIME *revoked_at=NULL,
+        *this_update=NULL, *next_update=NULL;
+    int status, reason;
 
     /* build request */
     request=OCSP_REQUEST_new();
     if(!request) {
         sslerror("OCSP: OCSP_REQUEST_new");
-        goto cleanup;
+        OCSP_CERTID_free(certID);
+        return OCSP_FAILED;
     }
     if(!OCSP_request_add0_id(request, certID)) {
         sslerror("OCSP: OCSP_request_add0_id");
-        goto cleanup;
+        OCSP_CERTID_free(certID);
+        OCSP_REQUEST_free(request);
+        return OCSP_FAILED;
     }
-    OCSP_request_add1_nonce(request, 0, -1);
+    if(!issuer) /* most public responders of stapling don't echo a nonce */
+        OCSP_request_add1_nonce(request, 0, -1);
 
-    /* send the request and get a response */
-    /* FIXME: this code won't work with ucontext threading */
-    /* (blocking sockets are used) */
+    /* connect the OCSP server (responder) */
+    handshake_pause(); /* until the response is received */
+    c->fd=s_socket(responder->addr.sa.sa_family, SOCK_STREAM, 0,
+        1, "OCSP: socket (auth_user)");
+    if(c->fd<0) {
+        handshake_resume();
+        OCSP_REQUEST_free(request);
+        return OCSP_FAILED;
+    }
+    if(connect_blocking(c, &responder->addr, addr_len(responder->addr)))
+        goto cleanup;
+    s_log(LOG_DEBUG, "OCSP: server connected");
+
+    /* send the request and get a response without blocking the thread */
     bio=BIO_new_fd(c->fd, BIO_NOCLOSE);
-    response=OCSP_sendreq_bio(bio, c->opt->ocsp_path, request);
+    if(!bio) {
+        sslerror("OCSP: BIO_new_fd");
+        goto cleanup;
+    }
+    req_ctx=OCSP_sendreq_new(bio, responder->path, NULL, -1);
+    if(!req_ctx) {
+        sslerror("OCSP: OCSP_sendreq_new");
+        goto cleanup;
+    }
+    if(responder->host &&
+            !OCSP_REQ_CTX_add1_header(req_ctx, "Host", responder->host)) {
+        sslerror("OCSP: OCSP_REQ_CTX_add1_header");
+        goto cleanup;
+    }
+    if(!OCSP_REQ_CTX_set1_req(req_ctx, request)) {
+        sslerror("OCSP: OCSP_REQ_CTX_set1_req");
+        goto cleanup;
+    }
+#ifdef USE_UCONTEXT
+    /* the msec parameter of s_poll_wait() is ignored with ucontext */
+    sec=(c->opt->ocsp_timeout+999)/1000;
+    msec=0;
+#else
+    sec=c->opt->ocsp_timeout/1000;
+    msec=c->opt->ocsp_timeout%1000;
+#endif
+    while(OCSP_sendreq_nbio(&response, req_ctx)==-1) { /* retry */
+        s_poll_init(&c->fds);
+        s_poll_add(&c->fds, c->fd,
+            BIO_should_read(bio) || !BIO_should_write(bio),
+            BIO_should_write(bio));
+        switch(s_poll_wait(&c->fds, sec, msec)) {
+        case -1:
+            sockerror("OCSP: s_poll_wait");
+            goto cleanup;
+        case 0:
+            s_log(LOG_ERR, "OCSP: s_poll_wait: OCSPtimeout exceeded");
+            goto cleanup;
+        }
+    }
+    handshake_resume();
     if(!response) {
-        sslerror("OCSP: OCSP_sendreq_bio");
+        sslerror("OCSP: OCSP_sendreq_nbio");
         goto cleanup;
     }
     error=OCSP_response_status(response);
@@ -400,12 +1526,35 @@ static int ocsp_check(CLI *c, X509_STORE_CTX *callback_ctx) {
         sslerror("OCSP: OCSP_response_get1_basic");
         goto cleanup;
     }
-    if(OCSP_check_nonce(request, basicResponse)<=0) {
+    if(!issuer && OCSP_check_nonce(request, basicResponse)<=0) {
         sslerror("OCSP: OCSP_check_nonce");
         goto cleanup;
     }
-    if(OCSP_basic_verify(basicResponse, NULL,
-            c->opt->revocation_store, c->opt->ocsp_flags)<=0) {
+    if(issuer) { /* trust our issuer as a signer */
+        issuer_certs=sk_X509_new_null();
+        if(!issuer_certs || !sk_X509_push(issuer_certs, issuer)) {
+            sslerror("OCSP: sk_X509_push");
+            goto cleanup;
+        }
+        /* the issuer is also the trust anchor of a delegated responder */
+        store=X509_STORE_new();
+        if(!store) {
+            sslerror("OCSP: X509_STORE_new");
+            goto cleanup;
+        }
+        if(!X509_STORE_add_cert(store, issuer)) {
+            sslerror("OCSP: X509_STORE_add_cert");
+            goto cleanup;
+        }
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+        X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+#else
+        X509_STORE_set_verify_cb(store, ocsp_issuer_cb);
+#endif
+    } else
+        store=c->opt->revocation_store;
+    if(OCSP_basic_verify(basicResponse, issuer_certs, store,
+            c->opt->ocsp_flags|(issuer ? OCSP_TRUSTOTHER : 0))<=0) {
         sslerror("OCSP: OCSP_basic_verify");
         goto cleanup;
     }
@@ -430,14 +1579,24 @@ static int ocsp_check(CLI *c, X509_STORE_CTX *callback_ctx) {
             s_log(LOG_WARNING, "OCSP: Certificate revoked: %d: %s",
                 reason, OCSP_crl_reason_str(reason));
         log_time(LOG_NOTICE, "OCSP: Revoked at", revoked_at);
-        goto cleanup;
     }
-    retval=1; /* accept connection */
+    retval=status;
+    if(next_update)
+        *next_update_ret=ASN1_STRING_dup(next_update);
+    if(response_ret) { /* pass the response to the caller */
+        *response_ret=response;
+        response=NULL;
+    }
 cleanup:
+    handshake_resume(); /* if the exchange with the responder failed */
+    if(issuer_certs)
+        sk_X509_free(issuer_certs); /* the issuer is owned by the caller */
+    if(store && store!=c->opt->revocation_store)
+        X509_STORE_free(store);
+    if(req_ctx)
+        OCSP_REQ_CTX_free(req_ctx);
     if(bio)
         BIO_free_all(bio);
-    if(issuer)
-        X509_free(issuer);
     if(request)
         OCSP_REQUEST_free(request);
     if(response)
@@ -449,6 +1608,330 @@ cleanup:
     return retval;
 }
 
+#ifndef X509_V_FLAG_PARTIAL_CHAIN
+
+    /* the chain of a delegated responder ends with the issuer, which is
+     * the only certificate of the store, so its own issuer is missing */
+static int ocsp_issuer_cb(int ok, X509_STORE_CTX *ctx) {
+    if(!ok && X509_STORE_CTX_get_error(ctx)==
+            X509_V_ERR_UNABLE_TO_GET_ISSUER_CERT)
+        return 1;
+    return ok;
+}
+
+#endif /* X509_V_FLAG_PARTIAL_CHAIN */
+
+/**************************************** OCSP cache */
+
+static OCSP_CACHE_ENTRY *ocsp_cache_slot(SERVICE_OPTIONS *opt,
+        const unsigned char *key, int key_len) {
+    unsigned long hash=2166136261UL; /* FNV-1a */
+    int i;
+
+    for(i=0; i<key_len; ++i)
+        hash=((hash^key[i])*16777619UL)&0xffffffffUL;
+    return opt->ocsp_cache->slot+hash%OCSP_CACHE_SIZE;
+}
+
+    /* return the cached status or OCSP_NOT_CACHED */
+static int ocsp_cache_get(CLI *c, const unsigned char *key, int key_len) {
+    OCSP_CACHE_ENTRY *entry;
+    time_t now, limit;
+    int status=OCSP_NOT_CACHED;
+
+    time(&now);
+    limit=now+OCSP_MARGIN;
+    enter_critical_section(CRIT_OCSP);
+    entry=ocsp_cache_slot(c->opt, key, key_len);
+    if(entry->key_len==key_len && !memcmp(entry->key, key, key_len) &&
+            now<entry->expires && (!entry->next_update ||
+            X509_cmp_time(entry->next_update, &limit)>0)) {
+        status=entry->status;
+        verify_cache_until(c, entry->expires);
+        if(entry->next_update)
+            verify_cache_until_asn1(c, entry->next_update);
+    }
+    if(status==OCSP_NOT_CACHED)
+        ++c->opt->ocsp_misses;
+    else if(status==OCSP_FAILED)
+        ++c->opt->ocsp_negative_hits;
+    else
+        ++c->opt->ocsp_hits;
+    leave_critical_section(CRIT_OCSP);
+
+    if(status==OCSP_FAILED)
+        s_log(LOG_WARNING, "OCSP: Cached failure of the previous request");
+    else if(status!=OCSP_NOT_CACHED)
+        s_log(LOG_INFO, "OCSP: Cached status: %d: %s",
+            status, OCSP_cert_status_str(status));
+    return status;
+}
+
+    /* takes the ownership of next_update */
+static void ocsp_cache_put(CLI *c, const unsigned char *key, int key_len,
+        int status, ASN1_GENERALIZEDTIME *next_update) {
+    OCSP_CACHE_ENTRY *entry;
+    ASN1_GENERALIZEDTIME *old_next_update;
+
+    enter_critical_section(CRIT_OCSP);
+    entry=ocsp_cache_slot(c->opt, key, key_len);
+    old_next_update=entry->next_update;
+    memcpy(entry->key, key, key_len);
+    entry->key_len=key_len;
+    entry->status=status;
+    entry->expires=time(NULL)+
+        (status==OCSP_FAILED ? OCSP_NEGATIVE_TTL : OCSP_MAX_AGE);
+    entry->next_update=next_update;
+    leave_critical_section(CRIT_OCSP);
+    if(old_next_update)
+        ASN1_STRING_free(old_next_update);
+}
+
+/**************************************** OCSP stapling */
+
+#ifndef OPENSSL_NO_TLSEXT
+
+int ocsp_staple_init(SERVICE_OPTIONS *section) {
+    OCSP_STAPLE *staple;
+    BIO *bio;
+
+    /* never released, as the contexts of reloaded sections */
+    staple=calloc(1, sizeof(OCSP_STAPLE));
+    if(!staple) {
+        s_log(LOG_ERR, "OCSP stapling: Memory allocation failed");
+        return 0;
+    }
+    bio=BIO_new_file(section->cert, "r");
+    if(!bio) {
+        sslerror("OCSP stapling: BIO_new_file");
+        free(staple);
+        return 0;
+    }
+    staple->cert=PEM_read_bio_X509(bio, NULL, NULL, NULL);
+    if(staple->cert)
+        staple->issuer=ocsp_staple_issuer(section, staple->cert, bio);
+    BIO_free(bio);
+    if(!staple->cert) {
+        s_log(LOG_ERR, "OCSP stapling: Cannot read the certificate from %s",
+            section->cert);
+        free(staple);
+        return 0;
+    }
+    if(!staple->issuer) {
+        s_log(LOG_ERR,
+            "OCSP stapling: Issuer certificate not found in %s, CAfile or CApath",
+            section->cert);
+        X509_free(staple->cert);
+        free(staple);
+        return 0;
+    }
+    staple->certID=OCSP_cert_to_id(NULL, staple->cert, staple->issuer);
+    if(!staple->certID) {
+        sslerror("OCSP stapling: OCSP_cert_to_id");
+        X509_free(staple->issuer);
+        X509_free(staple->cert);
+        free(staple);
+        return 0;
+    }
+    section->ocsp_staple=staple;
+
+    SSL_CTX_set_tlsext_status_cb(section->ctx, ocsp_staple_cb);
+    SSL_CTX_set_tlsext_status_arg(section->ctx, section);
+#if !defined(USE_PTHREAD) && !defined(USE_WIN32)
+    /* no cron thread: only fetched on configuration (re)load */
+    ocsp_staple_refresh(section, time(NULL));
+#endif
+    return 1; /* OK */
+}
+
+    /* the issuer follows our certificate in the chain file,
+     * or it can be found in the CAfile/CApath store */
+static X509 *ocsp_staple_issuer(SERVICE_OPTIONS *section, X509 *cert,
+        BIO *bio) {
+    X509 *candidate, *issuer=NULL;
+    X509_STORE_CTX *store_ctx;
+
+    while((candidate=PEM_read_bio_X509(bio, NULL, NULL, NULL))) {
+        if(!issuer && X509_check_issued(candidate, cert)==X509_V_OK)
+            issuer=candidate;
+        else
+            X509_free(candidate);
+    }
+    ERR_clear_error(); /* ignore the end of file */
+    if(issuer || !section->revocation_store)
+        return issuer;
+
+    store_ctx=X509_STORE_CTX_new();
+    if(!store_ctx)
+        return NULL;
+    if(X509_STORE_CTX_init(store_ctx, section->revocation_store, cert, NULL))
+        if(X509_STORE_CTX_get1_issuer(&issuer, store_ctx, cert)!=1)
+            issuer=NULL;
+    X509_STORE_CTX_free(store_ctx);
+    ERR_clear_error();
+    return issuer;
+}
+
+    /* status_request callback: serve the response from memory */
+static int ocsp_staple_cb(SSL *ssl, void *arg) {
+    SERVICE_OPTIONS *opt=arg;
+    OCSP_STAPLE *staple=opt->ocsp_staple;
+    unsigned char *der=NULL;
+    int der_len=0;
+
+    /* the response only covers the first certificate */
+    if(opt->extra_cert_num && X509_cmp(SSL_get_certificate(ssl), staple->cert)) {
+        s_log(LOG_DEBUG, "OCSP stapling: Not the stapled certificate");
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    enter_critical_section(CRIT_OCSP);
+    /* without a cron thread the response is not refreshed before it expires */
+    if(staple->der_len && (!staple->next_update ||
+            X509_cmp_time(staple->next_update, NULL)>0)) {
+        der=OPENSSL_malloc(staple->der_len); /* freed by OpenSSL */
+        if(der) {
+            memcpy(der, staple->der, staple->der_len);
+            der_len=staple->der_len;
+        }
+    }
+    leave_critical_section(CRIT_OCSP);
+    if(!der) {
+        s_log(LOG_INFO, "OCSP stapling: No valid response available");
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    SSL_set_tlsext_status_ocsp_resp(ssl, der, der_len);
+    s_log(LOG_DEBUG, "OCSP stapling: Response sent (%d bytes)", der_len);
+    return SSL_TLSEXT_ERR_OK;
+}
+
+    /* fetch a new response ahead of nextUpdate */
+void ocsp_staple_refresh(SERVICE_OPTIONS *opt, time_t now) {
+    OCSP_STAPLE *staple=opt->ocsp_staple;
+    unsigned char *der;
+    time_t limit;
+
+    if(!staple || now<staple->retry_time)
+        return;
+    limit=now+OCSP_STAPLE_MARGIN;
+    if(staple->der_len && now<staple->refresh_time && (!staple->next_update ||
+            X509_cmp_time(staple->next_update, &limit)>0))
+        return; /* still fresh */
+    staple->retry_time=now+OCSP_STAPLE_RETRY;
+    if(ocsp_staple_fetch(opt, now))
+        return;
+
+    if(!staple->der_len || !staple->next_update ||
+            X509_cmp_time(staple->next_update, &now)>0) {
+        if(staple->der_len)
+            s_log(LOG_WARNING,
+                "Service %s: Keeping the old stapled OCSP response",
+                opt->servname);
+        return;
+    }
+    enter_critical_section(CRIT_OCSP);
+    der=staple->der;
+    staple->der=NULL;
+    staple->der_len=0;
+    leave_critical_section(CRIT_OCSP);
+    free(der);
+    s_log(LOG_WARNING, "Service %s: Stapled OCSP response expired",
+        opt->servname);
+}
+
+static int ocsp_staple_fetch(SERVICE_OPTIONS *opt, time_t now) {
+    OCSP_STAPLE *staple=opt->ocsp_staple;
+    CLI *c;
+    OCSP_RESPONDER responder;
+    OCSP_CERTID *certID;
+    OCSP_RESPONSE *response=NULL;
+    ASN1_GENERALIZEDTIME *next_update=NULL, *old_next_update;
+    unsigned char *der, *der_tmp;
+    int der_len, status=OCSP_FAILED;
+
+    /* ocsp_request() only needs the section and a socket */
+    c=calloc(1, sizeof(CLI));
+    if(!c) {
+        s_log(LOG_ERR, "OCSP stapling: Memory allocation failed");
+        return 0;
+    }
+    c->opt=opt;
+    c->fd=-1;
+    memset(&responder, 0, sizeof responder);
+    switch(ocsp_responder(c, staple->cert, 1, &responder)) {
+    case 0:
+        s_log(LOG_ERR, "OCSP stapling: No responder URL for the certificate");
+        break;
+    case 1:
+        certID=OCSP_CERTID_dup(staple->certID); /* consumed by the request */
+        if(certID)
+            status=ocsp_request(c, certID, &responder, staple->issuer,
+                &next_update, &response);
+        else
+            sslerror("OCSP stapling: OCSP_CERTID_dup");
+        break;
+    }
+    str_free(responder.host);
+    str_free(responder.path);
+    free(c);
+    if(status==OCSP_FAILED)
+        return 0;
+
+    der_len=i2d_OCSP_RESPONSE(response, NULL);
+    der=der_len>0 ? malloc(der_len) : NULL;
+    if(!der) {
+        s_log(LOG_ERR, "OCSP stapling: Failed to encode the response");
+        OCSP_RESPONSE_free(response);
+        if(next_update)
+            ASN1_STRING_free(next_update);
+        return 0;
+    }
+    der_tmp=der;
+    i2d_OCSP_RESPONSE(response, &der_tmp);
+    OCSP_RESPONSE_free(response);
+
+    enter_critical_section(CRIT_OCSP);
+    der_tmp=staple->der;
+    staple->der=der;
+    staple->der_len=der_len;
+    old_next_update=staple->next_update;
+    staple->next_update=next_update;
+    leave_critical_section(CRIT_OCSP);
+    free(der_tmp);
+    if(old_next_update)
+        ASN1_STRING_free(old_next_update);
+    staple->refresh_time=now+OCSP_MAX_AGE;
+    s_log(LOG_NOTICE, "Service %s: Stapled OCSP response updated (%d bytes)",
+        opt->servname, der_len);
+    return 1;
+}
+
+#endif /* OPENSSL_NO_TLSEXT */
+
+#ifndef USE_WIN32
+
+    /* the names used by X509_LOOKUP_hash_dir():
+     * 8 hex digits, ".", "r" for CRLs, and digits */
+static int hashed_name(const char *name, int crl) {
+    int i;
+
+    for(i=0; i<8; ++i)
+        if(!isxdigit((unsigned char)name[i]))
+            return 0;
+    if(name[8]!='.')
+        return 0;
+    i=crl ? 10 : 9;
+    if(crl && name[9]!='r')
+        return 0;
+    if(!name[i])
+        return 0;
+    for(; name[i]; ++i)
+        if(!isdigit((unsigned char)name[i]))
+            return 0;
+    return 1;
+}
+
+#endif /* USE_WIN32 */
+
 static void log_time(const int level, const char *txt, ASN1_TIME *t) {
     char *cp;
     BIO *bio;